@@ -2,6 +2,9 @@
 #include "agif.h"
 #include <gif_lib.h>
 #include "quant.h"
+#include "frames.h"
+#include "gifenc.h"
+#include "parallel.h"
 
 #include <iostream>
 #include <cassert>
@@ -15,6 +18,7 @@
 #include <QMultiMap>
 #include <QPainter>
 #include <QVariant>
+#include <QFile>
 
 typedef QList< QPair<QRgb, int> > QgsColorBox; //Color / number of pixels
 typedef QMultiMap< int, QgsColorBox > QgsColorBoxMap; // sum of pixels / color box
@@ -440,221 +444,224 @@ std::map<QRgb,int> g_nearest;
      return img;
  }
 
-void makeIndexedImage( const QuantizeMethod method, QImage& img, const QVector<QRgb>& current_color_table = QVector<QRgb>() )
+// area of a frame which gets written
+static QRect frameRegion( const QImage& image, const QRect& crop )
 {
-    //img.save("/tmp/out_orig.png", "png", 50);
-    switch (method)
-    {
-    case QuantizeMethod_DIFFUSE:
-    {
-        img = img.convertToFormat(QImage::Format_Indexed8, Qt::DiffuseDither);
-        break;
-    }
-    case QuantizeMethod_THRESHOLD:
-        img = img.convertToFormat(QImage::Format_Indexed8, Qt::ThresholdDither);
-        break;
-    case QuantizeMethod_ORDERED:
-        img = img.convertToFormat(QImage::Format_Indexed8, Qt::OrderedDither);
-        break;        
-    case QuantizeMethod_MEDIANCUT:
-    case QuantizeMethod_MEDIANCUT_FLOYD:
+    return crop.isValid() ? ( crop & image.rect() ) : image.rect();
+}
+
+// one palette for the whole animation, from a histogram merged across
+// all frames. Empty if the quantizer doesn't build palettes.
+static QVector<QRgb> globalPalette( const Quantizer* quantizer, const QuantizeOptions& opts, int sample,
+                                    const FrameStore& store )
+{
+    ColorHistogram hist;
+    for ( int i = 0; i < store.size(); ++i )
     {
-        if ( current_color_table.size() )
+        QImage image = store.at( i );
+        QRect region = frameRegion( image, store.crop( i ) );
+        if ( region == image.rect() )
         {
-            img = img.convertToFormat( QImage::Format_Indexed8, current_color_table );
+            addToHistogram( hist, image, sample );
         }
-        else
+        else if ( region.isValid() )
         {
-            img = quantize_mediancut(img, (method == QuantizeMethod_MEDIANCUT_FLOYD));
-            img = img.convertToFormat( QImage::Format_Indexed8 );
+            addToHistogram( hist, image.copy( region ), sample );
         }
-        break;
-    }
-    default:
-        assert(false); // everything must be handled
-        break;
-    }
-    if ( img.colorCount() != 256 )
-    {
-        //std::cerr << "WARNING: forcing color count (" << img.colorCount() << ") to 256" << std::endl;
-        img.setColorCount( 256 );
     }
+    fitHistogram( hist, MAXCOLORS );
+    return quantizer->palette( hist, opts );
 }
 
-ColorMapObject makeColorMapObject( const QImage& idx8 )
+GifOptions::GifOptions()
+    : optimize(false)
+    , palette_sample(1)
+    , local_palette_threshold(0.0)
+    , lossiness(0)
 {
-    // color table
-    QVector<QRgb> colorTable = idx8.colorTable();
-    ColorMapObject cmap;
-    // numColors must be a power of 2
-    int numColors = 1 << GifBitSize(idx8.colorCount());
-    cmap.ColorCount = numColors;
-    //std::cout << "numColors:" << numColors << std::endl;
-    cmap.BitsPerPixel = idx8.depth();// should always be 8
-    if ( cmap.BitsPerPixel != 8 )
-    {
-        std::cerr << "Incorrect bit depth" << std::endl;
-        return cmap;
-    }
-    GifColorType* colorValues = (GifColorType*)malloc(cmap.ColorCount * sizeof(GifColorType));
-    cmap.Colors = colorValues;
-    int c = 0;
-    for(; c < idx8.colorCount(); ++c)
-    {
-        //std::cout << "color " << c << " has " << qRed(colorTable[c]) << "," <<  qGreen(colorTable[c]) << "," << qBlue(colorTable[c]) << std::endl;
-        colorValues[c].Red = qRed(colorTable[c]);
-        colorValues[c].Green = qGreen(colorTable[c]);
-        colorValues[c].Blue = qBlue(colorTable[c]);
-    }
-    // In case we had an actual number of colors that's not a power of 2,
-    // fill the rest with something (black perhaps).
-    for (; c < numColors; ++c)
-    {
-        colorValues[c].Red = 0;
-        colorValues[c].Green = 0;
-        colorValues[c].Blue = 0;
-    }
-    return cmap;
 }
 
-bool gifWrite ( const QuantizeMethod method, const QVector<QImage> & images, const QVector<int>& delays, 
-                const QVector<QRect>& crops, const QString& filename, bool loop )
+bool gifWrite ( const Quantizer* quantizer, const QuantizeOptions& opts, const GifOptions& gif_opts,
+                const FrameStore& store, QIODevice* out, bool loop )
 {
-    if ( !images.size() )
+    if ( !store.size() )
     {
         return false;
     }
-    if ( images.size() != delays.size() )
+
+    QuantizeOptions palette_opts = opts;
+    if ( gif_opts.optimize )
     {
-        std::cerr << "Internal error: images:delays mismatch" << std::endl;
-        return false;
+        // keep the last index free for unchanged pixels
+        palette_opts.max_colors = qMin( palette_opts.max_colors, 255 );
     }
-    if ( images.size() != crops.size() )
+
+    QVector<QRgb> first_color_table = globalPalette( quantizer, palette_opts, gif_opts.palette_sample, store );
+    QSize screen = store.imageSize( 0 );
+    if ( first_color_table.isEmpty() )
     {
-        std::cerr << "Internal error: images:crops mismatch" << std::endl;
-        return false;
+        // quantizer converts images directly, use the first frame's colors
+        first_color_table = quantizer->quantize( store.at( 0 ), palette_opts ).colorTable();
     }
-
-
-    QImage initial = images.at(0);
-    QImage base_indexed = initial;
-    makeIndexedImage(method, base_indexed);
-
-    QVector<QRgb> first_color_table = base_indexed.colorTable();
-    /*
-    for( QVector<QRgb>::iterator it = first_color_table.begin();
-         it != first_color_table.end();
-         ++it )
+    int transparent = -1;
+    QVector<QRgb> global_color_table = first_color_table;
+    if ( gif_opts.optimize && first_color_table.size() < 256 )
     {
-        QColor c(*it);
-        //std::cout << c.red() << ":" << c.blue() << ":" << c.green() << std::endl;
+        transparent = first_color_table.size();
+        global_color_table.push_back( 0 );
     }
-    std::cout << "first_color_table size:" << first_color_table.size() << std::endl;
-    */
 
-    int error = 0;
-    GifFileType *gif = EGifOpenFileName(filename.toLocal8Bit().constData(), false, &error);
-    if (!gif) return false;
-    EGifSetGifVersion(gif, true);
-
-    // global color map
-    ColorMapObject cmap = makeColorMapObject(base_indexed);
-    if (EGifPutScreenDesc(gif, base_indexed.width(), base_indexed.height(), 8, 0, &cmap) == GIF_ERROR)
+    // what a viewer shows after the previous frame, for optimize
+    QImage canvas;
+    if ( gif_opts.optimize )
     {
-        std::cerr << "EGifPutScreenDesc returned error" << std::endl;
-        return false;
+        canvas = makeCanvas( screen );
     }
-    free(cmap.Colors);
-    
-    if ( loop )
+
+    if ( !gifWriteHeader( out, screen, global_color_table, loop ) )
     {
-        unsigned char nsle[12] = "NETSCAPE2.0";
-        unsigned char subblock[3];
-        int loop_count = 0;
-        subblock[0] = 1;
-        subblock[1] = loop_count % 256;
-        subblock[2] = loop_count / 256;
-        if (EGifPutExtensionLeader(gif, APPLICATION_EXT_FUNC_CODE) == GIF_ERROR
-            || EGifPutExtensionBlock(gif, 11, nsle) == GIF_ERROR
-            || EGifPutExtensionBlock(gif, 3, subblock) == GIF_ERROR
-            || EGifPutExtensionTrailer(gif) == GIF_ERROR) {
-            std::cerr << "Error writing loop extension" << std::endl;
-            return false;
-        }
+        std::cerr << "Error writing gif: " << out->errorString().toLocal8Bit().constData() << std::endl;
+        return false;
     }
 
-    for ( QVector<QImage>::const_iterator it = images.begin(); it != images.end() ; ++it )
+    // quantize and diff in order, since each frame depends on the one
+    // before it. A batch is then LZW compressed across the pool and
+    // written before the next, so only a batch of frames is held.
+    int batch = frameBatch();
+    QVector<GifFrame> frames;
+    for ( int idx = 0; idx < store.size(); ++idx )
     {
+        QImage image = store.at( idx );
+        frames.push_back( GifFrame() );
+        GifFrame& frame = frames.last();
         QImage sub;
 
-        int idx = it-images.begin();
-        const QRect& crop = crops[idx];
+        QRect crop = store.crop( idx );
+        if ( gif_opts.optimize )
+        {
+            QRect region = frameRegion( image, crop ) & canvas.rect();
+            crop = changedRect( canvas, image, region );
+            if ( !crop.isValid() )
+            {
+                // nothing changed, but the delay still needs a frame
+                crop = QRect( region.isValid() ? region.topLeft() : QPoint(0, 0), QSize(1, 1) );
+            }
+        }
         if ( crop.isValid() )
         { 
-            sub = it->copy( crop );
+            sub = image.copy( crop );
+            frame.offset = crop.topLeft();
         }
         else
         {
-            sub = *it;
+            sub = image;
         }
-        makeIndexedImage(method, sub, first_color_table);
+        frame.indexed = quantizer->quantize( sub, opts, first_color_table );
+        frame.transparent = transparent;
 
-        /*
-        QVector<QRgb> sub_color_table = sub.colorTable();
-        for( QVector<QRgb>::iterator it = sub_color_table.begin();
-             it != sub_color_table.end();
-             ++it )
+        // frames too far from the global palette get one of their own
+        if ( gif_opts.local_palette_threshold > 0
+             && paletteError( sub, frame.indexed ) > gif_opts.local_palette_threshold )
         {
-            QColor c(*it);
-            //std::cout << c.red() << ":" << c.blue() << ":" << c.green() << std::endl;
+            frame.indexed = quantizer->quantize( sub, palette_opts );
+            frame.local_palette = true;
+            if ( gif_opts.optimize )
+            {
+                frame.transparent = frame.indexed.colorCount() < 256 ? frame.indexed.colorCount() : -1;
+            }
         }
-        std::cout << "sub_color_table size:" << sub_color_table.size() << std::endl;
 
-        if ( sub_color_table != first_color_table )
+        if ( gif_opts.optimize )
         {
-            std::cerr << "WARNING: sub_color_table table does NOT match first_color_table!" << std::endl;
+            if ( frame.transparent >= 0 )
+            {
+                maskUnchanged( frame.indexed, frame.offset, canvas, image, frame.transparent );
+            }
+            drawFrame( canvas, image, crop );
         }
-        */
-
-
-        // animation delay
-        int msec_delay = delays.at( idx );
-        static unsigned char ExtStr[4] = { 0x04, 0x00, 0x00, 0xff };
-        ExtStr[0] = (false) ? 0x06 : 0x04;
-        ExtStr[1] = msec_delay % 256;
-        ExtStr[2] = msec_delay / 256;
-        EGifPutExtension(gif, GRAPHICS_EXT_FUNC_CODE, 4, ExtStr);
-
-        // local color map
-        ColorMapObject lcmap = makeColorMapObject(sub);
+        // gif counts centiseconds, rounded and at least one since
+        // browsers play 0 as fast as they like
+        frame.delay = qMin( 65535, qMax( 1, ( store.delay( idx ) + 5 ) / 10 ) );
 
-        // local image description
-        int local_x = 0;
-        int local_y = 0;
-        int local_w = sub.width();
-        int local_h = sub.height();
-        if ( crop.isValid() )
+        if ( frames.size() < batch && idx + 1 < store.size() )
         {
-            local_x = crop.x();
-            local_y = crop.y();
+            continue;
         }
-        if (EGifPutImageDesc(gif, local_x, local_y, local_w, local_h, 0, &lcmap) == GIF_ERROR)
+        gifEncodeFrames( frames, global_color_table.size(), gif_opts.lossiness );
+        if ( !gifWriteFrames( out, frames ) )
         {
-            std::cerr << "EGifPutImageDesc returned error" << std::endl;
+            std::cerr << "Error writing gif: " << out->errorString().toLocal8Bit().constData() << std::endl;
+            return false;
         }
-        free(lcmap.Colors);
+        frames.clear();
+    }
+    if ( !gifWriteTrailer( out ) )
+    {
+        std::cerr << "Error writing gif: " << out->errorString().toLocal8Bit().constData() << std::endl;
+        return false;
+    }
+    return true;
+}
 
-        int lc = sub.height();
-        for (int l = 0; l < lc; ++l)
+bool gifWrite ( const Quantizer* quantizer, const QuantizeOptions& opts, const GifOptions& gif_opts,
+                const FrameStore& store, const QString& filename, bool loop )
+{
+    QFile file( filename );
+    if ( !file.open( QIODevice::WriteOnly | QIODevice::Truncate ) )
+    {
+        std::cerr << "Unable to open gif: " << filename.toLocal8Bit().constData() << std::endl;
+        return false;
+    }
+    return gifWrite( quantizer, opts, gif_opts, store, &file, loop );
+}
+
+int gifCheck( const QString& filename )
+{
+    int error = 0;
+    GifFileType* gif = DGifOpenFileName( filename.toLocal8Bit().constData(), &error );
+    if ( !gif )
+    {
+        std::cerr << "Unable to open " << filename.toLocal8Bit().constData() << ": " << GifErrorString( error ) << std::endl;
+        return 1;
+    }
+    if ( DGifSlurp( gif ) == GIF_ERROR )
+    {
+        std::cerr << "Unable to decode " << filename.toLocal8Bit().constData() << ": " << GifErrorString( gif->Error ) << std::endl;
+        DGifCloseFile( gif );
+        return 1;
+    }
+    int result = 0;
+    std::cout << filename.toLocal8Bit().constData() << ": " << gif->SWidth << "x" << gif->SHeight
+              << " frames: " << gif->ImageCount << std::endl;
+    std::cout << "delays:";
+    for ( int i = 0; i < gif->ImageCount; ++i )
+    {
+        GraphicsControlBlock gcb;
+        gcb.DelayTime = 0;
+        DGifSavedExtensionToGCB( gif, i, &gcb );
+        std::cout << " " << gcb.DelayTime;
+    }
+    std::cout << std::endl;
+    for ( int i = 0; i < gif->ImageCount; ++i )
+    {
+        const GifImageDesc& desc = gif->SavedImages[i].ImageDesc;
+        GraphicsControlBlock gcb;
+        gcb.TransparentColor = NO_TRANSPARENT_COLOR;
+        DGifSavedExtensionToGCB( gif, i, &gcb );
+        std::cout << "frame " << i << ": " << desc.Width << "x" << desc.Height << "+" << desc.Left << "+" << desc.Top
+                  << ( gcb.TransparentColor != NO_TRANSPARENT_COLOR ? " transparent" : "" )
+                  << ( desc.ColorMap ? " local palette" : "" ) << std::endl;
+        if ( desc.Left + desc.Width > gif->SWidth || desc.Top + desc.Height > gif->SHeight )
         {
-            uchar* line = sub.scanLine(l);
-            if (EGifPutLine(gif, (GifPixelType*)line, local_w) == GIF_ERROR)
-            {
-                std::cerr << "EGifPutLine returned error: " <<  gif->Error << std::endl;
-            }
+            std::cerr << "Frame " << i << " outside of the screen" << std::endl;
+            result = 1;
+        }
+        if ( !desc.ColorMap && !gif->SColorMap )
+        {
+            std::cerr << "Frame " << i << " has no color map" << std::endl;
+            result = 1;
         }
     }
-    EGifCloseFile(gif);
-    return true;
+    DGifCloseFile( gif );
+    return result;
 }
-
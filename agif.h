@@ -4,8 +4,25 @@
 #include <QVector>
 #include <QImage>
 #include "quant.h"
+#include "framestore.h"
 
-bool gifWrite ( const QuantizeMethod method, const QVector<QImage> & images, const QVector<int>& delays, 
-                const QVector< QRect >& crops, const QString& filename, bool loop = false );
+class QIODevice;
+
+struct GifOptions
+{
+    GifOptions();
+    bool optimize;                  // only write what changed since the previous frame
+    int palette_sample;             // histogram every n'th row for the global palette
+    double local_palette_threshold; // error above which a frame gets its own palette, 0 never
+    int lossiness;                  // RGB distance the LZW encoder may shift pixels by, 0 lossless
+};
+
+bool gifWrite ( const Quantizer* quantizer, const QuantizeOptions& opts, const GifOptions& gif_opts,
+                const FrameStore& frames, const QString& filename, bool loop = false );
+bool gifWrite ( const Quantizer* quantizer, const QuantizeOptions& opts, const GifOptions& gif_opts,
+                const FrameStore& frames, QIODevice* out, bool loop = false );
+
+// decode filename with giflib and sanity check it, 0 if it's valid
+int gifCheck( const QString& filename );
 
 #endif
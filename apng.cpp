@@ -0,0 +1,136 @@
+#include "apng.h"
+#include "frames.h"
+#include "parallel.h"
+#include "pngchunk.h"
+#include <QIODevice>
+#include <QByteArray>
+
+// filtered RGBA scanlines of image
+static QByteArray filterImage( const QImage& image )
+{
+    int stride = image.width() * 4;
+    QByteArray filtered;
+    filtered.reserve( ( stride + 1 ) * image.height() );
+    QByteArray prev( stride, 0 );
+    QByteArray cur( stride, 0 );
+    for ( int y = 0; y < image.height(); ++y )
+    {
+        pngRowBytes( image, y, true, (uchar*)cur.data() );
+        pngFilterRow( (const uchar*)cur.constData(), (const uchar*)prev.constData(), stride, 4, filtered );
+        qSwap( prev, cur );
+    }
+    return filtered;
+}
+
+class DeflateTask : public ParallelTask
+{
+public:
+    DeflateTask( const QVector<AnimFrame>& f, QByteArray* d, int l )
+        : frames(f), data(d), level(l)
+    {
+    }
+    void run( int index )
+    {
+        // qCompress is a zlib stream behind a 4 byte length, which is
+        // exactly what IDAT/fdAT hold
+        data[index] = qCompress( filterImage( frames[index].image ), level ).mid( 4 );
+    }
+private:
+    const QVector<AnimFrame>& frames;
+    QByteArray* data;
+    int level;
+};
+
+static QByteArray frameControl( int sequence, const AnimFrame& frame )
+{
+    QByteArray fctl;
+    pngPutLong( fctl, sequence );
+    pngPutLong( fctl, frame.image.width() );
+    pngPutLong( fctl, frame.image.height() );
+    pngPutLong( fctl, frame.offset.x() );
+    pngPutLong( fctl, frame.offset.y() );
+    if ( frame.delay <= 65535 )
+    {
+        pngPutShort( fctl, frame.delay ); // delay in milliseconds
+        pngPutShort( fctl, 1000 );
+    }
+    else
+    {
+        pngPutShort( fctl, qMin( ( frame.delay + 5 ) / 10, 65535 ) ); // in centiseconds when too long
+        pngPutShort( fctl, 100 );
+    }
+    fctl.append( (char)0 );                          // dispose: none
+    fctl.append( (char)( frame.blend ? 1 : 0 ) );    // blend: over or source
+    return fctl;
+}
+
+bool apngWrite( const FrameStore& store, QIODevice* out, int quality, bool loop )
+{
+    if ( store.isEmpty() )
+    {
+        return false;
+    }
+    if ( out->write( PNG_SIGNATURE, 8 ) != 8 )
+    {
+        return false;
+    }
+    QByteArray actl;
+    pngPutLong( actl, store.size() );
+    pngPutLong( actl, loop ? 0 : 1 ); // plays, 0 is forever
+    if ( !pngWriteChunk( out, "IHDR", pngHeader( store.imageSize( 0 ), true ) )
+         || !pngWriteChunk( out, "acTL", actl ) )
+    {
+        return false;
+    }
+
+    // diff a batch of frames, deflate it across the pool and write it
+    // out before the next, so only a batch is held at once. Sequence
+    // numbers are shared by fcTL and fdAT chunks. The first frame is
+    // the default image, so it goes in IDAT.
+    FrameDiffer differ( store );
+    int batch = frameBatch();
+    QVector<AnimFrame> frames;
+    QVector<QByteArray> data;
+    int sequence = 0;
+    for ( ;; )
+    {
+        frames.clear();
+        AnimFrame frame;
+        while ( frames.size() < batch && differ.next( frame ) )
+        {
+            frames.push_back( frame );
+        }
+        if ( frames.isEmpty() )
+        {
+            break;
+        }
+        data.fill( QByteArray(), frames.size() );
+        DeflateTask task( frames, data.data(), pngLevel( quality ) );
+        parallelRun( task, frames.size() );
+        for ( int i = 0; i < frames.size(); ++i )
+        {
+            bool first = sequence == 0;
+            if ( !pngWriteChunk( out, "fcTL", frameControl( sequence++, frames[i] ) ) )
+            {
+                return false;
+            }
+            if ( first )
+            {
+                if ( !pngWriteChunk( out, "IDAT", data[i] ) )
+                {
+                    return false;
+                }
+                continue;
+            }
+            QByteArray fdat;
+            fdat.reserve( data[i].size() + 4 );
+            pngPutLong( fdat, sequence++ );
+            fdat.append( data[i] );
+            if ( !pngWriteChunk( out, "fdAT", fdat ) )
+            {
+                return false;
+            }
+        }
+    }
+    return pngWriteChunk( out, "IEND", QByteArray() );
+}
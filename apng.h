@@ -0,0 +1,13 @@
+#ifndef APNG_H
+#define APNG_H
+
+#include "framestore.h"
+
+class QIODevice;
+
+// Animated PNG. Frames after the first only carry the area which
+// changed; quality maps to the deflate level the way Qt's png writer
+// does it.
+bool apngWrite( const FrameStore& frames, QIODevice* out, int quality, bool loop = false );
+
+#endif
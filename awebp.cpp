@@ -0,0 +1,153 @@
+#include "awebp.h"
+#include "frames.h"
+#include "parallel.h"
+#include <QIODevice>
+#include <QByteArray>
+#include <webp/encode.h>
+#include <webp/mux.h>
+#include <cstdlib>
+
+// libwebp wants R,G,B,A bytes, QRgb is a native endian integer
+static QByteArray rgbaBytes( const QImage& image )
+{
+    QByteArray rgba( image.width() * image.height() * 4, 0 );
+    uchar* out = (uchar*)rgba.data();
+    for ( int y = 0; y < image.height(); ++y )
+    {
+        const QRgb* line = (const QRgb*)image.scanLine( y );
+        for ( int x = 0; x < image.width(); ++x )
+        {
+            *out++ = qRed( line[x] );
+            *out++ = qGreen( line[x] );
+            *out++ = qBlue( line[x] );
+            *out++ = qAlpha( line[x] );
+        }
+    }
+    return rgba;
+}
+
+static QByteArray encodeImage( const QImage& image, int quality )
+{
+    QImage argb = image.convertToFormat( QImage::Format_ARGB32 );
+    QByteArray rgba = rgbaBytes( argb );
+    uint8_t* data = 0;
+    size_t size;
+    if ( quality >= 100 )
+    {
+        size = WebPEncodeLosslessRGBA( (const uint8_t*)rgba.constData(), argb.width(), argb.height(),
+                                       argb.width() * 4, &data );
+    }
+    else
+    {
+        size = WebPEncodeRGBA( (const uint8_t*)rgba.constData(), argb.width(), argb.height(),
+                               argb.width() * 4, quality < 0 ? 75 : quality, &data );
+    }
+    QByteArray encoded;
+    if ( size && data )
+    {
+        encoded = QByteArray( (const char*)data, size );
+    }
+    free( data );
+    return encoded;
+}
+
+class EncodeTask : public ParallelTask
+{
+public:
+    EncodeTask( const QVector<AnimFrame>& f, QByteArray* d, int q )
+        : frames(f), data(d), quality(q)
+    {
+    }
+    void run( int index )
+    {
+        data[index] = encodeImage( frames[index].image, quality );
+    }
+private:
+    const QVector<AnimFrame>& frames;
+    QByteArray* data;
+    int quality;
+};
+
+bool webpWriteImage( const QImage& image, QIODevice* out, int quality )
+{
+    QByteArray encoded = encodeImage( image, quality );
+    return !encoded.isEmpty() && out->write( encoded ) == encoded.size();
+}
+
+bool webpWrite( const FrameStore& store, QIODevice* out, int quality, bool loop )
+{
+    if ( store.isEmpty() )
+    {
+        return false;
+    }
+    if ( store.size() == 1 )
+    {
+        return webpWriteImage( store.at( 0 ), out, quality );
+    }
+
+    WebPMux* mux = WebPMuxNew();
+    if ( !mux )
+    {
+        return false;
+    }
+    WebPMuxAnimParams params;
+    params.bgcolor = 0;
+    params.loop_count = loop ? 0 : 1; // 0 is forever
+    bool ok = WebPMuxSetAnimationParams( mux, &params ) == WEBP_MUX_OK;
+
+    // diff and encode a batch of frames at a time, the mux copies each
+    // encoded frame so only the batch's images are held. The RIFF header
+    // needs the total size, so the file is assembled once at the end.
+    // webp frame offsets are stored halved, so they have to be even.
+    FrameDiffer differ( store, 2 );
+    int batch = frameBatch();
+    QVector<AnimFrame> frames;
+    QVector<QByteArray> data;
+    while ( ok )
+    {
+        frames.clear();
+        AnimFrame frame;
+        while ( frames.size() < batch && differ.next( frame ) )
+        {
+            frames.push_back( frame );
+        }
+        if ( frames.isEmpty() )
+        {
+            break;
+        }
+        data.fill( QByteArray(), frames.size() );
+        EncodeTask task( frames, data.data(), quality );
+        parallelRun( task, frames.size() );
+        for ( int i = 0; i < frames.size() && ok; ++i )
+        {
+            if ( data[i].isEmpty() )
+            {
+                ok = false;
+                break;
+            }
+            WebPMuxFrameInfo info;
+            info.bitstream.bytes = (const uint8_t*)data[i].constData();
+            info.bitstream.size = data[i].size();
+            info.id = WEBP_CHUNK_ANMF;
+            info.x_offset = frames[i].offset.x();
+            info.y_offset = frames[i].offset.y();
+            info.duration = frames[i].delay; // milliseconds
+            info.dispose_method = WEBP_MUX_DISPOSE_NONE;
+            info.blend_method = frames[i].blend ? WEBP_MUX_BLEND : WEBP_MUX_NO_BLEND;
+            ok = WebPMuxPushFrame( mux, &info, 1 ) == WEBP_MUX_OK;
+        }
+    }
+    WebPData assembled;
+    WebPDataInit( &assembled );
+    if ( ok )
+    {
+        ok = WebPMuxAssemble( mux, &assembled ) == WEBP_MUX_OK;
+    }
+    if ( ok )
+    {
+        ok = out->write( (const char*)assembled.bytes, assembled.size ) == (qint64)assembled.size;
+    }
+    WebPDataClear( &assembled );
+    WebPMuxDelete( mux );
+    return ok;
+}
@@ -0,0 +1,16 @@
+#ifndef AWEBP_H
+#define AWEBP_H
+
+#include <QImage>
+#include "framestore.h"
+
+class QIODevice;
+
+// WebP through libwebp, quality 100 is lossless
+bool webpWriteImage( const QImage& image, QIODevice* out, int quality );
+
+// animated, unless there's only one frame. Frames after the first only
+// carry the area which changed.
+bool webpWrite( const FrameStore& frames, QIODevice* out, int quality, bool loop = false );
+
+#endif
@@ -1,15 +1,28 @@
 #include "conv.h"
 #include "agif.h"
+#include "apng.h"
+#include "awebp.h"
+#include "frames.h"
+#include "still.h"
+#include "strip.h"
+#include "sprite.h"
+#include "resample.h"
+#include "trim.h"
+#include "parallel.h"
+#include "vtime.h"
+#include "writer.h"
 #include <QApplication>
 #include <QPainter>
 #include <QFile>
 #include <QFileInfo>
+#include <QScopedPointer>
 #include <QWebPage>
 #include <QWebFrame>
 #include <QWebElement>
 #include <QDateTime>
 #include <iostream>
 #include <algorithm> 
+#include <cmath>
 #include <time.h>
 
 // overload to allow QString output
@@ -22,6 +35,8 @@ std::ostream& operator<<(std::ostream& str, const QString& string)
 Converter::Converter(const Engine* engine, const Settings & s)
     : settings(s)
     , activePage(0)
+    , last_hash(0)
+    , merged_frames(0)
 {
     // engine communication to and fro
     connect(engine, SIGNAL(javascriptEnvironment(QWebPage*)), this, SLOT(slotJavascriptEnvironment(QWebPage*)));
@@ -62,32 +77,133 @@ void Converter::setLooping( bool l )
 
 void Converter::setQuantizeMethod( const QString& method )
 {
-    if ( method == "DIFFUSE" )
+    const Quantizer* quantizer = findQuantizer( method );
+    if ( quantizer )
     {
-        settings.quantize_method = QuantizeMethod_DIFFUSE;
+        settings.quantizer = quantizer;
     }
-    if ( method == "THRESHOLD" )
+    else
     {
-        settings.quantize_method = QuantizeMethod_THRESHOLD;
+        warningvec.push_back( QString("Unknown quantize method: %1").arg(method) );
     }
-    if ( method == "ORDERED" )
+}
+
+void Converter::setQuantizeKmeans( int iterations )
+{
+    settings.quantize_options.kmeans_iterations = iterations;
+}
+
+void Converter::setGifOptimize( bool o )
+{
+    settings.gif_options.optimize = o;
+}
+
+void Converter::setGifPaletteSample( int rows )
+{
+    settings.gif_options.palette_sample = rows;
+}
+
+void Converter::setGifLocalPaletteThreshold( double error )
+{
+    settings.gif_options.local_palette_threshold = error;
+}
+
+void Converter::setGifLossiness( int lossiness )
+{
+    settings.gif_options.lossiness = lossiness;
+}
+
+void Converter::setPng8Auto( bool a )
+{
+    settings.png8_auto = a;
+}
+
+void Converter::setAutoMaxBytes( int bytes )
+{
+    settings.auto_options.max_bytes = bytes;
+}
+
+void Converter::setAutoMinQuality( int q )
+{
+    settings.auto_options.min_quality = q;
+}
+
+void Converter::setStream( bool s )
+{
+    settings.stream = s;
+}
+
+void Converter::setScale( double s )
+{
+    settings.scale = s;
+}
+
+void Converter::setMaxSize( int w, int h )
+{
+    settings.max_width = w;
+    settings.max_height = h;
+}
+
+void Converter::setDeviceScaleFactor( double f )
+{
+    settings.device_scale_factor = f > 0 ? f : 1.0;
+}
+
+void Converter::setAutotrim( bool trim, int tolerance )
+{
+    settings.autotrim = trim;
+    settings.autotrim_tolerance = tolerance;
+}
+
+double Converter::advanceTime( int msec )
+{
+    QWebFrame* frame = activePage->mainFrame();
+    if ( !hasVirtualTime( frame ) )
     {
-        settings.quantize_method = QuantizeMethod_ORDERED;
+        // timers the page set up while loading keep using the real clock
+        warningvec.push_back( "virtual time installed after load, set virtual_time in the request" );
+        installVirtualTime( frame );
     }
-    if ( method == "MEDIANCUT" )
+    return advanceVirtualTime( frame, msec );
+}
+
+void Converter::captureTimeline( int fps, int duration_ms )
+{
+    if ( fps <= 0 || duration_ms < 0 )
     {
-        settings.quantize_method = QuantizeMethod_MEDIANCUT;
+        QString err = QString("Invalid timeline: %1 fps for %2 ms").arg(fps).arg(duration_ms);
+        errorvec.push_back( err );
+        std::cerr << err << std::endl;
+        return;
     }
-    if ( method == "MEDIANCUT_FLOYD" )
+    int count = qMax( 1, (int)( (qint64)duration_ms * fps / 1000 ) );
+    QRect invalid;
+    advanceTime( 0 ); // pins css animations before the first frame
+    int at = 0; // ms of the frame being captured, rounded so they add up
+    for ( int i = 0; i < count; ++i )
     {
-        settings.quantize_method = QuantizeMethod_MEDIANCUT_FLOYD;
+        int next = (int)( (qint64)( i + 1 ) * 1000 / fps );
+        internalSnapshot( next - at, invalid );
+        if ( i + 1 < count )
+        {
+            advanceTime( next - at );
+        }
+        at = next;
+    }
+    if ( settings.convert_verbosity )
+    {
+        std::cout << "convert: captured " << count << " frames at " << fps << " fps" << std::endl;
     }
 }
 
 void Converter::slotJavascriptEnvironment(QWebPage* page)
 {
-    images.clear();
-    delays.clear();
+    frames.clear();
+    last_hash = 0;
+    merged_frames = 0;
+    snapshot_area = QRect();
+    write_refs.clear();
+    trim_rect = QRect();
     warningvec.clear();
     errorvec.clear();
 
@@ -117,21 +233,17 @@ void Converter::slotJavascriptError(QString s )
 
 void Converter::snapshotElements( const QStringList& ids, int msec_delay )
 {
-    if ( !crops.size() )
+    if ( frames.isEmpty() )
     {
         snapshotPage( msec_delay );
         return;
     }
-    QWebFrame* frame = activePage->mainFrame();
     // calculate largest rect encompassing all elements
     QRect crop_rect;
-    for( QStringList::const_iterator it = ids.begin();
-         it != ids.end();
-         ++it )
+    QVector<QRect> rects = elementRects( ids );
+    for ( int i = 0; i < rects.size(); ++i )
     {
-        QMap<QString,QVariant> crop = frame->evaluateJavaScript( QString("document.getElementById('%1').getBoundingClientRect()").arg(*it) ).toMap();    
-        QRect r = QRect( crop["left"].toInt(), crop["top"].toInt(),
-                         crop["width"].toInt()+1, crop["height"].toInt() );
+        QRect r = rects[i];
         if ( r.isValid() )
         {
             r.adjust( -1 * (std::min(15,r.x())), -1 * (std::min(15,r.y())), 15, 15 ); // padding to account for possible font overflow
@@ -149,6 +261,85 @@ void Converter::snapshotElements( const QStringList& ids, int msec_delay )
 }
 
 
+// encode a single image in settings.fmt, resolving format=auto into fmt
+static bool encodeStill( const Settings& settings, const QImage& image, QIODevice* out, QString& fmt )
+{
+    fmt = settings.fmt;
+    if ( fmt == "gif" )
+    {
+        FrameStore single;
+        single.append( image, 0, QRect() );
+        return gifWrite( settings.quantizer, settings.quantize_options, settings.gif_options, single, out );
+    }
+    if ( fmt == "auto" )
+    {
+        QByteArray encoded;
+        return autoWrite( image, settings.quality, settings.quantizer, settings.quantize_options,
+                          settings.auto_options, encoded, fmt )
+            && out->write( encoded ) == encoded.size();
+    }
+    return stillWrite( image, fmt, settings.quality, settings.quantizer, settings.quantize_options,
+                       settings.png8_auto, out );
+}
+
+// quoted javascript string literal of s
+static QString jsString( const QString& s )
+{
+    QString out = "'";
+    for ( int i = 0; i < s.length(); ++i )
+    {
+        ushort c = s[i].unicode();
+        if ( c == '\\' || c == '\'' )
+        {
+            out += '\\';
+            out += s[i];
+        }
+        else if ( c < 0x20 || c == 0x2028 || c == 0x2029 )
+        {
+            out += QString("\\u%1").arg( c, 4, 16, QChar('0') );
+        }
+        else
+        {
+            out += s[i];
+        }
+    }
+    return out + "'";
+}
+
+// bounding rects of elements by id, or css selector when no element has
+// that id, measured in one evaluation so layout is only flushed once.
+// Elements which aren't found get an invalid rect.
+QVector<QRect> Converter::elementRects( const QStringList& ids )
+{
+    QString list;
+    for ( int i = 0; i < ids.size(); ++i )
+    {
+        list += ( i ? "," : "" ) + jsString( ids[i] );
+    }
+    QString script = QString(
+        "(function(ids) {"
+        "  var out = [];"
+        "  for ( var i = 0; i < ids.length; ++i ) {"
+        "    var el = document.getElementById( ids[i] );"
+        "    if ( !el ) { try { el = document.querySelector( ids[i] ); } catch ( e ) {} }"
+        "    var r = el ? el.getBoundingClientRect() : null;"
+        "    out.push( r ? [ r.left, r.top, r.width, r.height ] : [] );"
+        "  }"
+        "  return out;"
+        "})([%1])" ).arg( list );
+    QVariantList measured = activePage->mainFrame()->evaluateJavaScript( script ).toList();
+    QVector<QRect> rects( ids.size() );
+    for ( int i = 0; i < measured.size() && i < rects.size(); ++i )
+    {
+        QVariantList r = measured[i].toList();
+        if ( r.size() == 4 )
+        {
+            rects[i] = QRect( r[0].toInt(), r[1].toInt(), r[2].toInt() + 1, r[3].toInt() );
+        }
+    }
+    return rects;
+}
+
 void Converter::snapshotPage(int msec_delay)
 {
     QRect invalid;
@@ -156,6 +347,56 @@ void Converter::snapshotPage(int msec_delay)
 }
 
 void Converter::internalSnapshot( int msec_delay, const QRect& crop )
+{
+    QRect rect = layoutPage();
+    if ( streaming() )
+    {
+        // rendered strip by strip in saveToOutput, where it's written
+        frames.append( QImage(), msec_delay, crop );
+        stream_rect = rect;
+        last_hash = 0;
+        snapshot_area = QRect();
+    }
+    else
+    {
+        // scaled up, a still image only paints what it keeps, so a 2x
+        // element costs 4x its own pixels rather than the whole page's
+        QRect area = rect;
+        bool still = settings.fmt != "gif" && settings.fmt != "apng" && settings.fmt != "webp";
+        if ( settings.device_scale_factor != 1.0 && still
+             && settings.selectors.isEmpty() && settings.widths.isEmpty() )
+        {
+            QRect r = outputRect( rect );
+            if ( r.isValid() )
+            {
+                area = r;
+            }
+        }
+        QImage image = renderRect( area );
+        QRect image_crop = deviceRect( crop.translated( -area.topLeft() ) );
+        quint64 hash = imageHash( image );
+        int last = frames.size() - 1;
+        if ( last >= 0 && hash == last_hash && frames.crop( last ) == image_crop
+             && sameImage( frames.last(), image ) )
+        {
+            // nothing moved, show the previous frame for longer instead
+            frames.addDelay( last, msec_delay );
+            ++merged_frames;
+            return;
+        }
+        frames.append( image, msec_delay, image_crop );
+        last_hash = hash;
+        snapshot_area = area == rect ? QRect() : area;
+    }
+}
+
+bool Converter::streaming() const
+{
+    return settings.stream && !thumbnailing() && !settings.autotrim && ( settings.fmt == "png" || settings.fmt == "jpg" || settings.fmt == "jpeg" );
+}
+
+// size the viewport to the page, returning the area to render
+QRect Converter::layoutPage()
 {
     QWebFrame* frame = activePage->mainFrame();
     frame->setScrollBarPolicy(Qt::Vertical, Qt::ScrollBarAlwaysOff);
@@ -221,17 +462,16 @@ void Converter::internalSnapshot( int msec_delay, const QRect& crop )
         }
         activePage->setViewportSize(QSize(highWidth, content_height));
     }
+    return QRect(QPoint(0,0), activePage->viewportSize());
+}
 
+// render rect of the page, in page coordinates, at the device scale
+QImage Converter::renderRect( const QRect& rect )
+{
+    QWebFrame* frame = activePage->mainFrame();
     QPainter painter;
-    QImage image;
-
-    QRect rect = QRect(QPoint(0,0), activePage->viewportSize());
-    if (rect.width() == 0 || rect.height() == 0) 
-    {
-        //?
-    }
-
-    image = QImage(rect.size(), QImage::Format_ARGB32_Premultiplied); // draw as fast as possible
+    QRect device = deviceRect( rect );
+    QImage image = QImage(device.size(), QImage::Format_ARGB32_Premultiplied); // draw as fast as possible
     painter.begin(&image);
 
     if (settings.transparent) 
@@ -243,85 +483,225 @@ void Converter::internalSnapshot( int msec_delay, const QRect& crop )
         pal.setColor(QPalette::Base, QColor(Qt::transparent));
         activePage->setPalette(pal);
         painter.setCompositionMode(QPainter::CompositionMode_Clear);
-        painter.fillRect(QRect(QPoint(0,0),activePage->viewportSize()), QColor(0,0,0,0));
+        painter.fillRect(QRect(QPoint(0,0),device.size()), QColor(0,0,0,0));
         painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
     } 
     else 
     {
-        painter.fillRect(QRect(QPoint(0,0),activePage->viewportSize()), Qt::white);
+        painter.fillRect(QRect(QPoint(0,0),device.size()), Qt::white);
     }
     
-    painter.translate(-rect.left(), -rect.top());
-    frame->render(&painter);
+    painter.translate(-device.left(), -device.top());
+    if ( settings.device_scale_factor != 1.0 )
+    {
+        painter.scale(settings.device_scale_factor, settings.device_scale_factor);
+        painter.setRenderHint(QPainter::SmoothPixmapTransform);
+    }
+    frame->render(&painter, QRegion(rect));
     painter.end();
-    
-    images.push_back(image);
-    delays.push_back(msec_delay);
-    crops.push_back( crop );
+    return image;
+}
+
+// the image pixels a rect of the page covers at the device scale. Both
+// edges are rounded up, so that renders of adjacent rects tile exactly.
+QRect Converter::deviceRect( const QRect& rect ) const
+{
+    double s = settings.device_scale_factor;
+    if ( s == 1.0 || !rect.isValid() )
+    {
+        return rect;
+    }
+    return QRect( QPoint( (int)ceil( rect.left() * s ), (int)ceil( rect.top() * s ) ),
+                  QPoint( (int)ceil( ( rect.right() + 1 ) * s ) - 1, (int)ceil( ( rect.bottom() + 1 ) * s ) - 1 ) );
+}
+
+// bounding rect of the selector's element, invalid if there's none
+QRect Converter::selectorRect()
+{
+    QWebFrame* frame = activePage->mainFrame();
+    QWebElement el = frame->findFirstElement( settings.selector );
+    QMap<QString,QVariant> crop = el.evaluateJavaScript( QString("this.getBoundingClientRect()") ).toMap();
+    QRect r = QRect( crop["left"].toInt(), crop["top"].toInt(),
+                     crop["width"].toInt(), crop["height"].toInt() );
+    if ( settings.convert_verbosity )
+    {
+        std::cout << "convert: selector: " << settings.selector << std::endl;
+        std::cout << "convert: selector rect: " << crop["left"].toInt() << "," << crop["top"].toInt() 
+                  << " " <<crop["width"].toInt() << "x" <<crop["height"].toInt() << " valid:" << r.isValid() << std::endl;
+    }
+    return r;
+}
+
+// the selector/crop area of page, in page coordinates
+QRect Converter::outputRect( const QRect& page )
+{
+    QRect rect = page;
+    if ( settings.selector.length() )
+    {
+        rect = selectorRect();
+    }
+    if ( settings.crop_rect.isValid() && rect.isValid() )
+    {
+        rect = QRect( rect.topLeft() + settings.crop_rect.topLeft(), settings.crop_rect.size() );
+    }
+    return rect;
+}
+
+// render the selector/crop area of the page strip by strip, handing
+// each strip to the encoder as soon as it's drawn
+bool Converter::streamToOutput( QIODevice* out )
+{
+    QRect rect = outputRect( stream_rect );
+    if ( !rect.isValid() )
+    {
+        return false;
+    }
+    QScopedPointer<StripWriter> writer( makeStripWriter( settings.fmt, out, settings.quality ) );
+    if ( !writer || !writer->begin( deviceRect( rect ).size(), settings.transparent ) )
+    {
+        return false;
+    }
+    for ( int y = rect.top(); y <= rect.bottom(); y += STREAM_STRIP_ROWS )
+    {
+        int rows = qMin( STREAM_STRIP_ROWS, rect.bottom() + 1 - y );
+        if ( !writer->writeStrip( renderRect( QRect( rect.left(), y, rect.width(), rows ) ) ) )
+        {
+            return false;
+        }
+    }
+    if ( settings.convert_verbosity )
+    {
+        std::cout << "convert: streamed " << rect.width() << "x" << rect.height()
+                  << " in strips of " << STREAM_STRIP_ROWS << " rows" << std::endl;
+    }
+    return writer->finish();
 }
 
 void Converter::saveToOutput()
 {
-    if ( !images.size() )
+    bool widths_only = !settings.widths.isEmpty() && settings.selectors.isEmpty();
+    if ( frames.isEmpty() && !widths_only ) // widths output renders its own
     {
         warningvec.push_back( "saveToOutput forcing snapshotPage" );
         snapshotPage();
     }
     if ( settings.convert_verbosity )
     {
-        std::cout << "convert: images: " << images.size() << std::endl;
+        std::cout << "convert: images: " << frames.size() << " stored bytes: " << frames.storedBytes() << std::endl;
     }
-    if ( settings.fmt == "gif" )
+    if ( merged_frames )
     {
-        gifWrite( settings.quantize_method, images, delays, crops, settings.out, settings.looping );
+        warningvec.push_back( QString("Merged %1 duplicate frames").arg(merged_frames) );
+        if ( settings.statsd )
+        {
+            settings.statsd->count( settings.statsd_ns + "frames_merged", merged_frames );
+        }
     }
-    else
+    output_format = settings.fmt;
+    if ( !streaming() && stream_rect.isValid() )
     {
-        QImage img = images.last();
-        // selector, optionally creates initial crop
-        if ( settings.selector.length() )
+        // snapshots taken while streaming, before the format changed
+        FrameStore rendered;
+        for ( int i = 0; i < frames.size(); ++i )
         {
-            QWebFrame* frame = activePage->mainFrame();
-            QWebElement el = frame->findFirstElement( settings.selector );
-            QMap<QString,QVariant> crop = el.evaluateJavaScript( QString("this.getBoundingClientRect()") ).toMap();
-            QRect r = QRect( crop["left"].toInt(), crop["top"].toInt(),
-                             crop["width"].toInt(), crop["height"].toInt() );
-            if ( settings.convert_verbosity )
-            {
-                std::cout << "convert: selector: " << settings.selector << std::endl;
-                std::cout << "convert: selector rect: " << crop["left"].toInt() << "," << crop["top"].toInt() 
-                          << " " <<crop["width"].toInt() << "x" <<crop["height"].toInt() << " valid:" << r.isValid() << std::endl;
-            }
-            if (r.isValid())
-            {
-                img = img.copy(r);
-            }
-            else
-            {
-                img = QImage();
-            }
+            QImage image = frames.at( i );
+            rendered.append( image.isNull() ? renderRect( stream_rect ) : image, frames.delay( i ), frames.crop( i ) );
         }
-        if ( settings.convert_verbosity )
+        frames = rendered;
+        stream_rect = QRect();
+    }
+    if ( !settings.selectors.isEmpty() )
+    {
+        QImage page = frames.last();
+        writeElements( page.isNull() ? renderRect( stream_rect ) : page );
+    }
+    else if ( widths_only )
+    {
+        writeWidths();
+    }
+    else if ( !settings.outputs.isEmpty() )
+    {
+        writeOutputs( thumbnail( trim( croppedSnapshot() ) ) );
+    }
+    else if ( settings.fmt == "gif" )
+    {
+        trimFrames();
+        thumbnailFrames();
+        EncodedFile encoded;
+        EncodeTarget target( encoded, settings.shared_output, settings.out );
+        if ( target.device()
+             && gifWrite( settings.quantizer, settings.quantize_options, settings.gif_options, frames, target.device(), settings.looping )
+             && target.finish() )
         {
-            std::cout << "convert: crop rect: " << settings.crop_rect.x() << "," << settings.crop_rect.y() 
-                      << " " << settings.crop_rect.width() << "x" << settings.crop_rect.height() << std::endl;
+            publish( settings.out, encoded );
         }
-        // actual cropping, relative to whatever img is now
-        if ( settings.crop_rect.isValid() )
+        else
         {
-            img = img.copy(settings.crop_rect);
+            QString err = encoded.error.length() ? encoded.error
+                : QString("Failure to save output file: %1 as %2 frames: %3").arg(settings.out).arg(settings.fmt).arg(frames.size());
+            errorvec.push_back(err);
+            std::cerr << err.toLocal8Bit().constData() << std::endl;
+        }
+    }
+    else if ( settings.fmt == "apng" || ( settings.fmt == "webp" && frames.size() > 1 ) )
+    {
+        trimFrames();
+        thumbnailFrames();
+        EncodedFile encoded;
+        EncodeTarget target( encoded, settings.shared_output, settings.out );
+        bool ok = target.device() && ( settings.fmt == "apng"
+            ? apngWrite( frames, target.device(), settings.quality, settings.looping )
+            : webpWrite( frames, target.device(), settings.quality, settings.looping ) );
+        if ( ok && target.finish() )
+        {
+            publish( settings.out, encoded );
         }
-        QFile file;
-        file.setFileName(settings.out);
-        bool openOk = file.open(QIODevice::WriteOnly);
-        if (!openOk) {
-            QString err = QString("Failure to open output file: %1").arg(settings.out);
+        else
+        {
+            QString err = encoded.error.length() ? encoded.error
+                : QString("Failure to save output file: %1 as %2 frames: %3").arg(settings.out).arg(settings.fmt).arg(frames.size());
             errorvec.push_back(err);
-            std::cerr << err.toLocal8Bit().constData() << std::endl;            
+            std::cerr << err.toLocal8Bit().constData() << std::endl;
         }
-        if ( !img.save(&file,settings.fmt.toLocal8Bit().constData(), settings.quality) )
+    }
+    else if ( streaming() )
+    {
+        // only the encoded bytes are held, the page is still rendered a
+        // strip at a time
+        EncodedFile encoded;
+        EncodeTarget target( encoded, settings.shared_output, settings.out );
+        if ( target.device() && streamToOutput( target.device() ) && target.finish() )
+        {
+            publish( settings.out, encoded );
+        }
+        else
         {
-            QString err = QString("Failure to save output file: %1 as %2 img: %3x%4").arg(settings.out).arg(settings.fmt).arg(img.width()).arg(img.height());
+            QString err = encoded.error.length() ? encoded.error
+                : QString("Failure to stream output file: %1 as %2").arg(settings.out).arg(settings.fmt);
+            errorvec.push_back(err);
+            std::cerr << err.toLocal8Bit().constData() << std::endl;
+        }
+    }
+    else
+    {
+        QImage img = thumbnail( trim( croppedSnapshot() ) );
+        EncodedFile encoded;
+        EncodeTarget target( encoded, settings.shared_output, settings.out );
+        QString fmt;
+        bool saveOk = target.device() && encodeStill( settings, img, target.device(), fmt ) && target.finish();
+        if ( settings.convert_verbosity && settings.fmt == "auto" )
+        {
+            std::cout << "convert: auto format: " << fmt << " bytes: " << encoded.size << std::endl;
+        }
+        output_format = fmt;
+        if ( saveOk )
+        {
+            publish( settings.out, encoded );
+        }
+        else
+        {
+            QString err = encoded.error.length() ? encoded.error
+                : QString("Failure to save output file: %1 as %2 img: %3x%4").arg(settings.out).arg(fmt).arg(img.width()).arg(img.height());
             errorvec.push_back(err);
             std::cerr << err.toLatin1().constData() << std::endl;
         }
@@ -358,3 +738,540 @@ QVector<QString> Converter::errors() const
 {
     return errorvec;
 }
+
+QString Converter::format() const
+{
+    return output_format;
+}
+
+QVector<ElementOutput> Converter::elements() const
+{
+    return element_outputs;
+}
+
+ElementOutput::ElementOutput()
+    : match(0)
+    , bytes(0)
+{
+}
+
+QVector<OutputResult> Converter::outputResults() const
+{
+    return output_results;
+}
+
+QRect Converter::trimmed() const
+{
+    return trim_rect;
+}
+
+QVector<WriteRef> Converter::writes() const
+{
+    return write_refs;
+}
+
+QVector<InlineFile> Converter::inlineFiles() const
+{
+    return inline_files;
+}
+
+// hand an encoded file to the writer thread, see writer.h, or keep it
+// to go back in the response
+void Converter::publish( const QString& path, EncodedFile& encoded )
+{
+    const QByteArray& data = encoded.data;
+    if ( settings.inline_output )
+    {
+        InlineFile file;
+        file.path = path;
+        file.bytes = encoded.size;
+        file.data = data;
+        file.fd = encoded.fd; // the response's now
+        encoded.fd = -1;
+        inline_files.push_back( file );
+        return;
+    }
+    if ( settings.convert_verbosity )
+    {
+        std::cout << "convert: writing " << path << " bytes: " << data.size() << std::endl;
+    }
+    write_refs.push_back( writeOutput( path, data ) );
+}
+
+InlineFile::InlineFile()
+    : fd(-1)
+    , bytes(0)
+{
+}
+
+OutputResult::OutputResult()
+    : bytes(0)
+    , encode_ms(0)
+    , ok(false)
+{
+}
+
+QVector<WidthOutput> Converter::widthOutputs() const
+{
+    return width_outputs;
+}
+
+WidthOutput::WidthOutput()
+    : width(0)
+    , bytes(0)
+{
+}
+
+// crop the uniform border off img, before it's thumbnailed or encoded
+QImage Converter::trim( const QImage& img )
+{
+    if ( !settings.autotrim || img.isNull() )
+    {
+        return img;
+    }
+    trim_rect = trimRect( img, settings.autotrim_tolerance );
+    if ( settings.convert_verbosity )
+    {
+        std::cout << "convert: trim " << img.width() << "x" << img.height() << " to "
+                  << trim_rect.x() << "," << trim_rect.y() << " " << trim_rect.width() << "x" << trim_rect.height() << std::endl;
+    }
+    return trim_rect == img.rect() ? img : img.copy( trim_rect );
+}
+
+// trim every frame of an animation to the content of all of them
+void Converter::trimFrames()
+{
+    if ( !settings.autotrim || frames.isEmpty() )
+    {
+        return;
+    }
+    QRect content;
+    for ( int i = 0; i < frames.size(); ++i )
+    {
+        QRect r = trimRect( frames.at( i ), settings.autotrim_tolerance );
+        if ( r != QRect( 0, 0, 1, 1 ) ) // all border
+        {
+            content |= r;
+        }
+    }
+    if ( !content.isValid() )
+    {
+        content = QRect( 0, 0, 1, 1 );
+    }
+    trim_rect = content;
+    if ( content == QRect( QPoint( 0, 0 ), frames.imageSize( 0 ) ) )
+    {
+        return;
+    }
+    FrameStore trimmed;
+    for ( int i = 0; i < frames.size(); ++i )
+    {
+        QRect crop = frames.crop( i );
+        if ( crop.isValid() )
+        {
+            crop = crop.translated( -content.topLeft() );
+        }
+        trimmed.append( frames.at( i ).copy( content ), frames.delay( i ), crop );
+    }
+    frames = trimmed;
+}
+
+bool Converter::thumbnailing() const
+{
+    return settings.scale != 1.0 || settings.max_width > 0 || settings.max_height > 0;
+}
+
+// the scale, max_width and max_height stage, before any quantization
+QImage Converter::thumbnail( const QImage& img )
+{
+    if ( !thumbnailing() || img.isNull() )
+    {
+        return img;
+    }
+    QSize size = thumbnailSize( img.size(), settings.scale, settings.max_width, settings.max_height );
+    if ( settings.convert_verbosity )
+    {
+        std::cout << "convert: thumbnail " << img.width() << "x" << img.height()
+                  << " to " << size.width() << "x" << size.height() << std::endl;
+    }
+    return size == img.size() ? img : resampleImage( img, size );
+}
+
+// thumbnail every frame of an animation, and its crop along with it
+void Converter::thumbnailFrames()
+{
+    if ( !thumbnailing() )
+    {
+        return;
+    }
+    FrameStore scaled;
+    for ( int i = 0; i < frames.size(); ++i )
+    {
+        QImage image = frames.at( i );
+        QImage small = thumbnail( image );
+        QRect crop = frames.crop( i );
+        if ( crop.isValid() && !image.isNull() )
+        {
+            double fx = (double)small.width() / image.width();
+            double fy = (double)small.height() / image.height();
+            crop = QRect( QPoint( (int)floor( crop.left() * fx ), (int)floor( crop.top() * fy ) ),
+                          QPoint( (int)ceil( ( crop.right() + 1 ) * fx ) - 1, (int)ceil( ( crop.bottom() + 1 ) * fy ) - 1 ) );
+        }
+        scaled.append( small, frames.delay( i ), crop );
+    }
+    frames = scaled;
+}
+
+// apply the selector and crop rect to a snapshot of the whole page
+QImage Converter::cropOutput( const QImage& page )
+{
+    QImage img = page;
+    // selector, optionally creates initial crop
+    if ( settings.selector.length() )
+    {
+        QRect r = selectorRect();
+        if (r.isValid())
+        {
+            img = img.copy(deviceRect(r));
+        }
+        else
+        {
+            img = QImage();
+        }
+    }
+    if ( settings.convert_verbosity )
+    {
+        std::cout << "convert: crop rect: " << settings.crop_rect.x() << "," << settings.crop_rect.y() 
+                  << " " << settings.crop_rect.width() << "x" << settings.crop_rect.height() << std::endl;
+    }
+    // actual cropping, relative to whatever img is now
+    if ( settings.crop_rect.isValid() )
+    {
+        img = img.copy(deviceRect(settings.crop_rect));
+    }
+    return img;
+}
+
+// the last snapshot with the selector and crop applied, unless that's
+// all it covers already
+QImage Converter::croppedSnapshot()
+{
+    QImage page = frames.last();
+    if ( snapshot_area.isValid() )
+    {
+        return page;
+    }
+    return cropOutput( page.isNull() ? renderRect( stream_rect ) : page );
+}
+
+// every element matching each of the selectors, in document order
+QVector<ElementOutput> Converter::matchElements()
+{
+    QString list;
+    for ( int i = 0; i < settings.selectors.size(); ++i )
+    {
+        list += ( i ? "," : "" ) + jsString( settings.selectors[i] );
+    }
+    QString script = QString(
+        "(function(selectors) {"
+        "  var out = [];"
+        "  for ( var i = 0; i < selectors.length; ++i ) {"
+        "    var els = [];"
+        "    try { els = document.querySelectorAll( selectors[i] ); } catch ( e ) {}"
+        "    for ( var j = 0; j < els.length; ++j ) {"
+        "      var r = els[j].getBoundingClientRect();"
+        "      out.push( [ i, j, r.left, r.top, r.width, r.height ] );"
+        "    }"
+        "  }"
+        "  return out;"
+        "})([%1])" ).arg( list );
+    QVariantList measured = activePage->mainFrame()->evaluateJavaScript( script ).toList();
+    QVector<ElementOutput> found;
+    for ( int i = 0; i < measured.size(); ++i )
+    {
+        QVariantList m = measured[i].toList();
+        if ( m.size() != 6 )
+        {
+            continue;
+        }
+        ElementOutput element;
+        element.selector = settings.selectors.value( m[0].toInt() );
+        element.match = m[1].toInt();
+        element.rect = QRect( m[2].toInt(), m[3].toInt(), m[4].toInt(), m[5].toInt() );
+        found.push_back( element );
+    }
+    return found;
+}
+
+// output.png -> output_3.png
+static QString numberedPath( const QString& out, int n )
+{
+    int dot = out.lastIndexOf( QChar('.') );
+    if ( dot > out.lastIndexOf( QChar('/') ) )
+    {
+        return out.left( dot ) + QString("_%1").arg( n ) + out.mid( dot );
+    }
+    return out + QString("_%1").arg( n );
+}
+
+// encodes images which are written as separate files, in parallel
+class StillEncodeTask : public ParallelTask
+{
+public:
+    StillEncodeTask( const Settings& s, const QVector<QImage>& i )
+        : settings(s), images(i), encoded(i.size()), fmts(i.size()), ok(i.size())
+    {
+    }
+    void run( int index )
+    {
+        EncodeTarget target( encoded[index], settings.shared_output, settings.out );
+        ok[index] = target.device() && encodeStill( settings, images[index], target.device(), fmts[index] ) && target.finish();
+    }
+    const Settings& settings;
+    const QVector<QImage>& images;
+    QVector<EncodedFile> encoded;
+    QVector<QString> fmts;
+    QVector<int> ok;
+};
+
+// crop every element matching settings.selectors out of one render of
+// the page, and write them as separate files or one sprite sheet
+void Converter::writeElements( const QImage& page )
+{
+    element_outputs.clear();
+    if ( settings.fmt == "apng" )
+    {
+        QString err = QString("selectors output needs a still format, not %1").arg(settings.fmt);
+        errorvec.push_back(err);
+        std::cerr << err.toLocal8Bit().constData() << std::endl;
+        return;
+    }
+    QVector<ElementOutput> found = matchElements();
+    QVector<QImage> crops;
+    for ( int i = 0; i < found.size(); ++i )
+    {
+        QRect r = deviceRect( found[i].rect ) & page.rect();
+        if ( r.isEmpty() )
+        {
+            warningvec.push_back( QString("Element %1 of %2 has nothing to show").arg(found[i].match).arg(found[i].selector) );
+            continue;
+        }
+        found[i].rect &= QRect( QPoint( 0, 0 ), activePage->viewportSize() );
+        crops.push_back( page.copy( r ) );
+        element_outputs.push_back( found[i] );
+    }
+    if ( settings.convert_verbosity )
+    {
+        std::cout << "convert: elements: " << element_outputs.size() << " sprite: " << settings.sprite << std::endl;
+    }
+    if ( crops.isEmpty() )
+    {
+        QString err = QString("No elements matched selectors");
+        errorvec.push_back(err);
+        std::cerr << err.toLocal8Bit().constData() << std::endl;
+        return;
+    }
+    if ( settings.sprite )
+    {
+        QVector<QSize> sizes;
+        for ( int i = 0; i < crops.size(); ++i )
+        {
+            sizes.push_back( crops[i].size() );
+        }
+        QSize sheet;
+        QVector<QPoint> positions = packSprites( sizes, sheet );
+        EncodedFile encoded;
+        EncodeTarget target( encoded, settings.shared_output, settings.out );
+        QString fmt = settings.fmt;
+        if ( target.device() && encodeStill( settings, drawSprites( crops, positions, sheet ), target.device(), fmt ) && target.finish() )
+        {
+            publish( settings.out, encoded );
+        }
+        else
+        {
+            QString err = encoded.error.length() ? encoded.error
+                : QString("Failure to save sprite sheet: %1 as %2").arg(settings.out).arg(fmt);
+            errorvec.push_back(err);
+            std::cerr << err.toLocal8Bit().constData() << std::endl;
+        }
+        for ( int i = 0; i < element_outputs.size(); ++i )
+        {
+            element_outputs[i].position = positions[i];
+            element_outputs[i].path = settings.out;
+            element_outputs[i].bytes = encoded.size;
+        }
+        output_format = fmt;
+        return;
+    }
+    StillEncodeTask task( settings, crops );
+    parallelRun( task, crops.size() );
+    output_format = task.fmts[0];
+    for ( int i = 0; i < element_outputs.size(); ++i )
+    {
+        QString path = numberedPath( settings.out, i );
+        if ( !task.ok[i] )
+        {
+            QString err = task.encoded[i].error.length() ? task.encoded[i].error
+                : QString("Failure to save element output: %1 as %2").arg(path).arg(task.fmts[i]);
+            errorvec.push_back(err);
+            std::cerr << err.toLocal8Bit().constData() << std::endl;
+            continue;
+        }
+        publish( path, task.encoded[i] );
+        element_outputs[i].path = path;
+        element_outputs[i].bytes = task.encoded[i].size;
+        if ( task.fmts[i] != output_format )
+        {
+            output_format = settings.fmt; // format=auto picked more than one
+        }
+    }
+}
+
+// lay the already loaded page out again at each of settings.widths,
+// and write a render of each to its own file
+void Converter::writeWidths()
+{
+    width_outputs.clear();
+    if ( settings.fmt == "apng" )
+    {
+        QString err = QString("widths output needs a still format, not %1").arg(settings.fmt);
+        errorvec.push_back(err);
+        std::cerr << err.toLocal8Bit().constData() << std::endl;
+        return;
+    }
+    QVector<QImage> images;
+    for ( int i = 0; i < settings.widths.size(); ++i )
+    {
+        settings.screen_width = settings.widths[i];
+        QImage img = thumbnail( trim( cropOutput( renderRect( layoutPage() ) ) ) );
+        WidthOutput output;
+        output.width = settings.widths[i];
+        output.size = img.size();
+        if ( settings.convert_verbosity )
+        {
+            std::cout << "convert: width " << output.width << ": " << img.width() << "x" << img.height() << std::endl;
+        }
+        images.push_back( img );
+        width_outputs.push_back( output );
+    }
+    // rendering has to stay on this thread, encoding doesn't
+    StillEncodeTask task( settings, images );
+    parallelRun( task, images.size() );
+    output_format = task.fmts[0];
+    for ( int i = 0; i < width_outputs.size(); ++i )
+    {
+        WidthOutput& output = width_outputs[i];
+        QString path = numberedPath( settings.out, output.width );
+        if ( images[i].isNull() || !task.ok[i] )
+        {
+            QString err = task.encoded[i].error.length() ? task.encoded[i].error
+                : QString("Failure to save output file: %1 as %2 width: %3").arg(path).arg(task.fmts[i]).arg(output.width);
+            errorvec.push_back(err);
+            std::cerr << err.toLocal8Bit().constData() << std::endl;
+            continue;
+        }
+        publish( path, task.encoded[i] );
+        output.path = path;
+        output.format = task.fmts[i];
+        output.bytes = task.encoded[i].size;
+        if ( task.fmts[i] != output_format )
+        {
+            output_format = settings.fmt; // format=auto picked more than one
+        }
+    }
+}
+
+// crops, scales and encodes each of settings.outputs from the same
+// image, one output per task
+class OutputTask : public ParallelTask
+{
+public:
+    OutputTask( const Settings& s, const QImage& i )
+        : settings(s), image(i), results(s.outputs.size()), encoded(s.outputs.size())
+    {
+    }
+    void run( int index )
+    {
+        timespec start, end;
+        clock_gettime( CLOCK_MONOTONIC, &start );
+        const OutputSpec& spec = settings.outputs[index];
+        OutputResult& result = results[index];
+        result.path = spec.path;
+        QImage out = image;
+        if ( spec.crop.isValid() )
+        {
+            QRect crop = spec.crop & out.rect();
+            if ( crop.isEmpty() )
+            {
+                // copy() of an empty rect would be the whole image
+                result.format = spec.fmt.length() ? spec.fmt : settings.fmt;
+                result.size = QSize( 0, 0 );
+                result.error = QString("Crop %1,%2 %3x%4 of output %5 is outside the %6x%7 image")
+                    .arg(spec.crop.x()).arg(spec.crop.y()).arg(spec.crop.width()).arg(spec.crop.height())
+                    .arg(spec.path).arg(out.width()).arg(out.height());
+                return;
+            }
+            out = out.copy( crop );
+        }
+        if ( spec.scale > 0 && spec.scale != 1.0 && !out.isNull() )
+        {
+            out = resampleImage( out, thumbnailSize( out.size(), spec.scale, 0, 0 ) );
+        }
+        result.size = out.size();
+        Settings s = settings;
+        if ( spec.fmt.length() )
+        {
+            s.fmt = spec.fmt;
+        }
+        if ( spec.quality >= 0 )
+        {
+            s.quality = spec.quality;
+        }
+        result.format = s.fmt;
+        EncodeTarget target( encoded[index], settings.shared_output, spec.path );
+        result.ok = !out.isNull() && target.device() && encodeStill( s, out, target.device(), result.format ) && target.finish();
+        result.bytes = result.ok ? encoded[index].size : 0;
+        result.error = encoded[index].error;
+        clock_gettime( CLOCK_MONOTONIC, &end );
+        result.encode_ms = ( end.tv_sec - start.tv_sec ) * 1000.0 + ( end.tv_nsec - start.tv_nsec ) / 1000000.0;
+    }
+    const Settings& settings;
+    const QImage& image;
+    QVector<OutputResult> results;
+    QVector<EncodedFile> encoded;
+};
+
+// write the image to every one of settings.outputs at once
+void Converter::writeOutputs( const QImage& img )
+{
+    OutputTask task( settings, img );
+    parallelRun( task, settings.outputs.size() );
+    output_results = task.results;
+    output_format = output_results[0].format;
+    for ( int i = 0; i < output_results.size(); ++i )
+    {
+        const OutputResult& result = output_results[i];
+        if ( settings.convert_verbosity )
+        {
+            std::cout << "convert: output " << result.path << " " << result.format << " "
+                      << result.size.width() << "x" << result.size.height() << " bytes: " << result.bytes
+                      << " " << result.encode_ms << "ms" << std::endl;
+        }
+        if ( !result.ok )
+        {
+            QString err = result.error.length() ? result.error
+                : QString("Failure to save output file: %1 as %2 img: %3x%4").arg(result.path)
+                  .arg(result.format).arg(result.size.width()).arg(result.size.height());
+            errorvec.push_back(err);
+            std::cerr << err.toLocal8Bit().constData() << std::endl;
+        }
+        else
+        {
+            publish( result.path, task.encoded[i] );
+        }
+        if ( result.format != output_format )
+        {
+            output_format = settings.fmt; // outputs differ
+        }
+    }
+}
@@ -7,9 +7,60 @@
 #include <utility>
 #include <iostream>
 
+// rows rendered and encoded at a time when streaming
+#define STREAM_STRIP_ROWS 256
+
 #include "engine.h"
 #include "quant.h"
 #include "statsd_client.h"
+#include "writer.h"
+#include "sharedmem.h"
+
+// one element written by selectors output
+struct ElementOutput
+{
+    ElementOutput();
+    QString selector;
+    int match;       // index among the elements the selector matched
+    QRect rect;      // on the page
+    QPoint position; // in the sprite sheet
+    QString path;    // file written, the sheet for sprites
+    qint64 bytes;    // size of path
+};
+
+// one render of widths output
+struct WidthOutput
+{
+    WidthOutput();
+    int width;      // of the viewport
+    QSize size;     // of the image written
+    QString path;
+    QString format; // differs per width with format=auto
+    qint64 bytes;
+};
+
+// one file of outputs
+struct OutputResult
+{
+    OutputResult();
+    QString path;
+    QString format;   // as written, format=auto resolved
+    QSize size;
+    qint64 bytes;
+    double encode_ms; // crop, scale and encode
+    bool ok;
+    QString error;    // why it failed, when it wasn't the encoder
+};
+
+// an output file kept in memory, with settings.inline_output
+struct InlineFile
+{
+    InlineFile();
+    QString path;
+    QByteArray data; // empty when shared
+    int fd;          // shared memory holding it with settings.shared_output, else -1
+    qint64 bytes;
+};
 
 class Converter : public QObject
 {
@@ -20,6 +71,13 @@ public:
                 
     QVector<QString> warnings() const;
     QVector<QString> errors() const;
+    QString format() const; // as written, format=auto resolved
+    QVector<ElementOutput> elements() const; // with settings.selectors
+    QVector<WidthOutput> widthOutputs() const; // with settings.widths
+    QVector<OutputResult> outputResults() const; // with settings.outputs
+    QVector<WriteRef> writes() const; // of every file, finishing on the writer thread
+    QVector<InlineFile> inlineFiles() const; // instead of writes, with settings.inline_output
+    QRect trimmed() const; // with settings.autotrim, what was kept of the image
 
 public slots:
     void setTransparent( bool t );
@@ -31,6 +89,21 @@ public slots:
     void snapshotElements( const QStringList& ids, int msec_delay = 100 );
     void saveToOutput();
     void setQuantizeMethod( const QString& method ); // see quant.h
+    void setQuantizeKmeans( int iterations );
+    void setGifOptimize( bool o );
+    void setGifPaletteSample( int rows );
+    void setGifLocalPaletteThreshold( double error );
+    void setGifLossiness( int lossiness );
+    void setPng8Auto( bool a );
+    void setAutoMaxBytes( int bytes );
+    void setAutoMinQuality( int q );
+    void setStream( bool s );
+    void setScale( double s );
+    void setMaxSize( int w, int h );
+    void setDeviceScaleFactor( double f );
+    void setAutotrim( bool trim, int tolerance = 0 );
+    double advanceTime( int msec );
+    void captureTimeline( int fps, int duration_ms );
     void setSelector( const QString& sel );
     void setCss( const QString& css );
     void setCropRect( int x, int y, int w, int h );
@@ -47,12 +120,41 @@ signals:
 private:
     Settings settings;
     QWebPage* activePage;
-    QVector<QImage> images;
-    QVector<int> delays;
-    QVector<QRect> crops;
+    FrameStore frames;
     QVector<QString> warningvec;
     QVector<QString> errorvec;
+    QString output_format;
+    QRect stream_rect; // page area of streamed snapshots, which are stored as null images
+    quint64 last_hash; // of the last snapshot, see imageHash
+    int merged_frames; // snapshots folded into the one before
+    QRect snapshot_area; // page area the last snapshot covers when it's only the output's
     void internalSnapshot( int msec_delay, const QRect& crop );
+    bool streaming() const;
+    QRect layoutPage();
+    QImage renderRect( const QRect& rect );
+    QRect deviceRect( const QRect& rect ) const;
+    QRect selectorRect();
+    QRect outputRect( const QRect& page );
+    QVector<QRect> elementRects( const QStringList& ids );
+    QVector<ElementOutput> matchElements();
+    void writeElements( const QImage& page );
+    QVector<ElementOutput> element_outputs;
+    QImage cropOutput( const QImage& page );
+    QImage croppedSnapshot();
+    QImage trim( const QImage& img );
+    void trimFrames();
+    QRect trim_rect;
+    bool thumbnailing() const;
+    QImage thumbnail( const QImage& img );
+    void thumbnailFrames();
+    void writeWidths();
+    QVector<WidthOutput> width_outputs;
+    void writeOutputs( const QImage& img );
+    QVector<OutputResult> output_results;
+    bool streamToOutput( QIODevice* out );
+    void publish( const QString& path, EncodedFile& encoded );
+    QVector<WriteRef> write_refs;
+    QVector<InlineFile> inline_files;
 };
 
 #endif
@@ -0,0 +1,147 @@
+#include "decompress.h"
+#include <zlib.h>
+#include <zstd.h>
+#include <cstring>
+
+#define DECOMPRESS_MIN_BYTES 65536 // first guess at the size of a body
+#define DECOMPRESS_RATIO 4         // html compresses about this much
+
+static QString normalEncoding( const QString& encoding )
+{
+    QString e = encoding.trimmed().toLower();
+    return e == "x-gzip" ? QString("gzip") : e;
+}
+
+bool isCompressed( const QString& encoding )
+{
+    QString e = normalEncoding( encoding );
+    return !e.isEmpty() && e != "identity";
+}
+
+static QString tooLarge( qint64 max_bytes )
+{
+    return QString("Request body is larger than %1 bytes decompressed").arg(max_bytes);
+}
+
+// make room in buffer past length for more output, false once length
+// is past max_bytes. Capacity is capped at one byte over, which is how
+// a body that's too large shows itself.
+static bool room( QByteArray& buffer, qint64 length, size_t size, qint64 max_bytes )
+{
+    if ( length > max_bytes )
+    {
+        return false;
+    }
+    if ( length < buffer.size() )
+    {
+        return true;
+    }
+    qint64 want = qMax( (qint64)buffer.size() * 2, qMax( (qint64)DECOMPRESS_MIN_BYTES, (qint64)size * DECOMPRESS_RATIO ) );
+    buffer.resize( (int)qMin( want, max_bytes + 1 ) );
+    return true;
+}
+
+// gzip, and zlib wrapped deflate, told apart by their headers
+static bool inflateBody( const char* data, size_t size, qint64 max_bytes,
+                         QByteArray& buffer, qint64& length, QString& error )
+{
+    z_stream stream;
+    memset( &stream, 0, sizeof(stream) );
+    if ( inflateInit2( &stream, 15 + 32 ) != Z_OK )
+    {
+        error = "Failure to start decompressing request body";
+        return false;
+    }
+    stream.next_in = (Bytef*)data;
+    stream.avail_in = (uInt)size;
+    length = 0;
+    int r = Z_OK;
+    while ( r != Z_STREAM_END )
+    {
+        if ( !room( buffer, length, size, max_bytes ) )
+        {
+            error = tooLarge( max_bytes );
+            break;
+        }
+        stream.next_out = (Bytef*)buffer.data() + length;
+        stream.avail_out = (uInt)( buffer.size() - length );
+        r = inflate( &stream, Z_NO_FLUSH );
+        length = (char*)stream.next_out - buffer.data();
+        if ( r == Z_BUF_ERROR && !stream.avail_in )
+        {
+            error = "Request body is truncated";
+            break;
+        }
+        if ( r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR )
+        {
+            error = QString("Request body is corrupt: %1").arg(stream.msg ? stream.msg : "bad data");
+            break;
+        }
+    }
+    inflateEnd( &stream );
+    if ( error.isEmpty() && length > max_bytes )
+    {
+        error = tooLarge( max_bytes );
+    }
+    return error.isEmpty();
+}
+
+static bool zstdBody( const char* data, size_t size, qint64 max_bytes,
+                      QByteArray& buffer, qint64& length, QString& error )
+{
+    // requests are handled one at a time, so one context does
+    static ZSTD_DCtx* context = ZSTD_createDCtx();
+    ZSTD_DCtx_reset( context, ZSTD_reset_session_only );
+    ZSTD_inBuffer in = { data, size, 0 };
+    length = 0;
+    for ( ;; )
+    {
+        if ( !room( buffer, length, size, max_bytes ) )
+        {
+            error = tooLarge( max_bytes );
+            break;
+        }
+        ZSTD_outBuffer out = { buffer.data() + length, (size_t)( buffer.size() - length ), 0 };
+        size_t r = ZSTD_decompressStream( context, &out, &in );
+        length += out.pos;
+        if ( ZSTD_isError( r ) )
+        {
+            error = QString("Request body is corrupt: %1").arg(ZSTD_getErrorName( r ));
+            break;
+        }
+        if ( in.pos == in.size )
+        {
+            if ( !r )
+            {
+                break; // the last frame is complete
+            }
+            if ( out.pos < out.size )
+            {
+                // output had room, so it's waiting on input there isn't
+                error = "Request body is truncated";
+                break;
+            }
+        }
+    }
+    if ( error.isEmpty() && length > max_bytes )
+    {
+        error = tooLarge( max_bytes );
+    }
+    return error.isEmpty();
+}
+
+bool decompressBody( const QString& encoding, const char* data, size_t size, qint64 max_bytes,
+                     QByteArray& buffer, qint64& length, QString& error )
+{
+    QString e = normalEncoding( encoding );
+    if ( e == "gzip" || e == "deflate" )
+    {
+        return inflateBody( data, size, max_bytes, buffer, length, error );
+    }
+    if ( e == "zstd" )
+    {
+        return zstdBody( data, size, max_bytes, buffer, length, error );
+    }
+    error = QString("Unsupported Content-Encoding: %1").arg(encoding);
+    return false;
+}
@@ -0,0 +1,23 @@
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <QString>
+#include <QByteArray>
+
+// Request bodies sent with Content-Encoding gzip (or deflate) and zstd.
+// They're decompressed a chunk at a time into a buffer which is kept and
+// reused between requests, stopping as soon as the output passes the
+// size limit rather than inflating a hostile body in full.
+
+// whether a body with this Content-Encoding needs decompressBody, false
+// for none or identity
+bool isCompressed( const QString& encoding );
+
+// decompress size bytes of data into the front of buffer, setting
+// length to the size of the body. buffer only ever grows, so that it
+// can be passed again for the next body. False with error set when the
+// body is corrupt, truncated, or decompresses to more than max_bytes.
+bool decompressBody( const QString& encoding, const char* data, size_t size, qint64 max_bytes,
+                     QByteArray& buffer, qint64& length, QString& error );
+
+#endif
@@ -13,6 +13,13 @@
 
 #include "conv.h"
 #include "quant.h"
+#include "vtime.h"
+
+OutputSpec::OutputSpec()
+    : quality(-1)
+    , scale(1.0)
+{
+}
 
 Settings::Settings()
 {
@@ -32,10 +39,23 @@ Settings::Settings()
     convert_verbosity = 0;
     rasterizer = "ichabod";
     looping = false;
-    quantize_method = toQuantizeMethod( "MEDIANCUT" );
+    png8_auto = false;
+    stream = false;
+    scale = 1.0;
+    max_width = 0;
+    max_height = 0;
+    device_scale_factor = 1.0;
+    autotrim = false;
+    autotrim_tolerance = 0;
+    virtual_time = false;
+    quantizer = toQuantizer( "MEDIANCUT" );
     crop_rect = QRect();
     css = "";
     selector = "";
+    sprite = false;
+    fire_and_forget = false;
+    inline_output = false;
+    shared_output = false;
     slow_response_ms = 15000;
     statsd_ns = "ichabod";
     statsd = 0;
@@ -131,6 +151,8 @@ bool WebPage::extension(Extension extension, const ExtensionOption *option, Exte
 
 Engine::Engine(const Settings& s)
     : web_page(0),
+      owns_page(true),
+      load_only(false),
       settings(s),
       net_access(0),
       script_result(""),
@@ -139,25 +161,49 @@ Engine::Engine(const Settings& s)
       run_elapsedms(0.0),
       convert_elapsedms(0.0)
 {
-
-    // forward all interesting activity as signals for others to pick
-    // up on
-
     web_page = new WebPage();
     net_access = new NetAccess(s);
-
     net_access->setCookieJar(new QNetworkCookieJar());
-    connect(net_access, SIGNAL(sslErrors(QNetworkReply*, const QList<QSslError>&)),
-            this, SLOT(netSslErrors(QNetworkReply*, const QList<QSslError>&)));
-    connect(net_access, SIGNAL(finished (QNetworkReply *)),
-            this, SLOT(netFinished (QNetworkReply *) ) );
-    connect(net_access, SIGNAL(warning(const QString &)),
-            this, SLOT(netWarning(const QString &)));
-
     web_page->setNetworkAccessManager(net_access);
 
     connect(web_page, SIGNAL(loadStarted()), this, SLOT(webPageLoadStarted()));
     connect(web_page->mainFrame(), SIGNAL(loadFinished(bool)), this, SLOT(webPageLoadFinished(bool)));
+    if ( settings.virtual_time || settings.device_scale_factor != 1.0 )
+    {
+        // before any of the page's scripts run
+        connect(web_page->mainFrame(), SIGNAL(javaScriptWindowObjectCleared()), this, SLOT(webPageWindowObjectCleared()));
+    }
+    init();
+}
+
+Engine::Engine(const Settings& s, WebPage* page)
+    : web_page(page),
+      owns_page(false),
+      load_only(false),
+      settings(s),
+      net_access(qobject_cast<NetAccess*>(page->networkAccessManager())),
+      script_result(""),
+      check_done_attempts(0),
+      run_code(0),
+      run_elapsedms(0.0),
+      convert_elapsedms(0.0)
+{
+    init();
+}
+
+void Engine::init()
+{
+    // forward all interesting activity as signals for others to pick
+    // up on
+    if ( net_access )
+    {
+        connect(net_access, SIGNAL(sslErrors(QNetworkReply*, const QList<QSslError>&)),
+                this, SLOT(netSslErrors(QNetworkReply*, const QList<QSslError>&)));
+        connect(net_access, SIGNAL(finished (QNetworkReply *)),
+                this, SLOT(netFinished (QNetworkReply *) ) );
+        connect(net_access, SIGNAL(warning(const QString &)),
+                this, SLOT(netWarning(const QString &)));
+    }
     connect(web_page, SIGNAL(alert(const QString&)), SIGNAL(warning(const QString&)));
     connect(web_page, SIGNAL(confirm(const QString&)), SIGNAL(warning(const QString&)));
     connect(web_page, SIGNAL(prompt(const QString&)), SIGNAL(warning(const QString&)));
@@ -166,8 +212,28 @@ Engine::Engine(const Settings& s)
 
 Engine::~Engine()
 {
-    delete web_page;
-    delete net_access;
+    if ( owns_page )
+    {
+        delete web_page;
+        delete net_access;
+    }
+}
+
+WebPage* Engine::takePage()
+{
+    WebPage* page = web_page;
+    if ( owns_page && page )
+    {
+        // signals to this engine go with it
+        disconnect(page, 0, this, 0);
+        disconnect(page->mainFrame(), 0, this, 0);
+        disconnect(net_access, 0, this, 0);
+        net_access->setParent(page);
+    }
+    web_page = 0;
+    net_access = 0;
+    owns_page = true;
+    return page;
 }
 
 void Engine::netSslErrors(QNetworkReply *reply, const QList<QSslError> &) 
@@ -217,6 +283,27 @@ void Engine::webPageLoadFinished(bool b)
     }
 }
 
+void Engine::webPageWindowObjectCleared()
+{
+    if ( settings.device_scale_factor != 1.0 )
+    {
+        // so srcset and scripts pick the images for the scale painted at
+        web_page->mainFrame()->evaluateJavaScript( QString(
+            "try { Object.defineProperty( window, 'devicePixelRatio',"
+            " { get: function() { return %1; }, configurable: true } ); } catch ( e ) {}" )
+            .arg( settings.device_scale_factor ) );
+    }
+    if ( !settings.virtual_time )
+    {
+        return;
+    }
+    if ( settings.engine_verbosity )
+    {
+        std::cout << "engine: installing virtual time" << std::endl;
+    }
+    installVirtualTime( web_page->mainFrame() );
+}
+
 #define NANOS 1000000000LL
 #define USED_CLOCK CLOCK_MONOTONIC
 
@@ -316,7 +403,11 @@ void Engine::checkDone()
             }
         }
     }
-    if ( is_done )
+    if ( is_done && load_only )
+    {
+        stop(0);
+    }
+    else if ( is_done )
     {
         loadDone();
     }
@@ -349,6 +440,12 @@ void Engine::loadTimeout()
     stop(-2);
 }
 
+bool Engine::load()
+{
+    load_only = true;
+    return run();
+}
+
 bool Engine::run()
 {
     if ( settings.load_timeout_msec )
@@ -363,17 +460,25 @@ bool Engine::run()
     clock_gettime(USED_CLOCK, &time1);
     long long start = time1.tv_sec*NANOS + time1.tv_nsec;
 
-    QUrl url = QUrl::fromUserInput(settings.in);
-    if ( !url.isValid() )
+    if ( !owns_page )
     {
-        stop(-3);
-        return false;
+        // already loaded, go straight to the scripts once running
+        QTimer::singleShot(0, this, SLOT(checkDone()));
     }
-    QNetworkRequest r = QNetworkRequest(url);
+    else
+    {
+        QUrl url = QUrl::fromUserInput(settings.in);
+        if ( !url.isValid() )
+        {
+            stop(-3);
+            return false;
+        }
+        QNetworkRequest r = QNetworkRequest(url);
 
-    web_page->mainFrame()->setScrollBarPolicy(Qt::Vertical, Qt::ScrollBarAlwaysOff);
-    web_page->mainFrame()->setScrollBarPolicy(Qt::Horizontal, Qt::ScrollBarAlwaysOff);
-    web_page->mainFrame()->load(r);
+        web_page->mainFrame()->setScrollBarPolicy(Qt::Vertical, Qt::ScrollBarAlwaysOff);
+        web_page->mainFrame()->setScrollBarPolicy(Qt::Horizontal, Qt::ScrollBarAlwaysOff);
+        web_page->mainFrame()->load(r);
+    }
 
     if ( settings.engine_verbosity )
     {
@@ -3,6 +3,7 @@
 #include <QObject>
 #include <QVector>
 #include <QString>
+#include <QStringList>
 #include <QRect>
 #include <QSet>
 #include <QUrl>
@@ -11,8 +12,21 @@
 #include <QEventLoop>
 #include "statsd_client.h"
 #include "quant.h"
+#include "agif.h"
+#include "still.h"
 #include <string>
 
+// one of several files written from the same snapshot
+struct OutputSpec
+{
+    OutputSpec();
+    QString path;
+    QString fmt;  // empty for the request's
+    int quality;  // -1 for the request's
+    QRect crop;   // of the image otherwise written, invalid for all of it
+    double scale; // 1 keeps the size
+};
+
 class Settings
 {
 public:
@@ -35,10 +49,29 @@ public:
     int verbosity;
     QString rasterizer;
     bool looping;
-    QuantizeMethod quantize_method;
+    const Quantizer* quantizer;
+    QuantizeOptions quantize_options;
+    GifOptions gif_options;
+    bool png8_auto; // write png as png8 when that loses nothing
+    AutoFormatOptions auto_options;
+    bool stream; // render and encode png/jpg in strips
+    double scale;   // thumbnail stage, see resample.h
+    int max_width;  // 0 for no limit
+    int max_height;
+    double device_scale_factor; // paint scale, the page is laid out in css pixels
+    bool autotrim;          // crop uniform borders, see trim.h
+    int autotrim_tolerance;
+    bool virtual_time; // page clock only moves when advanced, see vtime.h
     QRect crop_rect;
     QString css;
     QString selector;
+    QStringList selectors; // output every match as its own image
+    bool sprite;           // or packed together in one
+    QList<int> widths;     // lay out and output the page at each
+    QList<OutputSpec> outputs; // instead of out, encoded in parallel
+    bool fire_and_forget; // respond without waiting for the files to be written
+    bool inline_output; // keep files in memory for the response, see unixsocket.h
+    bool shared_output; // with inline_output, in shared memory, see sharedmem.h
     int slow_response_ms;
     std::string statsd_ns; // interop with statsd code
     statsd::StatsdClient* statsd;
@@ -85,8 +118,13 @@ class Engine : public QObject
     Q_OBJECT
 public:
     Engine( const Settings & settings );
+    // on a page which is already loaded, see TemplateRegistry. The
+    // page stays the caller's.
+    Engine( const Settings & settings, WebPage* page );
     ~Engine();
     bool run();                   // do this
+    bool load();                  // or only load the page, then
+    WebPage* takePage();          // keep it, with its network access
     QString scriptResult() const; // then check this
     double runTime() const;       // and this
     double convertTime() const;   // and this
@@ -108,12 +146,16 @@ private slots:
     void netWarning(const QString & message);
     void webPageLoadStarted();
     void webPageLoadFinished(bool b);
+    void webPageWindowObjectCleared();
     void checkDone();
     void loadTimeout();
 
 private:
+    void init();
     void loadDone();
     WebPage* web_page;    
+    bool owns_page;
+    bool load_only;
     Settings settings;
     NetAccess* net_access;
     QString script_result;
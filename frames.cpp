@@ -0,0 +1,301 @@
+#include "frames.h"
+#include "parallel.h"
+#include <QVector>
+#include <cstring>
+
+QImage makeCanvas( const QSize& size )
+{
+    QImage canvas( size, QImage::Format_ARGB32 );
+    canvas.fill( 0 );
+    return canvas;
+}
+
+// per band bounding boxes, merged once every band is done
+class ChangedTask : public ParallelTask
+{
+public:
+    ChangedTask( const QImage& c, const QImage& f, const QRect& r, QRgb o, int bs )
+        : canvas(c), frame(f), region(r), opaque(o), bands(bs), rects(bs)
+    {
+    }
+    void run( int band )
+    {
+        int begin, end;
+        bandRange( band, bands, region.height(), begin, end );
+        int left = region.left();
+        int right = region.right();
+        int min_x = right + 1;
+        int max_x = left - 1;
+        int min_y = -1;
+        int max_y = -1;
+        for ( int y = region.top() + begin; y < region.top() + end; ++y )
+        {
+            const QRgb* c = (const QRgb*)canvas.scanLine( y );
+            const QRgb* f = (const QRgb*)frame.scanLine( y );
+            int x = left;
+            while ( x <= right && c[x] == ( f[x] | opaque ) )
+            {
+                ++x;
+            }
+            if ( x > right )
+            {
+                continue; // whole row unchanged
+            }
+            int last = right;
+            while ( c[last] == ( f[last] | opaque ) )
+            {
+                --last;
+            }
+            min_x = qMin( min_x, x );
+            max_x = qMax( max_x, last );
+            if ( min_y < 0 )
+            {
+                min_y = y;
+            }
+            max_y = y;
+        }
+        if ( min_y >= 0 )
+        {
+            rects[band] = QRect( QPoint( min_x, min_y ), QPoint( max_x, max_y ) );
+        }
+    }
+    QRect united() const
+    {
+        QRect r;
+        for ( int i = 0; i < rects.size(); ++i )
+        {
+            r |= rects[i];
+        }
+        return r;
+    }
+private:
+    const QImage& canvas;
+    const QImage& frame;
+    QRect region;
+    QRgb opaque; // or'ed into frame pixels before comparing
+    int bands;
+    QVector<QRect> rects;
+};
+
+QRect changedRect( const QImage& canvas, const QImage& frame, const QRect& region, bool keep_alpha )
+{
+    QRect r = region & canvas.rect() & frame.rect();
+    if ( r.isEmpty() )
+    {
+        return QRect();
+    }
+    int bands = bandCount( r.height() );
+    ChangedTask task( canvas, frame, r, keep_alpha ? 0 : 0xff000000, bands );
+    parallelRun( task, bands );
+    return task.united();
+}
+
+void maskUnchanged( QImage& indexed, const QPoint& offset, const QImage& canvas,
+                    const QImage& frame, int transparent )
+{
+    QRect r = QRect( offset, indexed.size() ) & canvas.rect() & frame.rect();
+    for ( int y = r.top(); y <= r.bottom(); ++y )
+    {
+        const QRgb* c = (const QRgb*)canvas.scanLine( y );
+        const QRgb* f = (const QRgb*)frame.scanLine( y );
+        uchar* out = indexed.scanLine( y - offset.y() ) - offset.x();
+        for ( int x = r.left(); x <= r.right(); ++x )
+        {
+            if ( c[x] == ( f[x] | 0xff000000 ) )
+            {
+                out[x] = transparent;
+            }
+        }
+    }
+}
+
+QImage blendFrame( const QImage& canvas, const QImage& frame, const QRect& rect, bool& blend )
+{
+    QImage sub = frame.copy( rect ).convertToFormat( QImage::Format_ARGB32 );
+    QRect r = rect & canvas.rect() & frame.rect();
+    blend = true;
+    for ( int y = r.top(); y <= r.bottom() && blend; ++y )
+    {
+        const QRgb* c = (const QRgb*)canvas.scanLine( y );
+        const QRgb* f = (const QRgb*)frame.scanLine( y );
+        for ( int x = r.left(); x <= r.right(); ++x )
+        {
+            if ( c[x] != f[x] && qAlpha( f[x] ) != 255 )
+            {
+                blend = false;
+                break;
+            }
+        }
+    }
+    if ( !blend )
+    {
+        return sub;
+    }
+    for ( int y = r.top(); y <= r.bottom(); ++y )
+    {
+        const QRgb* c = (const QRgb*)canvas.scanLine( y );
+        const QRgb* f = (const QRgb*)frame.scanLine( y );
+        QRgb* out = (QRgb*)sub.scanLine( y - rect.top() ) - rect.left();
+        for ( int x = r.left(); x <= r.right(); ++x )
+        {
+            if ( c[x] == f[x] )
+            {
+                out[x] = 0;
+            }
+        }
+    }
+    return sub;
+}
+
+// mix one 64 bit word into h, multiply then xorshift
+static inline quint64 mixWord( quint64 h, quint64 w )
+{
+    h ^= w;
+    h *= Q_UINT64_C(0x9e3779b97f4a7c15);
+    return h ^ ( h >> 29 );
+}
+
+static quint64 rowHash( const uchar* row, int bytes, quint64 h )
+{
+    int words = bytes / 8;
+    for ( int i = 0; i < words; ++i )
+    {
+        quint64 w;
+        memcpy( &w, row + i * 8, 8 );
+        h = mixWord( h, w );
+    }
+    if ( bytes % 8 )
+    {
+        quint64 w = 0;
+        memcpy( &w, row + words * 8, bytes % 8 );
+        h = mixWord( h, w );
+    }
+    return h;
+}
+
+class HashTask : public ParallelTask
+{
+public:
+    HashTask( const QImage& i, int bs )
+        : image(i), bands(bs), hashes(bs)
+    {
+    }
+    void run( int band )
+    {
+        int begin, end;
+        bandRange( band, bands, image.height(), begin, end );
+        int bytes = image.width() * image.depth() / 8;
+        quint64 h = band;
+        for ( int y = begin; y < end; ++y )
+        {
+            h = rowHash( image.scanLine( y ), bytes, h );
+        }
+        hashes[band] = h;
+    }
+    quint64 combined() const
+    {
+        quint64 h = ( (quint64)image.width() << 32 ) | image.height();
+        for ( int i = 0; i < hashes.size(); ++i )
+        {
+            h = mixWord( h, hashes[i] );
+        }
+        return h;
+    }
+private:
+    const QImage& image;
+    int bands;
+    QVector<quint64> hashes;
+};
+
+quint64 imageHash( const QImage& image )
+{
+    if ( image.isNull() )
+    {
+        return 0;
+    }
+    int bands = bandCount( image.height() );
+    HashTask task( image, bands );
+    parallelRun( task, bands );
+    return task.combined();
+}
+
+bool sameImage( const QImage& a, const QImage& b )
+{
+    if ( a.size() != b.size() || a.format() != b.format() )
+    {
+        return false;
+    }
+    int bytes = a.width() * a.depth() / 8;
+    for ( int y = 0; y < a.height(); ++y )
+    {
+        if ( memcmp( a.scanLine( y ), b.scanLine( y ), bytes ) != 0 )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void drawFrame( QImage& canvas, const QImage& frame, const QRect& rect, bool keep_alpha )
+{
+    QRgb opaque = keep_alpha ? 0 : 0xff000000;
+    QRect r = rect & canvas.rect() & frame.rect();
+    for ( int y = r.top(); y <= r.bottom(); ++y )
+    {
+        const QRgb* f = (const QRgb*)frame.scanLine( y );
+        QRgb* c = (QRgb*)canvas.scanLine( y );
+        for ( int x = r.left(); x <= r.right(); ++x )
+        {
+            c[x] = f[x] | opaque;
+        }
+    }
+}
+
+AnimFrame::AnimFrame()
+    : delay(0)
+    , blend(false)
+{
+}
+
+FrameDiffer::FrameDiffer( const FrameStore& s, int a )
+    : store(s)
+    , align(a)
+    , index(0)
+{
+    if ( !store.isEmpty() )
+    {
+        canvas = makeCanvas( store.imageSize( 0 ) );
+    }
+}
+
+bool FrameDiffer::next( AnimFrame& frame )
+{
+    if ( index >= store.size() )
+    {
+        return false;
+    }
+    int i = index++;
+    QImage image = store.at( i );
+    QRect region = canvas.rect();
+    if ( i > 0 && store.crop( i ).isValid() )
+    {
+        region &= store.crop( i );
+    }
+    QRect rect = region;
+    if ( i > 0 )
+    {
+        rect = changedRect( canvas, image, region, true );
+        if ( !rect.isValid() )
+        {
+            // nothing changed, but the delay still needs a frame
+            rect = QRect( region.isValid() ? region.topLeft() : QPoint(0, 0), QSize(1, 1) );
+        }
+        rect.setLeft( rect.left() / align * align );
+        rect.setTop( rect.top() / align * align );
+    }
+    frame.image = blendFrame( canvas, image, rect, frame.blend );
+    frame.offset = rect.topLeft();
+    frame.delay = store.delay( i );
+    drawFrame( canvas, image, rect, true );
+    return true;
+}
@@ -0,0 +1,76 @@
+#ifndef FRAMES_H
+#define FRAMES_H
+
+#include <QImage>
+#include <QRect>
+#include <QVector>
+#include "framestore.h"
+
+// Frame differencing for animated output. A canvas holds what a viewer
+// shows once the previous frames have been drawn, as 0 initialized
+// ARGB32 pixels in the frames' premultiplied format.
+//
+// Formats without alpha (gif) compare color only: the canvas stores
+// pixels forced opaque, so that undrawn pixels never match a frame.
+// With keep_alpha whole pixels are compared, and an undrawn canvas is
+// fully transparent, as it is for viewers of formats with alpha.
+
+QImage makeCanvas( const QSize& size );
+
+// bounding box of the pixels of frame inside region which differ from
+// the canvas, or a null rect if there are none
+QRect changedRect( const QImage& canvas, const QImage& frame, const QRect& region,
+                   bool keep_alpha = false );
+
+// set pixels of the indexed image (drawn at offset) which already show
+// on the canvas to the transparent index
+void maskUnchanged( QImage& indexed, const QPoint& offset, const QImage& canvas,
+                    const QImage& frame, int transparent );
+
+// rect of frame as non-premultiplied ARGB32 with the pixels which
+// already show on a keep_alpha canvas made transparent, for formats
+// which blend frames over the canvas. A changed pixel which isn't
+// opaque would let the canvas show through, so then the rect is
+// returned as is and blend is set false.
+QImage blendFrame( const QImage& canvas, const QImage& frame, const QRect& rect, bool& blend );
+
+// hash of the pixels of image, for spotting repeated frames. Each band
+// of rows gets its own hash, in parallel for large images, and the band
+// hashes are combined. Equal hashes don't prove equal images, check
+// with sameImage before relying on it.
+quint64 imageHash( const QImage& image );
+
+// true when a and b have the same size, format and pixels
+bool sameImage( const QImage& a, const QImage& b );
+
+// draw rect of frame onto the canvas
+void drawFrame( QImage& canvas, const QImage& frame, const QRect& rect, bool keep_alpha = false );
+
+// A frame for formats which keep alpha and take frame offsets (apng,
+// webp), holding only what changed since the previous frame
+struct AnimFrame
+{
+    AnimFrame();
+    QImage image;  // non-premultiplied ARGB32
+    QPoint offset;
+    int delay;     // milliseconds
+    bool blend;    // blend over the canvas, else replace the area
+};
+
+// diffs the frames of store in order, each against what the ones
+// before it left on the canvas, one at a time so a writer can encode
+// them as they come. The first frame always covers the whole canvas.
+// Offsets are rounded down to a multiple of align.
+class FrameDiffer
+{
+public:
+    FrameDiffer( const FrameStore& store, int align = 1 );
+    bool next( AnimFrame& frame ); // false once every frame is done
+private:
+    const FrameStore& store;
+    int align;
+    int index;
+    QImage canvas;
+};
+
+#endif
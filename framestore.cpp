@@ -0,0 +1,171 @@
+#include "framestore.h"
+#include "frames.h"
+#include <cstring>
+
+// a full frame at least this often, bounding the work of random access
+#define KEYFRAME_INTERVAL 32
+// deflate level: snapshots are stored for one request only, so favour
+// speed over size
+#define STORE_LEVEL 1
+
+FrameStore::Entry::Entry()
+    : null(true)
+    , key(false)
+    , delay(0)
+{
+}
+
+FrameStore::FrameStore()
+    : since_key(0)
+    , cached_index(-1)
+{
+}
+
+static QByteArray packRect( const QImage& image, const QRect& rect )
+{
+    int row_bytes = rect.width() * 4;
+    QByteArray rows( row_bytes * rect.height(), 0 );
+    char* out = rows.data();
+    for ( int y = rect.top(); y <= rect.bottom(); ++y )
+    {
+        memcpy( out, image.scanLine( y ) + rect.left() * 4, row_bytes );
+        out += row_bytes;
+    }
+    return qCompress( rows, STORE_LEVEL );
+}
+
+void FrameStore::append( const QImage& src, int delay, const QRect& crop )
+{
+    Entry entry;
+    entry.delay = delay;
+    entry.crop = crop;
+    if ( !src.isNull() )
+    {
+        QImage image = src;
+        if ( image.format() != QImage::Format_ARGB32_Premultiplied )
+        {
+            image = image.convertToFormat( QImage::Format_ARGB32_Premultiplied );
+        }
+        entry.null = false;
+        entry.size = image.size();
+        entry.key = previous.isNull() || previous.size() != image.size() || since_key >= KEYFRAME_INTERVAL;
+        entry.rect = entry.key ? image.rect() : changedRect( previous, image, image.rect(), true );
+        if ( entry.rect.isValid() )
+        {
+            entry.data = packRect( image, entry.rect );
+        }
+        since_key = entry.key ? 1 : since_key + 1;
+        previous = image;
+    }
+    entries.push_back( entry );
+}
+
+void FrameStore::clear()
+{
+    entries.clear();
+    previous = QImage();
+    since_key = 0;
+    cached = QImage();
+    cached_index = -1;
+}
+
+int FrameStore::size() const
+{
+    return entries.size();
+}
+
+bool FrameStore::isEmpty() const
+{
+    return entries.isEmpty();
+}
+
+void FrameStore::apply( const Entry& entry, QImage& image ) const
+{
+    if ( entry.key )
+    {
+        image = QImage( entry.size, QImage::Format_ARGB32_Premultiplied );
+    }
+    if ( !entry.rect.isValid() )
+    {
+        return;
+    }
+    QByteArray rows = qUncompress( entry.data );
+    int row_bytes = entry.rect.width() * 4;
+    const char* in = rows.constData();
+    for ( int y = entry.rect.top(); y <= entry.rect.bottom(); ++y )
+    {
+        memcpy( image.scanLine( y ) + entry.rect.left() * 4, in, row_bytes );
+        in += row_bytes;
+    }
+}
+
+QImage FrameStore::at( int index ) const
+{
+    if ( entries[index].null )
+    {
+        return QImage();
+    }
+    if ( index == cached_index )
+    {
+        return cached;
+    }
+    // walk back to the cached frame or a keyframe, whichever is nearer.
+    // Null entries don't take part in the chain.
+    int start = index;
+    while ( !entries[start].key && start != cached_index )
+    {
+        --start;
+    }
+    QImage image;
+    if ( start == cached_index )
+    {
+        image = cached;
+        cached = QImage(); // don't let the cache force a copy
+        ++start;
+    }
+    for ( int i = start; i <= index; ++i )
+    {
+        if ( !entries[i].null )
+        {
+            apply( entries[i], image );
+        }
+    }
+    cached = image;
+    cached_index = index;
+    return image;
+}
+
+QImage FrameStore::last() const
+{
+    return at( entries.size() - 1 );
+}
+
+void FrameStore::addDelay( int index, int delay )
+{
+    entries[index].delay += delay;
+}
+
+int FrameStore::delay( int index ) const
+{
+    return entries[index].delay;
+}
+
+QRect FrameStore::crop( int index ) const
+{
+    return entries[index].crop;
+}
+
+QSize FrameStore::imageSize( int index ) const
+{
+    return entries[index].size;
+}
+
+qint64 FrameStore::storedBytes() const
+{
+    qint64 bytes = 0;
+    for ( int i = 0; i < entries.size(); ++i )
+    {
+        bytes += entries[i].data.size();
+    }
+    return bytes;
+}
@@ -0,0 +1,60 @@
+#ifndef FRAMESTORE_H
+#define FRAMESTORE_H
+
+#include <QImage>
+#include <QRect>
+#include <QVector>
+#include <QByteArray>
+
+// Snapshots of an animation, kept compressed until they're encoded.
+// Each frame is stored as the rect which changed since the frame before
+// it, deflated, with a full keyframe every so often. Frames are decoded
+// on demand; going through them in order only ever decodes one frame's
+// changes at a time. The writers encode and write a batch of frames
+// (see frameBatch in parallel.h) before decoding the next.
+//
+// Delays are in milliseconds, as snapshotPage takes them. Each format
+// writer converts to its own unit: centiseconds for gif, a fraction
+// of a second for apng, milliseconds for webp.
+//
+// Not thread safe: at() updates a cache even though it's const.
+class FrameStore
+{
+public:
+    FrameStore();
+
+    // a null image is kept as a placeholder and decodes as null
+    void append( const QImage& image, int delay, const QRect& crop );
+    void clear();
+    void addDelay( int index, int delay ); // show a frame for longer, milliseconds
+
+    int size() const;
+    bool isEmpty() const;
+    QImage at( int index ) const; // premultiplied ARGB32
+    QImage last() const;
+    int delay( int index ) const; // milliseconds
+    QRect crop( int index ) const;
+    QSize imageSize( int index ) const;
+
+    qint64 storedBytes() const; // compressed size of every frame
+private:
+    struct Entry
+    {
+        Entry();
+        bool null;
+        bool key;        // full frame, else changes to the frame before
+        QSize size;      // of the whole frame
+        QRect rect;      // area held in data, invalid if nothing changed
+        QByteArray data; // deflated rows of rect
+        int delay;
+        QRect crop;
+    };
+    void apply( const Entry& entry, QImage& image ) const;
+    QVector<Entry> entries;
+    QImage previous;      // last non-null frame appended, to diff against
+    int since_key;
+    mutable QImage cached;
+    mutable int cached_index;
+};
+
+#endif
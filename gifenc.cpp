@@ -0,0 +1,359 @@
+#include "gifenc.h"
+#include "parallel.h"
+#include <QIODevice>
+#include <QScopedPointer>
+#include <QPair>
+#include <QtAlgorithms>
+#include <cstring>
+
+#define LZW_MAX_CODE 4095 // codes are at most 12 bits
+#define LZW_HASH_BITS 13  // twice the number of codes, keeps probes short
+#define LZW_HASH_SIZE (1 << LZW_HASH_BITS)
+
+GifFrame::GifFrame()
+    : delay(0)
+    , transparent(-1)
+    , local_palette(false)
+    , code_size(2)
+{
+}
+
+int gifColorBits( int colors )
+{
+    int bits = 1;
+    while ( ( 1 << bits ) < colors && bits < 8 )
+    {
+        ++bits;
+    }
+    return bits;
+}
+
+// Packs variable width codes into 255 byte sub-blocks
+class CodeWriter
+{
+public:
+    CodeWriter( QByteArray& o )
+        : out(o), accum(0), accum_bits(0), block_start(-1)
+    {
+    }
+    void write( int code, int bits )
+    {
+        accum |= (quint32)code << accum_bits;
+        accum_bits += bits;
+        while ( accum_bits >= 8 )
+        {
+            put( accum & 0xff );
+            accum >>= 8;
+            accum_bits -= 8;
+        }
+    }
+    void finish()
+    {
+        if ( accum_bits > 0 )
+        {
+            put( accum & 0xff );
+        }
+        accum = 0;
+        accum_bits = 0;
+        out.append( (char)0 ); // block terminator
+    }
+private:
+    void put( int byte )
+    {
+        if ( block_start < 0 || out.size() - block_start - 1 == 255 )
+        {
+            block_start = out.size();
+            out.append( (char)0 );
+        }
+        out.append( (char)byte );
+        ++out.data()[block_start];
+    }
+    QByteArray& out;
+    quint32 accum;
+    int accum_bits;
+    int block_start; // offset of the current sub-block's length byte
+};
+
+// Open addressing table from (prefix code, next index) to code
+class LzwTable
+{
+public:
+    LzwTable()
+    {
+        clear();
+    }
+    void clear()
+    {
+        memset( keys, 0xff, sizeof(keys) );
+    }
+    int find( int key ) const
+    {
+        for ( uint slot = hash( key ); ; slot = ( slot + 1 ) & ( LZW_HASH_SIZE - 1 ) )
+        {
+            if ( keys[slot] == key )
+            {
+                return codes[slot];
+            }
+            if ( keys[slot] < 0 )
+            {
+                return -1;
+            }
+        }
+    }
+    void insert( int key, int code )
+    {
+        uint slot = hash( key );
+        while ( keys[slot] >= 0 )
+        {
+            slot = ( slot + 1 ) & ( LZW_HASH_SIZE - 1 );
+        }
+        keys[slot] = key;
+        codes[slot] = code;
+    }
+private:
+    static uint hash( int key )
+    {
+        return ( (uint)key * 2654435761u ) >> ( 32 - LZW_HASH_BITS );
+    }
+    int keys[LZW_HASH_SIZE]; // prefix << 8 | index, -1 when empty
+    short codes[LZW_HASH_SIZE];
+};
+
+// Palette entries close enough to stand in for each entry, nearest
+// first. The transparent index never substitutes or gets substituted.
+static QVector< QVector<uchar> > nearIndices( const QVector<QRgb>& palette, int lossiness, int transparent )
+{
+    QVector< QVector<uchar> > nearby( 256 );
+    int max_dist = lossiness * lossiness;
+    for ( int i = 0; i < palette.size() && i < 256; ++i )
+    {
+        if ( i == transparent )
+        {
+            continue;
+        }
+        QVector< QPair<int, int> > candidates; // distance, index
+        for ( int j = 0; j < palette.size() && j < 256; ++j )
+        {
+            if ( j == i || j == transparent )
+            {
+                continue;
+            }
+            int dr = qRed( palette[i] ) - qRed( palette[j] );
+            int dg = qGreen( palette[i] ) - qGreen( palette[j] );
+            int db = qBlue( palette[i] ) - qBlue( palette[j] );
+            int dist = dr*dr + dg*dg + db*db;
+            if ( dist <= max_dist )
+            {
+                candidates.push_back( qMakePair( dist, j ) );
+            }
+        }
+        qSort( candidates );
+        for ( int k = 0; k < candidates.size(); ++k )
+        {
+            nearby[i].push_back( candidates[k].second );
+        }
+    }
+    return nearby;
+}
+
+QByteArray gifEncodeImage( const QImage& indexed, int code_size, int lossiness, int transparent )
+{
+    QVector< QVector<uchar> > nearby;
+    if ( lossiness > 0 )
+    {
+        nearby = nearIndices( indexed.colorTable(), lossiness, transparent );
+    }
+
+    QByteArray out;
+    out.append( (char)code_size );
+    CodeWriter writer( out );
+
+    // the table is 48k, too big for the stack of a pool thread
+    QScopedPointer<LzwTable> table( new LzwTable );
+    const int clear_code = 1 << code_size;
+    const int eoi_code = clear_code + 1;
+    int bits = code_size + 1;
+    int next_code = eoi_code + 1;
+
+    // Same code width rules as giflib: the width grows once the next
+    // free code no longer fits, and a full table is cleared.
+    writer.write( clear_code, bits );
+    int prefix = -1;
+    for ( int y = 0; y < indexed.height(); ++y )
+    {
+        const uchar* line = indexed.scanLine( y );
+        for ( int x = 0; x < indexed.width(); ++x )
+        {
+            int index = line[x];
+            if ( prefix < 0 )
+            {
+                prefix = index;
+                continue;
+            }
+            int key = ( prefix << 8 ) | index;
+            int code = table->find( key );
+            if ( code >= 0 )
+            {
+                prefix = code;
+                continue;
+            }
+            if ( lossiness > 0 )
+            {
+                // lossy: extend the current string with a close enough
+                // color instead of starting a new one
+                const QVector<uchar>& alternatives = nearby[index];
+                for ( int k = 0; k < alternatives.size() && code < 0; ++k )
+                {
+                    code = table->find( ( prefix << 8 ) | alternatives[k] );
+                }
+                if ( code >= 0 )
+                {
+                    prefix = code;
+                    continue;
+                }
+            }
+            writer.write( prefix, bits );
+            if ( next_code >= ( 1 << bits ) && bits < 12 )
+            {
+                ++bits;
+            }
+            if ( next_code >= LZW_MAX_CODE )
+            {
+                writer.write( clear_code, bits );
+                table->clear();
+                bits = code_size + 1;
+                next_code = eoi_code + 1;
+            }
+            else
+            {
+                table->insert( key, next_code++ );
+            }
+            prefix = index;
+        }
+    }
+    if ( prefix >= 0 )
+    {
+        writer.write( prefix, bits );
+        if ( next_code >= ( 1 << bits ) && bits < 12 )
+        {
+            ++bits;
+        }
+    }
+    writer.write( eoi_code, bits );
+    writer.finish();
+    return out;
+}
+
+class EncodeTask : public ParallelTask
+{
+public:
+    EncodeTask( GifFrame* f, int g, int l )
+        : frames(f), global_colors(g), lossiness(l)
+    {
+    }
+    void run( int index )
+    {
+        GifFrame& frame = frames[index];
+        int colors = frame.local_palette ? frame.indexed.colorCount() : global_colors;
+        colors = qMax( colors, frame.transparent + 1 );
+        // the LZW minimum code size can't be below 2
+        frame.code_size = qMax( 2, gifColorBits( colors ) );
+        frame.data = gifEncodeImage( frame.indexed, frame.code_size, lossiness, frame.transparent );
+    }
+private:
+    GifFrame* frames;
+    int global_colors;
+    int lossiness;
+};
+
+void gifEncodeFrames( QVector<GifFrame>& frames, int global_colors, int lossiness )
+{
+    EncodeTask task( frames.data(), global_colors, lossiness ); // detach before the workers start
+    parallelRun( task, frames.size() );
+}
+
+static void putShort( QByteArray& out, int v )
+{
+    out.append( (char)( v & 0xff ) );
+    out.append( (char)( ( v >> 8 ) & 0xff ) );
+}
+
+static void putColorTable( QByteArray& out, const QVector<QRgb>& palette, int bits )
+{
+    int size = 1 << bits;
+    for ( int i = 0; i < size; ++i )
+    {
+        // pad with black up to the power of 2 size
+        QRgb c = i < palette.size() ? palette[i] : 0;
+        out.append( (char)qRed( c ) );
+        out.append( (char)qGreen( c ) );
+        out.append( (char)qBlue( c ) );
+    }
+}
+
+bool gifWriteHeader( QIODevice* out, const QSize& screen, const QVector<QRgb>& global_palette, bool loop )
+{
+    // header, logical screen descriptor and global color table
+    QByteArray head( "GIF89a" );
+    int global_bits = gifColorBits( global_palette.size() );
+    putShort( head, screen.width() );
+    putShort( head, screen.height() );
+    head.append( (char)( 0x80 | 0x70 | ( global_bits - 1 ) ) ); // 8 bit color resolution
+    head.append( (char)0 );                                     // background
+    head.append( (char)0 );                                     // aspect ratio
+    putColorTable( head, global_palette, global_bits );
+
+    if ( loop )
+    {
+        const int loop_count = 0; // forever
+        head.append( "\x21\xff\x0b" "NETSCAPE2.0" "\x03\x01", 16 );
+        putShort( head, loop_count );
+        head.append( (char)0 );
+    }
+    return out->write( head ) == head.size();
+}
+
+bool gifWriteFrames( QIODevice* out, const QVector<GifFrame>& frames )
+{
+    for ( int i = 0; i < frames.size(); ++i )
+    {
+        const GifFrame& frame = frames[i];
+        QByteArray desc;
+
+        // graphic control extension. Disposal method 1 leaves the frame
+        // in place for the next one to draw over.
+        desc.append( "\x21\xf9\x04", 3 );
+        desc.append( (char)( 0x04 | ( frame.transparent >= 0 ? 0x01 : 0x00 ) ) );
+        putShort( desc, frame.delay );
+        desc.append( (char)( frame.transparent >= 0 ? frame.transparent : 0 ) );
+        desc.append( (char)0 );
+
+        // image descriptor and local color table
+        desc.append( (char)0x2c );
+        putShort( desc, frame.offset.x() );
+        putShort( desc, frame.offset.y() );
+        putShort( desc, frame.indexed.width() );
+        putShort( desc, frame.indexed.height() );
+        if ( frame.local_palette )
+        {
+            int bits = gifColorBits( qMax( frame.indexed.colorCount(), frame.transparent + 1 ) );
+            desc.append( (char)( 0x80 | ( bits - 1 ) ) );
+            putColorTable( desc, frame.indexed.colorTable(), bits );
+        }
+        else
+        {
+            desc.append( (char)0 );
+        }
+        if ( out->write( desc ) != desc.size()
+             || out->write( frame.data ) != frame.data.size() )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool gifWriteTrailer( QIODevice* out )
+{
+    return out->write( "\x3b", 1 ) == 1;
+}
@@ -0,0 +1,45 @@
+#ifndef GIFENC_H
+#define GIFENC_H
+
+#include <QImage>
+#include <QByteArray>
+#include <QVector>
+#include <QPoint>
+
+class QIODevice;
+
+// A GIF89a writer for any QIODevice. Each frame's LZW data only depends
+// on the frame itself, so a batch of frames is compressed in parallel
+// and then written out in order, before the next batch is made.
+
+struct GifFrame
+{
+    GifFrame();
+    QImage indexed;     // Format_Indexed8
+    QPoint offset;      // position on the logical screen
+    int delay;          // centiseconds, as the graphic control extension has it
+    int transparent;    // index left transparent, or -1
+    bool local_palette; // write the image's own color table
+    int code_size;      // LZW minimum code size, set by gifEncodeFrames
+    QByteArray data;    // LZW image data, set by gifEncodeFrames
+};
+
+// bits per index needed for colors palette entries, at least 1
+int gifColorBits( int colors );
+
+// LZW compress an indexed image into GIF image data sub-blocks. With
+// lossiness, pixels may be swapped for palette entries up to that RGB
+// distance away when it extends the current LZW string.
+QByteArray gifEncodeImage( const QImage& indexed, int code_size, int lossiness = 0, int transparent = -1 );
+
+// compress every frame on the worker pool. Frames without a local
+// palette use global_colors entries of the global one.
+void gifEncodeFrames( QVector<GifFrame>& frames, int global_colors, int lossiness = 0 );
+
+// header, logical screen and global palette, then any number of
+// gifWriteFrames, then the trailer
+bool gifWriteHeader( QIODevice* out, const QSize& screen, const QVector<QRgb>& global_palette, bool loop );
+bool gifWriteFrames( QIODevice* out, const QVector<GifFrame>& frames );
+bool gifWriteTrailer( QIODevice* out );
+
+#endif
@@ -10,6 +10,9 @@ TEMPLATE = app
 TARGET = ichabod
 INCLUDEPATH += . mongoose giflib/lib
 CONFIG += debug
+# the image kernels (quantizers, dithering, resampling) are written to be
+# auto-vectorized, and are many times slower unoptimized
+QMAKE_CXXFLAGS += -O2 -ftree-vectorize
 
 # mongoose
 SOURCES += mongoose/mongoose.c
@@ -35,8 +38,23 @@ SOURCES += statsd-client-cpp/src/statsd_client.cpp
 INCLUDEPATH += netpbm netpbm/lib
 LIBS += -Lnetpbm/lib -lnetpbm
 
+# libwebp
+LIBS += -lwebpmux -lwebp
+
+# strip encoders. zlib resolves against the copy inside QtCore.
+LIBS += -ljpeg -lz
+
+# compressed request bodies, zlib as above
+LIBS += -lzstd
+
+# shm_open, where there's no memfd_create
+LIBS += -lrt
+
 # ichabod
 HEADERS += conv.h engine.h
-SOURCES += agif.cpp conv.cpp main.cpp mediancut.cpp engine.cpp
+SOURCES += agif.cpp conv.cpp main.cpp mediancut.cpp engine.cpp palette.cpp parallel.cpp \
+           quantizer.cpp wu.cpp octree.cpp frames.cpp gifenc.cpp \
+           apng.cpp awebp.cpp png8.cpp still.cpp \
+           pngchunk.cpp strip.cpp framestore.cpp vtime.cpp sprite.cpp templates.cpp resample.cpp writer.cpp trim.cpp unixsocket.cpp decompress.cpp
 
 
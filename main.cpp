@@ -20,8 +20,17 @@
 #include "conv.h"
 #include "quant.h"
 #include "engine.h"
+#include "parallel.h"
+#include "agif.h"
+#include "templates.h"
+#include "resample.h"
+#include "writer.h"
+#include "unixsocket.h"
+#include "decompress.h"
+#include <unistd.h>
 
 #define ICHABOD_NAME "ichabod"
+#define SOCKET_POLL_MS 10 // turns between the unix socket and mongoose
 #define LOG_STRING "%1 %2x%3 %4 %5 %6 %7x%8+%9+%10 [%11ms] [%12ms]" // input WxH format output selector croprect [convert_elapsedms] [run_elapsedms]
 
 int g_verbosity = 0;
@@ -29,20 +38,28 @@ int g_engine_verbosity = 0;
 int g_convert_verbosity = 0;
 int g_slow_response_ms = 15 * 1000;
 QString g_quantize = "MEDIANCUT";
+int g_quantize_threads = 0;
+int g_quantize_kmeans = 0;
+int g_max_templates = 32;
+QString g_fsync = "none";
+int g_fsync_batch_ms = 5;
+QString g_socket; // path of the unix socket, see unixsocket.h
+int g_max_body_bytes = 64 << 20; // of a request body, once decompressed
+TemplateRegistry* g_templates = 0;
 statsd::StatsdClient g_statsd;
 
-void log( struct mg_connection* conn, const char* extra )
+void log( const char* source, const char* extra )
 {
-    std::cerr << conn->uri << " - " << extra << std::endl;
+    std::cerr << source << " - " << extra << std::endl;
 }
 
-// output error and send error back to client
-static int send_error(struct mg_connection* conn, const char* err)
+void log( struct mg_connection* conn, const char* extra )
 {
-    log(conn, err);
-    mg_send_status(conn, 500);
-    mg_send_header(conn, "X-Error-Message", err);
+    log( conn->uri, extra );
+}
 
+static std::string error_json(const char* err)
+{
     Json::Value root;
     root["path"] = Json::Value();
     root["elapsed"] = Json::Value();
@@ -55,17 +72,32 @@ static int send_error(struct mg_connection* conn, const char* err)
     root["errors"] = js_errors;
 
     Json::StyledWriter writer;
-    std::string json = writer.write(root);
+    return writer.write(root);
+}
+
+// output error and send error back to client
+static int send_error(struct mg_connection* conn, const char* err)
+{
+    log(conn, err);
+    mg_send_status(conn, 500);
+    mg_send_header(conn, "X-Error-Message", err);
+    std::string json = error_json(err);
     mg_send_data(conn, json.c_str(), json.length());
     return MG_TRUE;
 }
 
-// either get the POST variable, or returning empty string
+// either get the POST variable, or returning empty string. The buffer
+// is kept as large as the body, so no variable is too big for it.
 // WARNING: this function is not re-entrant
 static QString get_var( struct mg_connection *conn, const char* var_name, const QString default_string = QString() )
 {
-    static char data[20971520];
-    int r = mg_get_var(conn, var_name, data, sizeof(data));
+    static QByteArray data;
+    int needed = conn->content_len + ( conn->query_string ? strlen(conn->query_string) : 0 ) + 1;
+    if ( data.size() < needed )
+    {
+        data.resize( needed );
+    }
+    int r = mg_get_var(conn, var_name, data.data(), data.size());
     switch( r )
     {
     case -1: // not found
@@ -73,9 +105,73 @@ static QString get_var( struct mg_connection *conn, const char* var_name, const
     case -2: // too big
         return default_string;
     }
-    return QString(data);
+    return QString(data.constData());
+}
+
+// point the content of conn at its decompressed body, returning why it
+// can't be. The caller puts the original content back.
+static QString decode_body( struct mg_connection *conn )
+{
+    static QByteArray body; // grown to the largest body seen, and reused
+    const char* encoding = mg_get_header(conn, "Content-Encoding");
+    if ( !encoding || !isCompressed( encoding ) )
+    {
+        if ( conn->content_len > (size_t)g_max_body_bytes )
+        {
+            return QString("Request body is larger than %1 bytes").arg(g_max_body_bytes);
+        }
+        return QString();
+    }
+    qint64 length = 0;
+    QString err;
+    if ( !decompressBody( encoding, conn->content, conn->content_len, g_max_body_bytes, body, length, err ) )
+    {
+        return err;
+    }
+    conn->content = body.data();
+    conn->content_len = length;
+    return QString();
 }
 
+// variables of a request, from an http form or a unix socket frame
+class RequestVars
+{
+public:
+    virtual ~RequestVars() {}
+    virtual QString get( const char* var_name, const QString& default_string = QString() ) = 0;
+};
+
+class HttpVars : public RequestVars
+{
+public:
+    HttpVars( struct mg_connection* c ) : conn(c) {}
+    QString get( const char* var_name, const QString& default_string = QString() )
+    {
+        return get_var( conn, var_name, default_string );
+    }
+private:
+    struct mg_connection* conn;
+};
+
+class FrameVars : public RequestVars
+{
+public:
+    FrameVars( const QList<FrameField>& f ) : fields(f) {}
+    QString get( const char* var_name, const QString& default_string = QString() )
+    {
+        for ( int i = 0; i < fields.size(); ++i )
+        {
+            if ( fields[i].name == var_name )
+            {
+                return fields[i].toString();
+            }
+        }
+        return default_string;
+    }
+private:
+    const QList<FrameField>& fields;
+};
+
 static void send_headers(struct mg_connection* conn)
 {
     mg_send_header(conn, "Content-Type", "application/json");
@@ -105,7 +201,24 @@ void debug_settings(const Settings& settings, const QString& script_result,
         std::cout << "     was slow: " << (run_elapsedms > settings.slow_response_ms) << std::endl;
         std::cout << "script result: " << script_result.toLocal8Bit().constData() << std::endl;            
         std::cout << "      quality: " << settings.quality << std::endl;
-        std::cout << "     quantize: " << settings.quantize_method << std::endl;
+        std::cout << "     quantize: " << settings.quantizer->name().toLocal8Bit().constData() << std::endl;
+        std::cout << "       kmeans: " << settings.quantize_options.kmeans_iterations << std::endl;
+        std::cout << " gif optimize: " << settings.gif_options.optimize << std::endl;
+        std::cout << "  gif palette: sample " << settings.gif_options.palette_sample
+                  << " local threshold " << settings.gif_options.local_palette_threshold << std::endl;
+        std::cout << "gif lossiness: " << settings.gif_options.lossiness << std::endl;
+        std::cout << "    png8 auto: " << settings.png8_auto << std::endl;
+        std::cout << "  auto budget: " << settings.auto_options.max_bytes
+                  << " min quality " << settings.auto_options.min_quality << std::endl;
+        std::cout << "       stream: " << settings.stream << std::endl;
+        std::cout << "        scale: " << settings.scale << " max " << settings.max_width << "x" << settings.max_height << std::endl;
+        std::cout << " device scale: " << settings.device_scale_factor << std::endl;
+        std::cout << "     autotrim: " << settings.autotrim << " tolerance " << settings.autotrim_tolerance << std::endl;
+        std::cout << "    selectors: " << settings.selectors.size() << " sprite " << settings.sprite << std::endl;
+        std::cout << "       widths: " << settings.widths.size() << std::endl;
+        std::cout << "      outputs: " << settings.outputs.size() << std::endl;
+        std::cout << "  fire+forget: " << settings.fire_and_forget << std::endl;
+        std::cout << " virtual time: " << settings.virtual_time << std::endl;
         std::cout << "          fmt: " << settings.fmt.toLocal8Bit().constData() << std::endl;
         std::cout << "  transparent: " << settings.transparent << std::endl;
         std::cout << "  smart width: " << settings.smart_width << std::endl;
@@ -153,30 +266,129 @@ void debug_settings(const Settings& settings, const QString& script_result,
     }
 }
 
-static int handle_default(struct mg_connection *conn, Settings& settings)
+static Json::Value json_list( const QVector<QString>& list )
 {
-    send_headers(conn);
-    if ( !settings.run_scripts.size() )
+    Json::Value js_list;
+    for ( int i = 0; i < list.size(); ++i )
     {
-        return send_error(conn, "Internal error: no scripts");
+        js_list.append( list[i].toLocal8Bit().constData() );
+    }
+    return js_list;
+}
+
+// a response waiting for its output files to be written, see writer.h
+struct PendingResponse
+{
+    Settings settings;
+    QString result;
+    QVector<QString> warnings;
+    QVector<QString> errors;
+    bool conversion;
+    double run_elapsedms;
+    double convert_elapsedms;
+    Json::Value root; // all but what depends on the writes
+    QVector<WriteRef> writes;
+    QVector<InlineFile> files; // with settings.inline_output, instead of writes
+};
+
+static bool writes_finished( const QVector<WriteRef>& writes )
+{
+    for ( int i = 0; i < writes.size(); ++i )
+    {
+        if ( !writeFinished( writes[i] ) )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// fill in the results of the writes, returning the json to respond
+// with. With fire_and_forget the writes may still be going, and only
+// their sizes are known. source names the request in the log.
+static std::string complete_response(PendingResponse& r, const char* source)
+{
+    const Settings& settings = r.settings;
+    Json::Value& root = r.root;
+    double write_elapsedms = 0;
+    qint64 output_bytes = 0;
+    for ( int i = 0; i < r.writes.size(); ++i )
+    {
+        const WriteResult& w = *r.writes[i];
+        if ( !settings.fire_and_forget )
+        {
+            write_elapsedms = qMax( write_elapsedms, w.write_ms );
+            if ( !w.ok )
+            {
+                r.errors.push_back( w.error );
+                std::cerr << w.error.toLocal8Bit().constData() << std::endl;
+                r.conversion = false;
+                continue;
+            }
+        }
+        if ( w.path == settings.out )
+        {
+            output_bytes = w.bytes;
+        }
     }
+    for ( int i = 0; i < r.files.size(); ++i )
+    {
+        if ( r.files[i].path == settings.out )
+        {
+            output_bytes = r.files[i].bytes;
+        }
+    }
+    debug_settings( settings, r.result, r.warnings, r.errors, r.conversion, r.run_elapsedms, r.convert_elapsedms );
+    root["conversion"] = r.conversion;
+    root["output_bytes"] = (int)( r.conversion ? output_bytes : 0 );
+    root["write_elapsed"] = write_elapsedms;
+    root["errors"] = json_list( r.errors );
+    Json::StyledWriter writer;
+    std::string json = writer.write(root);
 
+    if ( settings.statsd )
+    {
+        settings.statsd->inc(settings.statsd_ns + "request");
+        if ( !settings.fire_and_forget && r.writes.size() )
+        {
+            settings.statsd->timing(settings.statsd_ns + "write", write_elapsedms);
+        }
+    }
+
+    QString xtra = QString(LOG_STRING).arg(settings.in).arg(settings.screen_width).arg(settings.screen_height).arg(settings.out).arg(settings.fmt)
+        .arg(settings.selector.length()?settings.selector:"''")
+        .arg(settings.crop_rect.width()).arg(settings.crop_rect.height()).arg(settings.crop_rect.x()).arg(settings.crop_rect.y())
+        .arg(r.run_elapsedms).arg(r.convert_elapsedms);
+    log( source, xtra.toLocal8Bit().constData() );
+    return json;
+}
+
+static int finish_response(struct mg_connection *conn, PendingResponse& r)
+{
+    std::string json = complete_response( r, conn->uri );
+    mg_send_data(conn, json.c_str(), json.length());
+    return MG_TRUE;
+}
+
+// run the scripts of settings, page is a template's, already loaded, or
+// 0 to load settings.in. The response is finished by complete_response.
+static PendingResponse* render(Settings& settings, WebPage* page)
+{
     // hook up converter to engine
-    Engine engine(settings);
-    Converter converter(&engine, settings);
+    QScopedPointer<Engine> engine( page ? new Engine(settings, page) : new Engine(settings) );
+    Converter converter(engine.data(), settings);
 
-    bool conversion_success = engine.run();
+    bool conversion_success = engine->run();
 
     // collect info
-    QString result = engine.scriptResult();
-    double run_elapsedms = engine.runTime();
-    double convert_elapsedms = engine.convertTime();
+    QString result = engine->scriptResult();
+    double run_elapsedms = engine->runTime();
+    double convert_elapsedms = engine->convertTime();
     QVector<QString> warnings = converter.warnings();
-    QVector<QString> errors = converter.errors();
-    debug_settings( settings, result, warnings, errors, conversion_success, run_elapsedms, convert_elapsedms );
 
-    // create json return
-    Json::Value root;
+    // create json return, finished in finish_response
+    PendingResponse* pending = new PendingResponse();
+    Json::Value& root = pending->root;
     root["path"] = settings.out.toLocal8Bit().constData();
 
     Json::Reader reader;
@@ -191,6 +403,7 @@ static int handle_default(struct mg_connection *conn, Settings& settings)
     root["conversion"] = conversion_success;
     root["run_elapsed"] = run_elapsedms;
     root["convert_elapsed"] = convert_elapsedms;
+    root["format"] = converter.format().toLocal8Bit().constData();
     Json::Value js_warnings;
     for( QVector<QString>::iterator it = warnings.begin();
          it != warnings.end();
@@ -199,28 +412,231 @@ static int handle_default(struct mg_connection *conn, Settings& settings)
         js_warnings.append( it->toLocal8Bit().constData() );
     }
     root["warnings"] = js_warnings;
-    Json::Value js_errors;
-    for( QVector<QString>::iterator it = errors.begin();
-         it != errors.end();
-         ++it )
+    QRect trimmed = converter.trimmed();
+    if ( settings.autotrim && trimmed.isValid() && settings.widths.isEmpty() )
     {
-        js_errors.append( it->toLocal8Bit().constData() );
+        Json::Value js_trim( Json::arrayValue );
+        js_trim.append( trimmed.x() );
+        js_trim.append( trimmed.y() );
+        js_trim.append( trimmed.width() );
+        js_trim.append( trimmed.height() );
+        root["trim"] = js_trim;
     }
-    root["errors"] = js_errors;
+    if ( !settings.selectors.isEmpty() )
+    {
+        Json::Value js_elements( Json::arrayValue );
+        QVector<ElementOutput> elements = converter.elements();
+        for ( int i = 0; i < elements.size(); ++i )
+        {
+            const ElementOutput& e = elements[i];
+            Json::Value element;
+            element["selector"] = e.selector.toUtf8().constData();
+            element["match"] = e.match;
+            element["left"] = e.rect.x();
+            element["top"] = e.rect.y();
+            element["width"] = e.rect.width();
+            element["height"] = e.rect.height();
+            if ( settings.sprite )
+            {
+                element["x"] = e.position.x();
+                element["y"] = e.position.y();
+            }
+            element["path"] = e.path.toLocal8Bit().constData();
+            element["bytes"] = (int)e.bytes;
+            js_elements.append( element );
+        }
+        root["elements"] = js_elements;
+    }
+    else if ( !settings.widths.isEmpty() )
+    {
+        Json::Value js_renders( Json::arrayValue );
+        QVector<WidthOutput> renders = converter.widthOutputs();
+        for ( int i = 0; i < renders.size(); ++i )
+        {
+            const WidthOutput& r = renders[i];
+            Json::Value render;
+            render["width"] = r.width;
+            render["image_width"] = r.size.width();
+            render["image_height"] = r.size.height();
+            render["path"] = r.path.toLocal8Bit().constData();
+            render["format"] = r.format.toLocal8Bit().constData();
+            render["bytes"] = (int)r.bytes;
+            js_renders.append( render );
+        }
+        root["renders"] = js_renders;
+    }
+    else if ( !settings.outputs.isEmpty() )
+    {
+        Json::Value js_outputs( Json::arrayValue );
+        QVector<OutputResult> outputs = converter.outputResults();
+        for ( int i = 0; i < outputs.size(); ++i )
+        {
+            const OutputResult& o = outputs[i];
+            Json::Value output;
+            output["path"] = o.path.toLocal8Bit().constData();
+            output["format"] = o.format.toLocal8Bit().constData();
+            output["width"] = o.size.width();
+            output["height"] = o.size.height();
+            output["bytes"] = (int)o.bytes;
+            output["encode_elapsed"] = o.encode_ms;
+            js_outputs.append( output );
+        }
+        root["outputs"] = js_outputs;
+    }
+    pending->settings = settings;
+    pending->result = result;
+    pending->warnings = warnings;
+    pending->errors = converter.errors();
+    pending->conversion = conversion_success;
+    pending->run_elapsedms = run_elapsedms;
+    pending->convert_elapsedms = convert_elapsedms;
+    pending->writes = converter.writes();
+    pending->files = converter.inlineFiles();
+    return pending;
+}
+
+// page is a template's, already loaded, or 0 to load settings.in
+static int handle_default(struct mg_connection *conn, Settings& settings, WebPage* page = 0)
+{
+    send_headers(conn);
+    if ( !settings.run_scripts.size() )
+    {
+        return send_error(conn, "Internal error: no scripts");
+    }
+    PendingResponse* pending = render( settings, page );
+    if ( settings.fire_and_forget || writes_finished( pending->writes ) )
+    {
+        int r = finish_response( conn, *pending );
+        delete pending;
+        return r;
+    }
+    // answered from MG_POLL once the files are written
+    conn->connection_param = pending;
+    return MG_MORE;
+}
+
+// outputs=[{"path": ..., "format": ..., "quality": ..., "crop": [x, y, w, h], "scale": ...}],
+// with format defaulting to the request's. Returns why it's bad, empty
+// when outputs is filled in.
+static QString parse_outputs( const QString& json, const QString& format, QList<OutputSpec>& outputs )
+{
+    const char* bad = "outputs must be a json array of objects, each with a path";
+    Json::Reader reader;
+    Json::Value list;
+    if ( !reader.parse( json.toUtf8().constData(), list ) || !list.isArray() || !list.size() )
+    {
+        return bad;
+    }
+    for ( int i = 0; i < (int)list.size(); ++i )
+    {
+        const Json::Value& o = list[i];
+        if ( !o.isObject() || !o.isMember("path") || !o["path"].isString() )
+        {
+            return bad;
+        }
+        OutputSpec spec;
+        spec.path = QString::fromUtf8( o["path"].asCString() );
+        if ( o.isMember("format") )
+        {
+            if ( !o["format"].isString() )
+            {
+                return "outputs format must be a string";
+            }
+            spec.fmt = QString::fromUtf8( o["format"].asCString() );
+            if ( spec.fmt.startsWith(".") )
+            {
+                spec.fmt = spec.fmt.mid(1);
+            }
+        }
+        QString fmt = spec.fmt.length() ? spec.fmt : format;
+        if ( fmt == "apng" )
+        {
+            return QString("outputs need a still format, not %1").arg(fmt);
+        }
+        if ( o.isMember("quality") )
+        {
+            if ( !o["quality"].isInt() || o["quality"].asInt() < 1 || o["quality"].asInt() > 100 )
+            {
+                return "outputs quality must be an integer from 1 to 100";
+            }
+            spec.quality = o["quality"].asInt();
+        }
+        if ( o.isMember("crop") )
+        {
+            const Json::Value& c = o["crop"];
+            if ( !c.isArray() || c.size() != 4 )
+            {
+                return "outputs crop must be a json array of x, y, width and height";
+            }
+            for ( int k = 0; k < 4; ++k )
+            {
+                if ( !c[k].isInt() )
+                {
+                    return "outputs crop must be a json array of x, y, width and height";
+                }
+            }
+            if ( c[2].asInt() <= 0 || c[3].asInt() <= 0 )
+            {
+                return "outputs crop width and height must be positive";
+            }
+            spec.crop = QRect( c[0].asInt(), c[1].asInt(), c[2].asInt(), c[3].asInt() );
+        }
+        if ( o.isMember("scale") )
+        {
+            if ( !o["scale"].isNumeric() || o["scale"].asDouble() <= 0 )
+            {
+                return "outputs scale must be a number above 0";
+            }
+            spec.scale = o["scale"].asDouble();
+        }
+        outputs.append( spec );
+    }
+    return QString();
+}
+
+// PUT /templates/<id>: load the page and keep it for POST /render/<id>
+static int handle_template_put(struct mg_connection *conn, const QString& id, Settings& settings, const QString& hook)
+{
+    send_headers(conn);
+    if ( g_templates->full() && !g_templates->contains( id ) )
+    {
+        return send_error(conn, QString("Too many templates, at most %1").arg(g_max_templates).toLocal8Bit().constData());
+    }
+    Engine engine(settings);
+    Converter converter(&engine, settings); // collects warnings and errors
+    bool loaded = engine.load();
+    if ( loaded )
+    {
+        g_templates->put( id, engine.takePage(), settings, hook );
+    }
+    debug_settings( settings, QString(), converter.warnings(), converter.errors(), loaded, engine.runTime(), 0 );
+
+    Json::Value root;
+    root["template"] = id.toLocal8Bit().constData();
+    root["conversion"] = loaded;
+    root["run_elapsed"] = engine.runTime();
+    root["warnings"] = json_list( converter.warnings() );
+    root["errors"] = json_list( converter.errors() );
     Json::StyledWriter writer;
     std::string json = writer.write(root);
     mg_send_data(conn, json.c_str(), json.length());
+    log( conn, QString("template %1 loaded: %2 [%3ms]").arg(id).arg(loaded).arg(engine.runTime()).toLocal8Bit().constData() );
+    return MG_TRUE;
+}
 
-    if ( settings.statsd )
+// DELETE /templates/<id>
+static int handle_template_delete(struct mg_connection *conn, const QString& id)
+{
+    send_headers(conn);
+    if ( !g_templates->remove( id ) )
     {
-        settings.statsd->inc(settings.statsd_ns + "request");
+        return send_error(conn, (QString("Unknown template:") + id).toLocal8Bit().constData());
     }
-
-    QString xtra = QString(LOG_STRING).arg(settings.in).arg(settings.screen_width).arg(settings.screen_height).arg(settings.out).arg(settings.fmt)
-        .arg(settings.selector.length()?settings.selector:"''")
-        .arg(settings.crop_rect.width()).arg(settings.crop_rect.height()).arg(settings.crop_rect.x()).arg(settings.crop_rect.y())
-        .arg(run_elapsedms).arg(convert_elapsedms);
-    log( conn, xtra.toLocal8Bit().constData() );
+    Json::Value root;
+    root["template"] = id.toLocal8Bit().constData();
+    Json::StyledWriter writer;
+    std::string json = writer.write(root);
+    mg_send_data(conn, json.c_str(), json.length());
     return MG_TRUE;
 }
 
@@ -232,6 +648,251 @@ static int handle_health(struct mg_connection *conn)
     return MG_TRUE;
 }
 
+// settings of a render, or of a template with put_template, from the
+// variables of a request. template_id is known to exist when rendering
+// one. html is written to file, which has to last as long as settings.
+// Returns why the request is bad, empty when settings is ready.
+static QString parse_request( RequestVars& vars, const QString& template_id, bool put_template, bool inline_output,
+                              Settings& settings, QTemporaryFile& file, QString& hook )
+{
+    bool render_template = template_id.length() && !put_template;
+    Settings loaded; // the template's, for defaults
+    if ( render_template )
+    {
+        loaded = g_templates->settings( template_id );
+    }
+
+    QString format = vars.get("format");
+    QString html = vars.get("html");
+    QString js = vars.get("js");
+    QString rasterizer = vars.get("rasterizer");
+    QString output = vars.get("output");
+    QString url = vars.get("url");
+    bool transparent = vars.get("transparent", "1").toInt();
+    int width = vars.get("width", render_template ? QString::number(loaded.screen_width) : QString()).toInt();
+    int height = vars.get("height", QString::number(render_template ? loaded.screen_height : -1)).toInt();
+    hook = vars.get("hook", "ichabodRender");
+    QString params = vars.get("params", "{}");
+    int crop_x = vars.get("crop_x", "0").toInt();
+    int crop_y = vars.get("crop_y", "0").toInt();
+    int crop_w = vars.get("crop_w", "0").toInt();
+    int crop_h = vars.get("crop_h", "0").toInt();
+    int smart_width = vars.get("smart_width", "1").toInt();
+    QString css = vars.get("css");
+    QString selector = vars.get("selector");
+    QString selectors_json = vars.get("selectors");
+    bool sprite = vars.get("sprite", "0").toInt();
+    QString widths_json = vars.get("widths");
+    QString outputs_json = vars.get("outputs");
+    int load_timeout_msec = vars.get("load_timeout", "0").toInt();
+    int enable_statsd = vars.get("enable_statsd", "0").toInt();
+    std::string statsd_ns(vars.get("statsd_ns").toLocal8Bit().constData());
+    QString quantize = vars.get("quantize", g_quantize);
+    int quantize_kmeans = vars.get("quantize_kmeans", QString::number(g_quantize_kmeans)).toInt();
+    bool gif_optimize = vars.get("gif_optimize", "0").toInt();
+    int gif_palette_sample = vars.get("gif_palette_sample", "1").toInt();
+    double gif_local_palette_threshold = vars.get("gif_local_palette_threshold", "0").toDouble();
+    int gif_lossiness = vars.get("gif_lossiness", "0").toInt();
+    bool png8_auto = vars.get("png8_auto", "0").toInt();
+    int auto_max_bytes = vars.get("auto_max_bytes", "0").toInt();
+    int auto_min_quality = vars.get("auto_min_quality", "30").toInt();
+    bool stream = vars.get("stream", "0").toInt();
+    double scale = vars.get("scale", "1").toDouble();
+    int max_width = vars.get("max_width", "0").toInt();
+    int max_height = vars.get("max_height", "0").toInt();
+    double device_scale_factor = vars.get("device_scale_factor", "1").toDouble();
+    bool fire_and_forget = vars.get("fire_and_forget", "0").toInt();
+    bool autotrim = vars.get("autotrim", "0").toInt();
+    int autotrim_tolerance = vars.get("autotrim_tolerance", "0").toInt();
+    bool virtual_time = vars.get("virtual_time", "0").toInt();
+    QRect crop_rect;
+    if ( crop_x || crop_y || crop_w || crop_h )
+    {
+        crop_rect = QRect(crop_x, crop_y, crop_w, crop_h);
+    }
+    if ( !rasterizer.length() )
+    {
+        rasterizer = ICHABOD_NAME;
+    }
+    QList<OutputSpec> outputs;
+    if ( outputs_json.length() )
+    {
+        QString err = parse_outputs( outputs_json, format.startsWith(".") ? format.mid(1) : format, outputs );
+        if ( err.length() )
+        {
+            return err;
+        }
+    }
+    if ( !output.length() && !put_template && outputs.isEmpty() && !inline_output )
+    {
+        return "No output specified";
+    }
+    if ( width < 1 )
+    {
+        return "Bad dimensions";
+    }
+    if ( device_scale_factor <= 0 || device_scale_factor > 4 )
+    {
+        return "device_scale_factor must be above 0 and at most 4";
+    }
+    if ( !html.length() && !url.length() && !render_template )
+    {
+        return "Empty document and no URL specified";
+    }
+    // called by name from every render's javascript, so refuse anything
+    // but a function name or a dotted path to one
+    if ( put_template && !QRegExp("[A-Za-z_$][\\w$]*(\\.[A-Za-z_$][\\w$]*)*").exactMatch( hook ) )
+    {
+        return "hook must be the name of a javascript function, such as ichabodRender or app.render";
+    }
+    if ( render_template )
+    {
+        // passed to the hook as a literal, so it has to be json
+        Json::Reader reader;
+        Json::Value params_root;
+        if ( !reader.parse( params.toUtf8().constData(), params_root ) || !params_root.isObject() )
+        {
+            return "params must be a json object";
+        }
+        Json::FastWriter writer;
+        QString call = QString("%1(%2);").arg(g_templates->hook( template_id ))
+            .arg(QString::fromUtf8( writer.write( params_root ).c_str() ).trimmed());
+        if ( !js.length() )
+        {
+            js = QString("%1.snapshotPage(); %1.saveToOutput();").arg(rasterizer.length() ? rasterizer : ICHABOD_NAME);
+        }
+        js = call + "\n" + js;
+        html = QString();
+        url = loaded.in;
+    }
+    QStringList selectors;
+    if ( selectors_json.length() )
+    {
+        Json::Reader reader;
+        Json::Value list;
+        if ( !reader.parse( selectors_json.toUtf8().constData(), list ) || !list.isArray() )
+        {
+            return "selectors must be a json array of strings";
+        }
+        for ( int i = 0; i < (int)list.size(); ++i )
+        {
+            if ( !list[i].isString() )
+            {
+                return "selectors must be a json array of strings";
+            }
+            selectors.append( QString::fromUtf8( list[i].asCString() ) );
+        }
+    }
+    QList<int> widths;
+    if ( widths_json.length() )
+    {
+        Json::Reader reader;
+        Json::Value list;
+        if ( !reader.parse( widths_json.toUtf8().constData(), list ) || !list.isArray() )
+        {
+            return "widths must be a json array of positive integers";
+        }
+        for ( int i = 0; i < (int)list.size(); ++i )
+        {
+            if ( !list[i].isInt() || list[i].asInt() < 1 )
+            {
+                return "widths must be a json array of positive integers";
+            }
+            widths.append( list[i].asInt() );
+        }
+    }
+    const Quantizer* quantizer = findQuantizer( quantize );
+    if ( !quantizer )
+    {
+        return QString("Unknown quantize method:") + quantize;
+    }
+
+    QString input;
+    QString temp_base = output.length() ? output : QDir::tempPath() + "/" + ICHABOD_NAME;
+    file.setFileTemplate(temp_base + QString("_XXXXXX.html"));
+    if ( html.length() ) {
+        if ( !file.open() )
+        {
+            return QString("Unable to open:") + temp_base + QString("_XXXXXX.html");
+        }
+        QTextStream out(&file);
+        out << html;
+        out.flush();
+
+        input = file.fileName();
+    } else {
+        input = url;
+    }
+
+    if ( format.startsWith(".") )
+    {
+        format = format.mid(1);
+    }
+    if ( format.isEmpty() )
+    {
+        format = "png";
+    }
+    if ( inline_output && !output.length() )
+    {
+        // only names the file in the response
+        output = "output." + format;
+    }
+
+    settings.verbosity = g_verbosity;
+    settings.engine_verbosity = g_engine_verbosity;
+    settings.convert_verbosity = g_convert_verbosity;
+    settings.slow_response_ms = g_slow_response_ms;
+    settings.rasterizer = rasterizer;
+    settings.fmt = format;
+    settings.in = input;
+    settings.quality = 50; // reasonable size/speed tradeoff by default
+    settings.out = output;
+    settings.screen_width = width;
+    settings.virtual_width = width;
+    settings.screen_height = height;
+    settings.transparent = transparent;
+    settings.looping = false;
+    settings.quantizer = quantizer;
+    settings.quantize_options.kmeans_iterations = quantize_kmeans;
+    settings.gif_options.optimize = gif_optimize;
+    settings.gif_options.palette_sample = gif_palette_sample;
+    settings.gif_options.local_palette_threshold = gif_local_palette_threshold;
+    settings.gif_options.lossiness = gif_lossiness;
+    settings.png8_auto = png8_auto;
+    settings.auto_options.max_bytes = auto_max_bytes;
+    settings.auto_options.min_quality = auto_min_quality;
+    settings.stream = stream;
+    settings.scale = scale > 0 ? scale : 1.0;
+    settings.max_width = max_width;
+    settings.max_height = max_height;
+    settings.device_scale_factor = device_scale_factor;
+    settings.autotrim = autotrim;
+    settings.autotrim_tolerance = autotrim_tolerance;
+    settings.virtual_time = virtual_time;
+    settings.smart_width = smart_width;
+    settings.crop_rect = crop_rect;
+    settings.css = css;
+    settings.selector = selector;
+    settings.selector = selector;
+    settings.selectors = selectors;
+    settings.sprite = sprite;
+    settings.widths = widths;
+    settings.outputs = outputs;
+    settings.fire_and_forget = fire_and_forget;
+    settings.inline_output = inline_output;
+    settings.load_timeout_msec = load_timeout_msec;
+    QList<QString> scripts;
+    scripts.append(js);
+    settings.run_scripts = scripts;
+    settings.statsd = 0;
+    if ( enable_statsd )
+    {
+        settings.statsd_ns = statsd_ns + (statsd_ns.length() ? "." : "");
+        settings.statsd = &g_statsd;
+    }
+    return QString();
+}
+
 // handler for all incoming connections
 static int ev_handler(struct mg_connection *conn, enum mg_event ev) 
 {
@@ -248,111 +909,185 @@ static int ev_handler(struct mg_connection *conn, enum mg_event ev)
             return handle_health(conn);
         }
 
-        QString format = get_var(conn, "format");
-        QString html = get_var(conn, "html");
-        QString js = get_var(conn, "js");
-        QString rasterizer = get_var(conn, "rasterizer");
-        QString output = get_var(conn, "output");
-        QString url = get_var(conn, "url");
-        bool transparent = get_var(conn, "transparent", "1").toInt();
-        int width = get_var(conn, "width").toInt();
-        int height = get_var(conn, "height", "-1").toInt();
-        int crop_x = get_var(conn, "crop_x", "0").toInt();
-        int crop_y = get_var(conn, "crop_y", "0").toInt();
-        int crop_w = get_var(conn, "crop_w", "0").toInt();
-        int crop_h = get_var(conn, "crop_h", "0").toInt();
-        int smart_width = get_var(conn, "smart_width", "1").toInt();
-        QString css = get_var(conn, "css");
-        QString selector = get_var(conn, "selector");
-        int load_timeout_msec = get_var(conn, "load_timeout", "0").toInt();
-        int enable_statsd = get_var(conn, "enable_statsd", "0").toInt();
-        std::string statsd_ns(get_var(conn, "statsd_ns").toLocal8Bit().constData());
-        QRect crop_rect;
-        if ( crop_x || crop_y || crop_w || crop_h )
+        // PUT or DELETE /templates/<id>, POST /render/<id>
+        QString template_id;
+        bool put_template = false;
+        if ( pathParts.size() == 2 && ( pathParts[0] == "templates" || pathParts[0] == "render" ) )
         {
-            crop_rect = QRect(crop_x, crop_y, crop_w, crop_h);
+            template_id = pathParts[1];
+            put_template = pathParts[0] == "templates";
+            if ( put_template && QString(conn->request_method) == "DELETE" )
+            {
+                return handle_template_delete(conn, template_id);
+            }
+            if ( !put_template && !g_templates->contains( template_id ) )
+            {
+                return send_error(conn, (QString("Unknown template:") + template_id).toLocal8Bit().constData());
+            }
         }
-        if ( !rasterizer.length() )
+        Settings settings;
+        QTemporaryFile file;
+        QString hook;
+        HttpVars vars( conn );
+        char* content = conn->content;
+        size_t content_len = conn->content_len;
+        QString err = decode_body( conn );
+        if ( err.isEmpty() )
         {
-            rasterizer = ICHABOD_NAME;
+            err = parse_request( vars, template_id, put_template, false, settings, file, hook );
         }
-        if ( !output.length() )
+        conn->content = content;
+        conn->content_len = content_len;
+        if ( err.length() )
         {
-            return send_error(conn, "No output specified");
+            return send_error(conn, err.toLocal8Bit().constData());
         }
-        if ( width < 1 )
+        if ( put_template )
         {
-            return send_error(conn, "Bad dimensions");
+            return handle_template_put(conn, template_id, settings, hook);
         }
-        if ( !html.length() && !url.length() )
+        if ( template_id.length() )
         {
-            return send_error(conn, "Empty document and no URL specified");
+            return handle_default(conn, settings, g_templates->page( template_id ));
         }
-
-        QString input;
-        QTemporaryFile file(output + QString("_XXXXXX.html"));
-        if ( html.length() ) {
-            if ( !file.open() )
-            {
-                return send_error(conn, (QString("Unable to open:") + output 
-                                         + QString("_XXXXXX.html")).toLocal8Bit().constData() );
-            }
-            QTextStream out(&file);
-            out << html;
-            out.flush();
-
-            input = file.fileName();
-        } else {
-            input = url;
+        return handle_default(conn, settings);
+    } 
+    else if (ev == MG_POLL && conn->connection_param)
+    {
+        PendingResponse* pending = (PendingResponse*)conn->connection_param;
+        if ( !writes_finished( pending->writes ) )
+        {
+            return MG_FALSE;
         }
+        conn->connection_param = 0;
+        finish_response(conn, *pending);
+        delete pending;
+        return MG_TRUE;
+    }
+    else if (ev == MG_CLOSE && conn->connection_param)
+    {
+        // client went away first, the files are still written
+        delete (PendingResponse*)conn->connection_param;
+        conn->connection_param = 0;
+    }
+    else if (ev == MG_AUTH) 
+    {
+        return MG_TRUE;
+    }
+    return MG_FALSE;
+}
+
+// a response to a unix socket request, sent once the ones before it to
+// the same client are
+struct SocketResponse
+{
+    int client;
+    PendingResponse* pending; // 0 when body is ready
+    QByteArray body;
+};
+static QList<SocketResponse> g_socket_responses;
 
-        if ( format.startsWith(".") )
+// shared files are passed as fds, in the order of their path fields
+static QByteArray socket_body(bool conversion, const std::string& json, const QVector<InlineFile>& files, QVector<int>& fds)
+{
+    QByteArray body;
+    appendInt( body, "conversion", conversion );
+    appendBytes( body, "json", QByteArray( json.c_str(), json.length() ) );
+    for ( int i = 0; i < files.size(); ++i )
+    {
+        appendBytes( body, "path", files[i].path.toUtf8() );
+        if ( files[i].fd >= 0 )
         {
-            format = format.mid(1);
+            appendInt( body, "size", files[i].bytes );
+            fds.append( files[i].fd );
         }
-        if ( format.isEmpty() )
+        else
         {
-            format = "png";
+            appendBytes( body, "data", files[i].data );
         }
+    }
+    return body;
+}
 
-        Settings settings;
-        settings.verbosity = g_verbosity;
-        settings.engine_verbosity = g_engine_verbosity;
-        settings.convert_verbosity = g_convert_verbosity;
-        settings.slow_response_ms = g_slow_response_ms;
-        settings.rasterizer = rasterizer;
-        settings.fmt = format;
-        settings.in = input;
-        settings.quality = 50; // reasonable size/speed tradeoff by default
-        settings.out = output;
-        settings.screen_width = width;
-        settings.virtual_width = width;
-        settings.screen_height = height;
-        settings.transparent = transparent;
-        settings.looping = false;
-        settings.quantize_method = toQuantizeMethod( g_quantize );
-        settings.smart_width = smart_width;
-        settings.crop_rect = crop_rect;
-        settings.css = css;
-        settings.selector = selector;
-        settings.selector = selector;
-        settings.load_timeout_msec = load_timeout_msec;
-        QList<QString> scripts;
-        scripts.append(js);
-        settings.run_scripts = scripts;
-        settings.statsd = 0;
-        if ( enable_statsd )
-        {
-            settings.statsd_ns = statsd_ns + (statsd_ns.length() ? "." : "");
-            settings.statsd = &g_statsd;
-        }
-        return handle_default(conn, settings);
-    } 
-    else if (ev == MG_AUTH) 
+static void socket_error(int client, const QString& err)
+{
+    log( "unix", err.toLocal8Bit().constData() );
+    SocketResponse r;
+    r.client = client;
+    r.pending = 0;
+    QVector<int> fds;
+    r.body = socket_body( false, error_json( err.toLocal8Bit().constData() ), QVector<InlineFile>(), fds );
+    g_socket_responses.append( r );
+}
+
+// a render from a frame of the same variables as POST /, plus template
+// to render one, inline to return the files rather than write them and
+// shm to return them as shared memory
+static void handle_socket_request(const SocketRequest& request)
+{
+    QList<FrameField> fields;
+    if ( !parseFrame( request.body, fields ) )
     {
-        return MG_TRUE;
+        return socket_error( request.client, "Malformed frame" );
+    }
+    FrameVars vars( fields );
+    QString template_id = vars.get("template");
+    if ( template_id.length() && !g_templates->contains( template_id ) )
+    {
+        return socket_error( request.client, QString("Unknown template:") + template_id );
+    }
+    bool inline_output = vars.get("inline", "1").toInt();
+    Settings settings;
+    QTemporaryFile file;
+    QString hook;
+    QString err = parse_request( vars, template_id, false, inline_output, settings, file, hook );
+    if ( err.length() )
+    {
+        return socket_error( request.client, err );
+    }
+    settings.shared_output = inline_output && vars.get("shm", "0").toInt();
+    SocketResponse r;
+    r.client = request.client;
+    r.pending = render( settings, template_id.length() ? g_templates->page( template_id ) : 0 );
+    g_socket_responses.append( r );
+}
+
+// send the responses which are done, in order per client
+static void send_socket_responses(SocketServer& socket_server)
+{
+    QSet<int> waiting; // clients with an earlier response still waiting on writes
+    for ( int i = 0; i < g_socket_responses.size(); )
+    {
+        SocketResponse& r = g_socket_responses[i];
+        PendingResponse* pending = r.pending;
+        if ( waiting.contains( r.client )
+             || ( pending && !pending->settings.fire_and_forget && !writes_finished( pending->writes ) ) )
+        {
+            waiting.insert( r.client );
+            ++i;
+            continue;
+        }
+        QVector<int> fds;
+        if ( pending )
+        {
+            QVector<InlineFile>& files = pending->files;
+            if ( pending->settings.shared_output && files.size() > FRAME_MAX_FDS )
+            {
+                for ( int f = 0; f < files.size(); ++f )
+                {
+                    close( files[f].fd );
+                }
+                files.clear();
+                pending->errors.push_back( QString("Too many files to share, at most %1").arg(FRAME_MAX_FDS) );
+                pending->conversion = false;
+            }
+            std::string json = complete_response( *pending, "unix" );
+            r.body = socket_body( pending->conversion, json, files, fds );
+            delete pending;
+        }
+        socket_server.respond( r.client, r.body, fds );
+        g_socket_responses.removeAt( i );
     }
-    return MG_FALSE;
 }
 
 int main(int argc, char *argv[])
@@ -379,12 +1114,21 @@ int main(int argc, char *argv[])
     QRegExp rxEngineVerbose("--engine-verbosity=([0-9]{1,})");
     QRegExp rxConvertVerbose("--convert-verbosity=([0-9]{1,})");
     QRegExp rxSlowResponseMs("--slow-response-ms=([0-9]{1,})");
-    QRegExp rxQuantize("--quantize=([a-zA-Z]{1,})");
+    QRegExp rxQuantize("--quantize=([a-zA-Z_]{1,})");
+    QRegExp rxQuantizeThreads("--quantize-threads=([0-9]{1,})");
+    QRegExp rxQuantizeKmeans("--quantize-kmeans=([0-9]{1,})");
+    QRegExp rxGifCheck("--gif-check=([^ ]+)");
+    QRegExp rxBenchScale("--bench-scale=([^ ]+)");
     QRegExp rxVersion("--version");
     QRegExp rxShortVersion("-v$");
     QRegExp rxStatsdHost("--statsd-host=([^ ]+)");
     QRegExp rxStatsdPort("--statsd-port=([0-9]{1,})");
     QRegExp rxStatsdNs("--statsd-ns=([^ ]+)");
+    QRegExp rxMaxTemplates("--max-templates=([0-9]{1,})");
+    QRegExp rxFsync("--fsync=([a-z]{1,})");
+    QRegExp rxFsyncBatchMs("--fsync-batch-ms=([0-9]{1,})");
+    QRegExp rxSocket("--socket=([^ ]+)");
+    QRegExp rxMaxBodyBytes("--max-body-bytes=([0-9]{1,})");
 
     for (int i = 1; i < args.size(); ++i) {
         if (rxPort.indexIn(args.at(i)) != -1 )
@@ -411,6 +1155,43 @@ int main(int argc, char *argv[])
         {
             g_quantize = rxQuantize.cap(1);
         }
+        else if (rxQuantizeThreads.indexIn(args.at(i)) != -1 ) 
+        {
+            g_quantize_threads = rxQuantizeThreads.cap(1).toInt();
+        }
+        else if (rxQuantizeKmeans.indexIn(args.at(i)) != -1 ) 
+        {
+            g_quantize_kmeans = rxQuantizeKmeans.cap(1).toInt();
+        }
+        else if (rxMaxTemplates.indexIn(args.at(i)) != -1 ) 
+        {
+            g_max_templates = rxMaxTemplates.cap(1).toInt();
+        }
+        else if (rxFsync.indexIn(args.at(i)) != -1 ) 
+        {
+            g_fsync = rxFsync.cap(1);
+        }
+        else if (rxFsyncBatchMs.indexIn(args.at(i)) != -1 ) 
+        {
+            g_fsync_batch_ms = rxFsyncBatchMs.cap(1).toInt();
+        }
+        else if (rxSocket.indexIn(args.at(i)) != -1 ) 
+        {
+            g_socket = rxSocket.cap(1);
+        }
+        else if (rxMaxBodyBytes.indexIn(args.at(i)) != -1 ) 
+        {
+            g_max_body_bytes = rxMaxBodyBytes.cap(1).toInt();
+        }
+        else if (rxGifCheck.indexIn(args.at(i)) != -1 ) 
+        {
+            return gifCheck( rxGifCheck.cap(1) );
+        }
+        else if (rxBenchScale.indexIn(args.at(i)) != -1 ) 
+        {
+            setWorkerThreads( g_quantize_threads );
+            return benchScale( rxBenchScale.cap(1) );
+        }
         else if (rxVersion.indexIn(args.at(i)) != -1 ) 
         {
             std::cout << ICHABOD_NAME << " version " << ICHABOD_VERSION << std::endl;
@@ -460,7 +1241,29 @@ int main(int argc, char *argv[])
     }
 
     ppm_init( &argc, argv );
+    setWorkerThreads( g_quantize_threads );
+    if ( !findQuantizer( g_quantize ) )
+    {
+        std::cerr << "Unknown quantize method:" << g_quantize.toLocal8Bit().constData() 
+                  << ", expected one of: " << quantizerNames().join(" ").toLocal8Bit().constData() << std::endl;
+        return -1;
+    }
+    if ( g_max_body_bytes < 1 || g_max_body_bytes > ( 1 << 30 ) )
+    {
+        std::cerr << "--max-body-bytes must be from 1 to " << ( 1 << 30 ) << std::endl;
+        return -1;
+    }
+    if ( !setFsyncPolicy( g_fsync, g_fsync_batch_ms ) )
+    {
+        std::cerr << "Unknown fsync policy:" << g_fsync.toLocal8Bit().constData()
+                  << ", expected one of: none always batch" << std::endl;
+        return -1;
+    }
     
+    TemplateRegistry templates;
+    templates.setCapacity( g_max_templates );
+    g_templates = &templates;
+
     struct mg_server *server = mg_create_server(NULL, ev_handler);
 
     const char * err = mg_set_option(server, "listening_port", QString::number(port).toLocal8Bit().constData());
@@ -469,12 +1272,26 @@ int main(int argc, char *argv[])
         std::cerr << "Cannot bind to port:" << port << " [" << err << "], exiting." << std::endl;
         return -1;
     }
+    SocketServer socket_server;
+    QString socket_err;
+    if ( g_socket.length() && !socket_server.listen( g_socket, socket_err ) )
+    {
+        std::cerr << "Cannot listen on socket:" << g_socket.toLocal8Bit().constData()
+                  << " [" << socket_err.toLocal8Bit().constData() << "], exiting." << std::endl;
+        return -1;
+    }
     std::cout << ICHABOD_NAME << " " << ICHABOD_VERSION 
               << " (port:" << mg_get_option(server, "listening_port") 
               << " verbosity:" << g_verbosity 
               << " engine verbosity:" << g_engine_verbosity 
               << " convert verbosity:" << g_convert_verbosity 
-              << " slow-response:" << g_slow_response_ms << "ms";
+              << " slow-response:" << g_slow_response_ms << "ms"
+              << " quantize threads:" << workerThreads()
+              << " fsync:" << g_fsync.toLocal8Bit().constData();
+    if ( g_socket.length() )
+    {
+        std::cout << " socket:" << g_socket.toLocal8Bit().constData();
+    }
     if ( statsd.enabled )
     {
         std::cout << " statsd:" << statsd.host << ":" << statsd.port << "[" << statsd.ns << "]";
@@ -484,7 +1301,23 @@ int main(int argc, char *argv[])
 
     for (;;) 
     {
-        mg_poll_server(server, 1000);
+        // responses waiting on the writer are sent from MG_POLL, so
+        // poll often while there are writes in flight
+        if ( !g_socket.length() )
+        {
+            mg_poll_server(server, pendingWrites() ? 5 : 1000);
+            continue;
+        }
+        // mongoose can't wait on the unix socket too, so they take turns:
+        // wait on the socket for a while, then take what http has
+        QList<SocketRequest> requests;
+        socket_server.poll( pendingWrites() ? 5 : SOCKET_POLL_MS, requests );
+        for ( int i = 0; i < requests.size(); ++i )
+        {
+            handle_socket_request( requests[i] );
+        }
+        send_socket_responses( socket_server );
+        mg_poll_server(server, 0);
     }
     
     mg_destroy_server(&server);
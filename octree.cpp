@@ -0,0 +1,150 @@
+#include "quant.h"
+#include <algorithm>
+
+/*
+** Octree quantizer (Gervautz & Purgathofer). Every color in the
+** histogram is inserted down to a full-depth leaf, one bit per channel
+** per level. Leaves are then folded into their parents, deepest level
+** and least populated nodes first, until no more than max_colors
+** remain. Each leaf's average color becomes a palette entry.
+*/
+
+#define OCTREE_DEPTH 8
+
+struct OctreeNode
+{
+    OctreeNode()
+        : r(0), g(0), b(0), count(0), leaf(false)
+    {
+        for ( int i = 0; i < 8; ++i )
+        {
+            child[i] = -1;
+        }
+    }
+    qint64 r, g, b;
+    qint64 count;
+    bool leaf;
+    int child[8];
+};
+
+struct OctreeCountLess
+{
+    OctreeCountLess( const QVector<OctreeNode>& n ) : nodes(n) {}
+    bool operator()( int a, int b ) const
+    {
+        return nodes[a].count < nodes[b].count;
+    }
+    const QVector<OctreeNode>& nodes;
+};
+
+OctreeQuantizer::OctreeQuantizer( const QString& name, DitherMethod dither )
+    : Quantizer(name, dither)
+{
+}
+
+QVector<QRgb> OctreeQuantizer::buildPalette( const ColorHistogram& hist, int max_colors ) const
+{
+    // nodes live in one vector and refer to each other by index
+    QVector<OctreeNode> nodes;
+    QVector< QVector<int> > levels( OCTREE_DEPTH ); // internal nodes per level
+    nodes.reserve( hist.size() * 2 );
+    nodes.push_back( OctreeNode() );
+    levels[0].push_back( 0 );
+    int leaves = 0;
+
+    for ( ColorHistogram::const_iterator it = hist.constBegin(); it != hist.constEnd(); ++it )
+    {
+        int r = qRed( it.key() );
+        int g = qGreen( it.key() );
+        int b = qBlue( it.key() );
+        int node = 0;
+        for ( int level = 0; level < OCTREE_DEPTH; ++level )
+        {
+            int shift = 7 - level;
+            int slot = ( ( ( r >> shift ) & 1 ) << 2 ) | ( ( ( g >> shift ) & 1 ) << 1 ) | ( ( b >> shift ) & 1 );
+            int child = nodes[node].child[slot];
+            if ( child < 0 )
+            {
+                child = nodes.size();
+                nodes.push_back( OctreeNode() );
+                nodes[node].child[slot] = child;
+                if ( level + 1 < OCTREE_DEPTH )
+                {
+                    levels[level + 1].push_back( child );
+                }
+                else
+                {
+                    nodes[child].leaf = true;
+                    ++leaves;
+                }
+            }
+            node = child;
+        }
+        qint64 n = it.value();
+        nodes[node].r += r * n;
+        nodes[node].g += g * n;
+        nodes[node].b += b * n;
+        nodes[node].count += n;
+    }
+
+    // pixel counts of internal nodes, used to pick which to fold first
+    for ( int level = OCTREE_DEPTH - 1; level >= 0; --level )
+    {
+        const QVector<int>& at_level = levels[level];
+        for ( int i = 0; i < at_level.size(); ++i )
+        {
+            OctreeNode& node = nodes[at_level[i]];
+            for ( int c = 0; c < 8; ++c )
+            {
+                if ( node.child[c] >= 0 )
+                {
+                    node.count += nodes[node.child[c]].count;
+                }
+            }
+        }
+    }
+
+    // fold leaves into their parents. A level is only started once the
+    // one below it has been folded completely, so children are always
+    // leaves by the time their parent is folded.
+    for ( int level = OCTREE_DEPTH - 1; level >= 0 && leaves > max_colors; --level )
+    {
+        QVector<int>& at_level = levels[level];
+        std::sort( at_level.begin(), at_level.end(), OctreeCountLess( nodes ) );
+        for ( int i = 0; i < at_level.size() && leaves > max_colors; ++i )
+        {
+            OctreeNode& node = nodes[at_level[i]];
+            node.count = 0;
+            for ( int c = 0; c < 8; ++c )
+            {
+                int child = node.child[c];
+                if ( child >= 0 )
+                {
+                    node.r += nodes[child].r;
+                    node.g += nodes[child].g;
+                    node.b += nodes[child].b;
+                    node.count += nodes[child].count;
+                    nodes[child].leaf = false;
+                    node.child[c] = -1;
+                    --leaves;
+                }
+            }
+            node.leaf = true;
+            ++leaves;
+        }
+    }
+
+    QVector<QRgb> palette;
+    palette.reserve( leaves );
+    for ( int i = 0; i < nodes.size(); ++i )
+    {
+        const OctreeNode& node = nodes[i];
+        if ( node.leaf && node.count )
+        {
+            palette.push_back( qRgb( (int)( node.r / node.count ),
+                                     (int)( node.g / node.count ),
+                                     (int)( node.b / node.count ) ) );
+        }
+    }
+    return palette;
+}
@@ -0,0 +1,539 @@
+#include "quant.h"
+#include "parallel.h"
+#include <QAtomicInt>
+#include <QThread>
+#include <QThreadStorage>
+#include <cmath>
+#include <climits>
+#include <cstring>
+
+// Histogram building and palette mapping, both split across the worker
+// pool in row bands. Floyd-Steinberg can't be split into independent
+// bands, so it runs as a wavefront instead: each row trails the row
+// above it by a couple of pixels, which is all the error terms need.
+
+#define CACHE_BITS 12
+#define CACHE_SIZE (1 << CACHE_BITS)
+#define PROGRESS_STEP 32
+
+static const int BAYER[8][8] =
+{
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+// Direct-mapped cache of color -> palette index. Pixels are always
+// opaque by the time they get here, so a zero key never matches.
+struct NearestCache
+{
+    NearestCache() : generation(-1) {}
+    void reset( int g )
+    {
+        generation = g;
+        memset( keys, 0, sizeof(keys) );
+    }
+    int generation;
+    QRgb keys[CACHE_SIZE];
+    int index[CACHE_SIZE];
+};
+
+static QAtomicInt g_palette_generation( 0 );
+static QThreadStorage<NearestCache*> g_nearest_cache;
+
+// per-thread cache, emptied whenever the palette changes
+static NearestCache& threadCache( int generation )
+{
+    if ( !g_nearest_cache.hasLocalData() )
+    {
+        g_nearest_cache.setLocalData( new NearestCache );
+    }
+    NearestCache* cache = g_nearest_cache.localData();
+    if ( cache->generation != generation )
+    {
+        cache->reset( generation );
+    }
+    return *cache;
+}
+
+static inline int nearestIndex( QRgb c, const QRgb* palette, int size )
+{
+    int r = qRed( c );
+    int g = qGreen( c );
+    int b = qBlue( c );
+    int nearest = 0;
+    int min_dist = INT_MAX;
+    for ( int i = 0; i < size; ++i )
+    {
+        int dr = qRed( palette[i] ) - r;
+        int dg = qGreen( palette[i] ) - g;
+        int db = qBlue( palette[i] ) - b;
+        int dist = dr*dr + dg*dg + db*db;
+        if ( dist < min_dist )
+        {
+            min_dist = dist;
+            nearest = i;
+        }
+    }
+    return nearest;
+}
+
+static inline int lookup( NearestCache& cache, QRgb c, const QRgb* palette, int size )
+{
+    uint slot = ( c * 2654435761u ) >> ( 32 - CACHE_BITS );
+    if ( cache.keys[slot] == c )
+    {
+        return cache.index[slot];
+    }
+    int ind = nearestIndex( c, palette, size );
+    cache.keys[slot] = c;
+    cache.index[slot] = ind;
+    return ind;
+}
+
+static inline int clampChannel( int v )
+{
+    return v < 0 ? 0 : ( v > 255 ? 255 : v );
+}
+
+static QImage opaqueSource( const QImage& src )
+{
+    if ( src.format() == QImage::Format_RGB32 )
+    {
+        return src;
+    }
+    return src.convertToFormat( QImage::Format_RGB32 );
+}
+
+// roughly half the distance between neighbouring palette entries
+static int ditherSpread( int palette_size )
+{
+    return qMax( 4, (int)( 255.0 / pow( (double)qMax( 2, palette_size ), 1.0 / 3.0 ) ) );
+}
+
+static inline int ditherOffset( DitherMethod dither, int x, int y, int spread )
+{
+    if ( dither == DitherMethod_ORDERED )
+    {
+        return ( BAYER[y & 7][x & 7] * 2 - 63 ) * spread / 128;
+    }
+    // interleaved gradient noise: a cheap, tileable stand-in for a
+    // precomputed blue noise texture
+    float n = 0.06711056f * x + 0.00583715f * y;
+    n = 52.9829189f * ( n - floorf( n ) );
+    n = n - floorf( n );
+    return (int)( ( n - 0.5f ) * spread );
+}
+
+static void reduceHistogram( ColorHistogram& hist, int shift )
+{
+    int mask = ( 0xff << shift ) & 0xff;
+    int center = 1 << ( shift - 1 );
+    ColorHistogram reduced;
+    for ( ColorHistogram::const_iterator it = hist.constBegin(); it != hist.constEnd(); ++it )
+    {
+        QRgb c = it.key();
+        reduced[qRgb( ( qRed( c ) & mask ) + center, ( qGreen( c ) & mask ) + center, ( qBlue( c ) & mask ) + center )] += it.value();
+    }
+    hist = reduced;
+}
+
+class HistogramTask : public ParallelTask
+{
+public:
+    HistogramTask( const QImage& s, int step, int b )
+        : src(s), sample(step), bands(b), hists(b)
+    {
+    }
+    void run( int band )
+    {
+        int begin, end;
+        bandRange( band, bands, src.height(), begin, end );
+        ColorHistogram& hist = hists[band];
+        int width = src.width();
+        begin = ( begin + sample - 1 ) / sample * sample;
+        for ( int y = begin; y < end; y += sample )
+        {
+            // count runs of the same color first, rendered pages are
+            // mostly flat fills
+            const QRgb* line = (const QRgb*)src.scanLine( y );
+            QRgb run_color = line[0] | 0xff000000;
+            int run = 0;
+            for ( int x = 0; x < width; ++x )
+            {
+                QRgb c = line[x] | 0xff000000;
+                if ( c != run_color )
+                {
+                    hist[run_color] += run;
+                    run_color = c;
+                    run = 0;
+                }
+                run += sample; // skipped rows count like this one
+            }
+            hist[run_color] += run;
+        }
+    }
+    const QImage& src;
+    int sample;
+    int bands;
+    QVector<ColorHistogram> hists;
+};
+
+class MapTask : public ParallelTask
+{
+public:
+    MapTask( const QImage& s, uchar* b, int bpl, const QVector<QRgb>& p, DitherMethod d, int bs, int g )
+        : src(s), bits(b), bytes_per_line(bpl), palette(p), dither(d), bands(bs), generation(g)
+        , spread( ditherSpread( p.size() ) )
+    {
+    }
+    void run( int band )
+    {
+        int begin, end;
+        bandRange( band, bands, src.height(), begin, end );
+        NearestCache& cache = threadCache( generation );
+        const QRgb* pal = palette.constData();
+        int size = palette.size();
+        int width = src.width();
+        for ( int y = begin; y < end; ++y )
+        {
+            const QRgb* line = (const QRgb*)src.scanLine( y );
+            uchar* out = bits + y * bytes_per_line;
+            for ( int x = 0; x < width; ++x )
+            {
+                QRgb c = line[x] | 0xff000000;
+                if ( dither != DitherMethod_NONE )
+                {
+                    int offset = ditherOffset( dither, x, y, spread );
+                    c = qRgb( clampChannel( qRed( c ) + offset ),
+                              clampChannel( qGreen( c ) + offset ),
+                              clampChannel( qBlue( c ) + offset ) );
+                }
+                out[x] = lookup( cache, c, pal, size );
+            }
+        }
+    }
+private:
+    const QImage& src;
+    uchar* bits;
+    int bytes_per_line;
+    const QVector<QRgb>& palette;
+    DitherMethod dither;
+    int bands;
+    int generation;
+    int spread;
+};
+
+// One task per row. Row r may work on column c once row r-1 has
+// finished column c+1, the last pixel which diffuses error into (r,c).
+// Only a few rows are ever in flight, so the error rows live in a small
+// ring rather than one per image row.
+class FloydTask : public ParallelTask
+{
+public:
+    FloydTask( const QImage& s, uchar* b, int bpl, const QVector<QRgb>& p, int g )
+        : src(s), bits(b), bytes_per_line(bpl), palette(p), generation(g)
+        , cols(s.width()), rows(s.height())
+        , ring_rows( workerThreads() + 2 )
+    {
+        progress = new QAtomicInt[rows];
+        errors = new int[ring_rows * ( cols + 2 ) * 3];
+        memset( errors, 0, ring_rows * ( cols + 2 ) * 3 * sizeof(int) );
+    }
+    ~FloydTask()
+    {
+        delete [] progress;
+        delete [] errors;
+    }
+    void run( int row )
+    {
+        int* cur = errorRow( row );
+        int* next = errorRow( row + 1 );
+        memset( next, 0, ( cols + 2 ) * 3 * sizeof(int) );
+
+        NearestCache& cache = threadCache( generation );
+        const QRgb* pal = palette.constData();
+        int size = palette.size();
+        const QRgb* line = (const QRgb*)src.scanLine( row );
+        uchar* out = bits + row * bytes_per_line;
+
+        int carry_r = 0, carry_g = 0, carry_b = 0; // error from the left, x16
+        int ready = row ? 0 : cols;
+        for ( int col = 0; col < cols; ++col )
+        {
+            int need = qMin( cols, col + 2 );
+            while ( ready < need )
+            {
+                ready = progress[row - 1].fetchAndAddAcquire( 0 );
+                if ( ready < need )
+                {
+                    QThread::yieldCurrentThread();
+                }
+            }
+
+            // errors are kept scaled by 16 (the FS denominator)
+            int* e = cur + ( col + 1 ) * 3;
+            QRgb c = line[col];
+            int r = clampChannel( qRed( c ) + ( e[0] + carry_r ) / 16 );
+            int g = clampChannel( qGreen( c ) + ( e[1] + carry_g ) / 16 );
+            int b = clampChannel( qBlue( c ) + ( e[2] + carry_b ) / 16 );
+
+            int ind = lookup( cache, qRgb( r, g, b ), pal, size );
+            out[col] = ind;
+
+            int er = r - qRed( pal[ind] );
+            int eg = g - qGreen( pal[ind] );
+            int eb = b - qBlue( pal[ind] );
+            carry_r = er * 7;
+            carry_g = eg * 7;
+            carry_b = eb * 7;
+            int* n = next + col * 3; // column col-1 of the next row
+            n[0] += er * 3; n[3] += er * 5; n[6] += er;
+            n[1] += eg * 3; n[4] += eg * 5; n[7] += eg;
+            n[2] += eb * 3; n[5] += eb * 5; n[8] += eb;
+
+            if ( ( col % PROGRESS_STEP ) == PROGRESS_STEP - 1 )
+            {
+                progress[row].fetchAndStoreRelease( col + 1 );
+            }
+        }
+        progress[row].fetchAndStoreRelease( cols );
+    }
+private:
+    int* errorRow( int row )
+    {
+        return errors + ( row % ring_rows ) * ( cols + 2 ) * 3;
+    }
+    const QImage& src;
+    uchar* bits;
+    int bytes_per_line;
+    const QVector<QRgb>& palette;
+    int generation;
+    int cols;
+    int rows;
+    int ring_rows;
+    QAtomicInt* progress;
+    int* errors;
+};
+
+void addToHistogram( ColorHistogram& hist, const QImage& src, int sample )
+{
+    QImage img = opaqueSource( src );
+    if ( img.isNull() )
+    {
+        return;
+    }
+    sample = qMax( 1, sample );
+    int bands = bandCount( img.height() );
+    HistogramTask task( img, sample, bands );
+    parallelRun( task, bands );
+
+    // merge per-band histograms
+    for ( int band = 0; band < bands; ++band )
+    {
+        ColorHistogram& h = task.hists[band];
+        for ( ColorHistogram::const_iterator it = h.constBegin(); it != h.constEnd(); ++it )
+        {
+            hist[it.key()] += it.value();
+        }
+        h.clear();
+    }
+}
+
+int fitHistogram( ColorHistogram& hist, int max_colors )
+{
+    // too many colors: drop low bits until it fits, at worst leaving 1
+    // significant bit per channel
+    int shift = 0;
+    while ( hist.size() > max_colors && shift < 7 )
+    {
+        ++shift;
+        reduceHistogram( hist, shift );
+    }
+    return shift;
+}
+
+int buildHistogram( ColorHistogram& hist, const QImage& src, int max_colors )
+{
+    hist.clear();
+    addToHistogram( hist, src );
+    return fitHistogram( hist, max_colors );
+}
+
+QImage mapToPalette( const QImage& src, const QVector<QRgb>& palette, DitherMethod dither )
+{
+    QImage img = opaqueSource( src );
+    QImage dst( img.size(), QImage::Format_Indexed8 );
+    dst.setColorTable( palette );
+    if ( img.isNull() || palette.isEmpty() )
+    {
+        return dst;
+    }
+    int generation = g_palette_generation.fetchAndAddOrdered( 1 );
+    uchar* bits = dst.bits(); // detach here, before any worker writes to it
+    if ( dither == DitherMethod_FLOYD )
+    {
+        FloydTask task( img, bits, dst.bytesPerLine(), palette, generation );
+        parallelRun( task, img.height() );
+    }
+    else
+    {
+        int bands = bandCount( img.height() );
+        MapTask task( img, bits, dst.bytesPerLine(), palette, dither, bands, generation );
+        parallelRun( task, bands );
+    }
+    return dst;
+}
+
+// squared color error of each band against its indexed pixels
+class ErrorTask : public ParallelTask
+{
+public:
+    ErrorTask( const QImage& s, const QImage& i, int w, int h, int b )
+        : src(s), indexed(i), table(i.colorTable()), width(w), rows(h), bands(b), errors(b, 0.0)
+    {
+    }
+    void run( int band )
+    {
+        int begin, end;
+        bandRange( band, bands, rows, begin, end );
+        int size = table.size();
+        double error = 0.0;
+        for ( int y = begin; y < end; ++y )
+        {
+            const QRgb* line = (const QRgb*)src.scanLine( y );
+            const uchar* ind = indexed.scanLine( y );
+            for ( int x = 0; x < width; ++x )
+            {
+                QRgb p = ind[x] < size ? table[ind[x]] : 0;
+                int dr = qRed( line[x] ) - qRed( p );
+                int dg = qGreen( line[x] ) - qGreen( p );
+                int db = qBlue( line[x] ) - qBlue( p );
+                error += dr*dr + dg*dg + db*db;
+            }
+        }
+        errors[band] = error;
+    }
+    const QImage& src;
+    const QImage& indexed;
+    QVector<QRgb> table;
+    int width;
+    int rows;
+    int bands;
+    QVector<double> errors;
+};
+
+double paletteError( const QImage& src, const QImage& indexed )
+{
+    QImage img = opaqueSource( src );
+    int width = qMin( img.width(), indexed.width() );
+    int rows = qMin( img.height(), indexed.height() );
+    if ( width <= 0 || rows <= 0 )
+    {
+        return 0.0;
+    }
+    int bands = bandCount( rows );
+    ErrorTask task( img, indexed, width, rows, bands );
+    parallelRun( task, bands );
+    double error = 0.0;
+    for ( int band = 0; band < bands; ++band )
+    {
+        error += task.errors[band];
+    }
+    return error / ( (double)rows * width );
+}
+
+// One k-means step over a slice of the histogram: sums of the colors
+// nearest to each palette entry.
+class KMeansTask : public ParallelTask
+{
+public:
+    KMeansTask( const QVector<QRgb>& c, const QVector<int>& n, const QVector<QRgb>& p, int s )
+        : colors(c), counts(n), palette(p), slices(s)
+        , sums( s * p.size() * 4, 0 )
+    {
+        sum_bits = sums.data(); // detach before the workers start
+    }
+    void run( int slice )
+    {
+        int begin, end;
+        bandRange( slice, slices, colors.size(), begin, end );
+        qint64* sum = sum_bits + slice * palette.size() * 4;
+        const QRgb* pal = palette.constData();
+        int size = palette.size();
+        for ( int i = begin; i < end; ++i )
+        {
+            QRgb c = colors[i];
+            qint64 n = counts[i];
+            qint64* s = sum + nearestIndex( c, pal, size ) * 4;
+            s[0] += qRed( c ) * n;
+            s[1] += qGreen( c ) * n;
+            s[2] += qBlue( c ) * n;
+            s[3] += n;
+        }
+    }
+    const QVector<QRgb>& colors;
+    const QVector<int>& counts;
+    const QVector<QRgb>& palette;
+    int slices;
+    QVector<qint64> sums; // slice, palette entry, r/g/b/count
+    qint64* sum_bits;
+};
+
+QVector<QRgb> refinePalette( const QVector<QRgb>& initial, const ColorHistogram& hist, int iterations )
+{
+    QVector<QRgb> palette = initial;
+    if ( palette.isEmpty() )
+    {
+        return palette;
+    }
+    QVector<QRgb> colors;
+    QVector<int> counts;
+    colors.reserve( hist.size() );
+    counts.reserve( hist.size() );
+    for ( ColorHistogram::const_iterator it = hist.constBegin(); it != hist.constEnd(); ++it )
+    {
+        colors.push_back( it.key() );
+        counts.push_back( it.value() );
+    }
+    int slices = bandCount( colors.size() );
+    for ( int iter = 0; iter < iterations; ++iter )
+    {
+        KMeansTask task( colors, counts, palette, slices );
+        parallelRun( task, slices );
+
+        bool moved = false;
+        for ( int p = 0; p < palette.size(); ++p )
+        {
+            qint64 r = 0, g = 0, b = 0, n = 0;
+            for ( int slice = 0; slice < slices; ++slice )
+            {
+                const qint64* s = task.sums.constData() + ( slice * palette.size() + p ) * 4;
+                r += s[0];
+                g += s[1];
+                b += s[2];
+                n += s[3];
+            }
+            if ( !n )
+            {
+                continue; // unused entry, leave it where it is
+            }
+            QRgb c = qRgb( (int)( ( r + n / 2 ) / n ), (int)( ( g + n / 2 ) / n ), (int)( ( b + n / 2 ) / n ) );
+            if ( c != palette[p] )
+            {
+                palette[p] = c;
+                moved = true;
+            }
+        }
+        if ( !moved )
+        {
+            break; // converged
+        }
+    }
+    return palette;
+}
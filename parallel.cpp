@@ -0,0 +1,109 @@
+#include "parallel.h"
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QAtomicInt>
+#include <QCoreApplication>
+
+#define MIN_BAND_ROWS 16
+#define BANDS_PER_THREAD 4
+#define FRAMES_PER_THREAD 2
+
+static int g_worker_threads = 0;
+
+static QThreadPool* workerPool()
+{
+    // kept apart from the global pool so webkit's own use of it can't
+    // starve us (and vice versa)
+    static QThreadPool pool;
+    return &pool;
+}
+
+static void drain( ParallelTask& task, QAtomicInt& next, int count )
+{
+    for ( ;; )
+    {
+        int index = next.fetchAndAddOrdered( 1 );
+        if ( index >= count )
+        {
+            break;
+        }
+        task.run( index );
+    }
+}
+
+class ParallelRunner : public QRunnable
+{
+public:
+    ParallelRunner( ParallelTask& t, QAtomicInt& n, int c, QSemaphore& d )
+        : task(t), next(n), count(c), done(d)
+    {
+    }
+    void run()
+    {
+        drain( task, next, count );
+        done.release();
+    }
+private:
+    ParallelTask& task;
+    QAtomicInt& next;
+    int count;
+    QSemaphore& done;
+};
+
+void setWorkerThreads( int threads )
+{
+    g_worker_threads = threads;
+    workerPool()->setMaxThreadCount( workerThreads() );
+}
+
+int workerThreads()
+{
+    if ( g_worker_threads > 0 )
+    {
+        return g_worker_threads;
+    }
+    return qMax( 1, QThread::idealThreadCount() );
+}
+
+void parallelRun( ParallelTask& task, int count )
+{
+    if ( count <= 0 )
+    {
+        return;
+    }
+    int helpers = qMin( workerThreads(), count ) - 1;
+    // nested calls from inside a worker run inline: waiting on the pool
+    // from one of its own threads can deadlock
+    QCoreApplication* app = QCoreApplication::instance();
+    if ( app && QThread::currentThread() != app->thread() )
+    {
+        helpers = 0;
+    }
+    QAtomicInt next( 0 );
+    QSemaphore done;
+    for ( int i = 0; i < helpers; ++i )
+    {
+        workerPool()->start( new ParallelRunner( task, next, count, done ) );
+    }
+    drain( task, next, count );
+    done.acquire( helpers );
+}
+
+int bandCount( int rows )
+{
+    int bands = qMin( rows / MIN_BAND_ROWS, workerThreads() * BANDS_PER_THREAD );
+    return qMax( 1, bands );
+}
+
+int frameBatch()
+{
+    return workerThreads() * FRAMES_PER_THREAD;
+}
+
+void bandRange( int band, int bands, int rows, int& begin, int& end )
+{
+    begin = (int)( (long long)rows * band / bands );
+    end = (int)( (long long)rows * ( band + 1 ) / bands );
+}
@@ -0,0 +1,30 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+// Work which can be split into independent items (row bands of an
+// image, frames of an animation) and run across a pool of worker
+// threads. The calling thread always takes part, so a busy pool slows
+// the work down but never stalls it.
+class ParallelTask
+{
+public:
+    virtual ~ParallelTask() {}
+    virtual void run( int index ) = 0; // called once per index, from any thread
+};
+
+// 0 (the default) uses one thread per core
+void setWorkerThreads( int threads );
+int workerThreads();
+
+// run task for every index in [0, count), returning once all are done
+void parallelRun( ParallelTask& task, int count );
+
+// split rows into bands sized for parallelRun
+int bandCount( int rows );
+void bandRange( int band, int bands, int rows, int& begin, int& end );
+
+// frames of an animation for a writer to hold and compress at once:
+// enough to keep the pool busy, few enough that only those are in memory
+int frameBatch();
+
+#endif
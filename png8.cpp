@@ -0,0 +1,217 @@
+#include "png8.h"
+#include "parallel.h"
+#include <QAtomicInt>
+#include <QHash>
+#include <QSet>
+#include <QtAlgorithms>
+
+// distinct colors per band, giving up once any band or all of them
+// together are known to have too many
+class ColorCountTask : public ParallelTask
+{
+public:
+    ColorCountTask( const QImage& s, int m, int b )
+        : src(s), max_colors(m), bands(b), colors(b), overflow(0)
+    {
+    }
+    void run( int band )
+    {
+        int begin, end;
+        bandRange( band, bands, src.height(), begin, end );
+        QSet<QRgb>& set = colors[band];
+        int width = src.width();
+        for ( int y = begin; y < end; ++y )
+        {
+            if ( overflow.fetchAndAddRelaxed( 0 ) )
+            {
+                return;
+            }
+            const QRgb* line = (const QRgb*)src.scanLine( y );
+            QRgb last = line[0];
+            set.insert( last );
+            for ( int x = 1; x < width; ++x )
+            {
+                if ( line[x] != last )
+                {
+                    last = line[x];
+                    set.insert( last );
+                }
+            }
+            if ( set.size() > max_colors )
+            {
+                overflow.fetchAndStoreRelaxed( 1 );
+                return;
+            }
+        }
+    }
+    const QImage& src;
+    int max_colors;
+    int bands;
+    QVector< QSet<QRgb> > colors;
+    QAtomicInt overflow;
+};
+
+static bool fewColors( const QImage& src, int max_colors )
+{
+    int bands = bandCount( src.height() );
+    ColorCountTask task( src, max_colors, bands );
+    parallelRun( task, bands );
+    if ( task.overflow.fetchAndAddRelaxed( 0 ) )
+    {
+        return false;
+    }
+    QSet<QRgb> all;
+    for ( int band = 0; band < bands; ++band )
+    {
+        all.unite( task.colors[band] );
+        if ( all.size() > max_colors )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// palette entries which aren't opaque go first, so tRNS stays short
+static bool alphaLess( QRgb a, QRgb b )
+{
+    return qAlpha( a ) < qAlpha( b );
+}
+
+QImage exactIndexed( const QImage& image, int max_colors )
+{
+    if ( image.isNull() )
+    {
+        return QImage();
+    }
+    QImage src = image;
+    if ( src.format() != QImage::Format_ARGB32 && src.format() != QImage::Format_ARGB32_Premultiplied
+         && src.format() != QImage::Format_RGB32 )
+    {
+        src = src.convertToFormat( QImage::Format_ARGB32_Premultiplied );
+    }
+    if ( !fewColors( src, max_colors ) )
+    {
+        return QImage();
+    }
+
+    // few enough colors: map them directly. Palette entries aren't
+    // premultiplied.
+    QImage argb = src.convertToFormat( QImage::Format_ARGB32 );
+    QHash<QRgb, int> index;
+    QVector<QRgb> table;
+    for ( int y = 0; y < argb.height(); ++y )
+    {
+        const QRgb* line = (const QRgb*)argb.scanLine( y );
+        for ( int x = 0; x < argb.width(); ++x )
+        {
+            if ( !index.contains( line[x] ) )
+            {
+                index.insert( line[x], 0 );
+                table.push_back( line[x] );
+            }
+        }
+    }
+    qStableSort( table.begin(), table.end(), alphaLess );
+    for ( int i = 0; i < table.size(); ++i )
+    {
+        index[table[i]] = i;
+    }
+    QImage indexed( argb.size(), QImage::Format_Indexed8 );
+    indexed.setColorTable( table );
+    for ( int y = 0; y < argb.height(); ++y )
+    {
+        const QRgb* line = (const QRgb*)argb.scanLine( y );
+        uchar* out = indexed.scanLine( y );
+        for ( int x = 0; x < argb.width(); ++x )
+        {
+            out[x] = index.value( line[x] );
+        }
+    }
+    return indexed;
+}
+
+QImage png8Image( const Quantizer* quantizer, const QuantizeOptions& opts, const QImage& image )
+{
+    QImage exact = exactIndexed( image, qMin( opts.max_colors, 256 ) );
+    if ( !exact.isNull() )
+    {
+        return exact;
+    }
+
+    // the quantizers only deal in opaque colors: drop pixels which are
+    // mostly transparent from the histogram and give them their own
+    // entry afterwards
+    QImage argb = image.convertToFormat( QImage::Format_ARGB32 );
+    QImage opaque( argb.size(), QImage::Format_RGB32 );
+    int transparent_pixels = 0;
+    for ( int y = 0; y < argb.height(); ++y )
+    {
+        const QRgb* line = (const QRgb*)argb.scanLine( y );
+        QRgb* out = (QRgb*)opaque.scanLine( y );
+        for ( int x = 0; x < argb.width(); ++x )
+        {
+            if ( qAlpha( line[x] ) < 128 )
+            {
+                out[x] = 0xff000000;
+                ++transparent_pixels;
+            }
+            else
+            {
+                out[x] = line[x] | 0xff000000;
+            }
+        }
+    }
+
+    QuantizeOptions palette_opts = opts;
+    if ( transparent_pixels )
+    {
+        palette_opts.max_colors = qMin( palette_opts.max_colors, 255 );
+    }
+    ColorHistogram hist;
+    addToHistogram( hist, opaque );
+    if ( transparent_pixels )
+    {
+        // they were counted as black
+        ColorHistogram::iterator black = hist.find( 0xff000000 );
+        black.value() -= transparent_pixels;
+        if ( black.value() <= 0 )
+        {
+            hist.erase( black );
+        }
+    }
+    fitHistogram( hist, MAXCOLORS );
+    QVector<QRgb> palette = quantizer->palette( hist, palette_opts );
+    if ( palette.isEmpty() )
+    {
+        // quantizer converts images directly, take its colors
+        palette = quantizer->quantize( opaque, palette_opts ).colorTable();
+        if ( transparent_pixels && palette.size() > 255 )
+        {
+            palette.resize( 255 );
+        }
+    }
+    QImage indexed = quantizer->quantize( opaque, palette_opts, palette );
+    if ( !transparent_pixels )
+    {
+        return indexed;
+    }
+
+    QVector<QRgb> table = indexed.colorTable();
+    int transparent = table.size();
+    table.push_back( 0 );
+    indexed.setColorTable( table );
+    for ( int y = 0; y < argb.height(); ++y )
+    {
+        const QRgb* line = (const QRgb*)argb.scanLine( y );
+        uchar* out = indexed.scanLine( y );
+        for ( int x = 0; x < argb.width(); ++x )
+        {
+            if ( qAlpha( line[x] ) < 128 )
+            {
+                out[x] = transparent;
+            }
+        }
+    }
+    return indexed;
+}
@@ -0,0 +1,22 @@
+#ifndef PNG8_H
+#define PNG8_H
+
+#include <QImage>
+#include <QVector>
+#include "quant.h"
+
+// Paletted (8 bit) PNG, with a tRNS chunk for palette alpha. Qt's png
+// writer does the rest once an image is Format_Indexed8.
+
+// image as Format_Indexed8 holding exactly its own colors, alpha
+// included, or a null image if it has more than max_colors of them.
+// Counting stops as soon as there are too many, so this is cheap to
+// try on photographic content.
+QImage exactIndexed( const QImage& image, int max_colors = 256 );
+
+// image reduced to a palette by the quantizer, or exactly when it has
+// few enough colors. Pixels less than half opaque share one fully
+// transparent entry; the rest are quantized as if opaque.
+QImage png8Image( const Quantizer* quantizer, const QuantizeOptions& opts, const QImage& image );
+
+#endif
@@ -0,0 +1,141 @@
+#include "pngchunk.h"
+#include <QIODevice>
+#include <cstdlib>
+
+static quint32 g_crc_table[256];
+static bool g_crc_table_ready = false;
+
+static quint32 crc32( const char* data, int len )
+{
+    if ( !g_crc_table_ready )
+    {
+        for ( quint32 n = 0; n < 256; ++n )
+        {
+            quint32 c = n;
+            for ( int k = 0; k < 8; ++k )
+            {
+                c = ( c & 1 ) ? 0xedb88320u ^ ( c >> 1 ) : c >> 1;
+            }
+            g_crc_table[n] = c;
+        }
+        g_crc_table_ready = true;
+    }
+    quint32 crc = 0xffffffffu;
+    for ( int i = 0; i < len; ++i )
+    {
+        crc = g_crc_table[( crc ^ (uchar)data[i] ) & 0xff] ^ ( crc >> 8 );
+    }
+    return ~crc;
+}
+
+void pngPutLong( QByteArray& out, quint32 v )
+{
+    out.append( (char)( v >> 24 ) );
+    out.append( (char)( v >> 16 ) );
+    out.append( (char)( v >> 8 ) );
+    out.append( (char)v );
+}
+
+void pngPutShort( QByteArray& out, int v )
+{
+    out.append( (char)( v >> 8 ) );
+    out.append( (char)v );
+}
+
+bool pngWriteChunk( QIODevice* out, const char* type, const QByteArray& data )
+{
+    QByteArray chunk;
+    chunk.reserve( data.size() + 12 );
+    pngPutLong( chunk, data.size() );
+    chunk.append( type, 4 );
+    chunk.append( data );
+    pngPutLong( chunk, crc32( chunk.constData() + 4, chunk.size() - 4 ) );
+    return out->write( chunk ) == chunk.size();
+}
+
+QByteArray pngHeader( const QSize& size, bool alpha )
+{
+    QByteArray ihdr;
+    pngPutLong( ihdr, size.width() );
+    pngPutLong( ihdr, size.height() );
+    ihdr.append( (char)8 );                 // bit depth
+    ihdr.append( (char)( alpha ? 6 : 2 ) ); // RGBA or RGB
+    ihdr.append( (char)0 );                 // deflate
+    ihdr.append( (char)0 );                 // adaptive filtering
+    ihdr.append( (char)0 );                 // not interlaced
+    return ihdr;
+}
+
+static inline int paeth( int a, int b, int c )
+{
+    int p = a + b - c;
+    int pa = abs( p - a );
+    int pb = abs( p - b );
+    int pc = abs( p - c );
+    if ( pa <= pb && pa <= pc )
+    {
+        return a;
+    }
+    return pb <= pc ? b : c;
+}
+
+void pngFilterRow( const uchar* c, const uchar* p, int bytes, int bpp, QByteArray& out )
+{
+    QByteArray candidate[5];
+    int best = 0;
+    long best_sum = -1;
+    for ( int f = 0; f < 5; ++f )
+    {
+        candidate[f].resize( bytes );
+        uchar* o = (uchar*)candidate[f].data();
+        long sum = 0;
+        for ( int i = 0; i < bytes; ++i )
+        {
+            int left = i >= bpp ? c[i - bpp] : 0;
+            int up = p[i];
+            int up_left = i >= bpp ? p[i - bpp] : 0;
+            int v;
+            switch ( f )
+            {
+            case 0: v = c[i]; break;
+            case 1: v = c[i] - left; break;
+            case 2: v = c[i] - up; break;
+            case 3: v = c[i] - ( ( left + up ) >> 1 ); break;
+            default: v = c[i] - paeth( left, up, up_left ); break;
+            }
+            o[i] = (uchar)v;
+            sum += abs( (signed char)o[i] );
+        }
+        if ( best_sum < 0 || sum < best_sum )
+        {
+            best_sum = sum;
+            best = f;
+        }
+    }
+    out.append( (char)best );
+    out.append( candidate[best] );
+}
+
+int pngLevel( int quality )
+{
+    if ( quality < 0 )
+    {
+        return -1;
+    }
+    return ( 100 - qMin( quality, 100 ) ) * 9 / 91;
+}
+
+void pngRowBytes( const QImage& image, int y, bool alpha, uchar* out )
+{
+    const QRgb* line = (const QRgb*)image.scanLine( y );
+    for ( int x = 0; x < image.width(); ++x )
+    {
+        *out++ = qRed( line[x] );
+        *out++ = qGreen( line[x] );
+        *out++ = qBlue( line[x] );
+        if ( alpha )
+        {
+            *out++ = qAlpha( line[x] );
+        }
+    }
+}
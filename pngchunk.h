@@ -0,0 +1,34 @@
+#ifndef PNGCHUNK_H
+#define PNGCHUNK_H
+
+#include <QByteArray>
+#include <QImage>
+
+class QIODevice;
+
+// Pieces of the png format shared by the apng and streaming png writers
+
+#define PNG_SIGNATURE "\x89PNG\r\n\x1a\n"
+
+void pngPutLong( QByteArray& out, quint32 v );  // big endian
+void pngPutShort( QByteArray& out, int v );
+
+// length, type, data and crc
+bool pngWriteChunk( QIODevice* out, const char* type, const QByteArray& data );
+
+// IHDR data, 8 bits per channel, RGBA or RGB
+QByteArray pngHeader( const QSize& size, bool alpha );
+
+// append the filter type byte and the filtered row, choosing the filter
+// with the smallest sum of absolute differences. prev is the previous
+// unfiltered row, all zero for the first one. bpp is 3 or 4.
+void pngFilterRow( const uchar* row, const uchar* prev, int bytes, int bpp, QByteArray& out );
+
+// deflate level for a quality setting, mapped the way Qt's png writer
+// does it: higher quality compresses faster but larger
+int pngLevel( int quality );
+
+// row y of image (ARGB32, not premultiplied) as R,G,B(,A) bytes
+void pngRowBytes( const QImage& image, int y, bool alpha, uchar* out );
+
+#endif
@@ -2,17 +2,104 @@
 #define QUANT_H
 
 #include <QImage>
+#include <QHash>
+#include <QVector>
+#include <QStringList>
 
-enum QuantizeMethod
+enum DitherMethod
 {
-    QuantizeMethod_THRESHOLD,
-    QuantizeMethod_DIFFUSE,
-    QuantizeMethod_ORDERED,
-    QuantizeMethod_MEDIANCUT,
-    QuantizeMethod_MEDIANCUT_FLOYD
+    DitherMethod_NONE,
+    DitherMethod_FLOYD,     // error diffusion, wavefront parallel
+    DitherMethod_ORDERED,   // 8x8 bayer matrix, band parallel
+    DitherMethod_BLUENOISE  // interleaved gradient noise, band parallel
 };
 
-QuantizeMethod toQuantizeMethod( const QString& s );
-QImage quantize_mediancut( const QImage& src, bool use_floyd );
+typedef QHash<QRgb, int> ColorHistogram; // color / number of pixels
+
+// histograms are reduced to at most this many colors before building
+// a palette from them
+//#define MAXCOLORS 32767
+#define MAXCOLORS 65536
+//#define MAXCOLORS 262144
+
+struct QuantizeOptions
+{
+    QuantizeOptions();
+    int max_colors;        // at most 256
+    int kmeans_iterations; // palette refinement passes, 0 disables
+};
+
+// A color reduction method, selected by name (see findQuantizer). Most
+// build a palette from a color histogram and then map the image onto
+// it; the Qt based ones convert the image directly.
+class Quantizer
+{
+public:
+    Quantizer( const QString& name, DitherMethod dither );
+    virtual ~Quantizer();
+    QString name() const;
+    DitherMethod dither() const;
+
+    // palette for the colors in hist, or an empty vector if this
+    // quantizer doesn't build its own
+    virtual QVector<QRgb> buildPalette( const ColorHistogram& hist, int max_colors ) const;
+
+    // buildPalette with the options applied: every color when there are
+    // few enough of them, k-means refinement otherwise
+    QVector<QRgb> palette( const ColorHistogram& hist, const QuantizeOptions& opts ) const;
+
+    // reduce src to Format_Indexed8. A non-empty color_table is used as
+    // is, so that animation frames can share one palette.
+    virtual QImage quantize( const QImage& src, const QuantizeOptions& opts,
+                             const QVector<QRgb>& color_table = QVector<QRgb>() ) const;
+private:
+    QString quantizer_name;
+    DitherMethod dither_method;
+};
+
+class QtQuantizer : public Quantizer
+{
+public:
+    QtQuantizer( const QString& name, Qt::ImageConversionFlags flags );
+    virtual QImage quantize( const QImage& src, const QuantizeOptions& opts,
+                             const QVector<QRgb>& color_table = QVector<QRgb>() ) const;
+private:
+    Qt::ImageConversionFlags conversion_flags;
+};
+
+class MedianCutQuantizer : public Quantizer
+{
+public:
+    MedianCutQuantizer( const QString& name, DitherMethod dither );
+    virtual QVector<QRgb> buildPalette( const ColorHistogram& hist, int max_colors ) const;
+};
+
+class WuQuantizer : public Quantizer
+{
+public:
+    WuQuantizer( const QString& name, DitherMethod dither );
+    virtual QVector<QRgb> buildPalette( const ColorHistogram& hist, int max_colors ) const;
+};
+
+class OctreeQuantizer : public Quantizer
+{
+public:
+    OctreeQuantizer( const QString& name, DitherMethod dither );
+    virtual QVector<QRgb> buildPalette( const ColorHistogram& hist, int max_colors ) const;
+};
+
+// registry, keyed by name. Builtins are registered on first use.
+void registerQuantizer( Quantizer* quantizer ); // takes ownership
+const Quantizer* findQuantizer( const QString& name ); // 0 if unknown
+const Quantizer* toQuantizer( const QString& name );   // MEDIANCUT if unknown
+QStringList quantizerNames();
+
+// palette.cpp
+int buildHistogram( ColorHistogram& hist, const QImage& src, int max_colors );
+void addToHistogram( ColorHistogram& hist, const QImage& src, int sample = 1 ); // every sample'th row
+int fitHistogram( ColorHistogram& hist, int max_colors ); // returns bits dropped per channel
+double paletteError( const QImage& src, const QImage& indexed ); // mean squared error per pixel
+QImage mapToPalette( const QImage& src, const QVector<QRgb>& palette, DitherMethod dither );
+QVector<QRgb> refinePalette( const QVector<QRgb>& palette, const ColorHistogram& hist, int iterations );
 
 #endif
@@ -0,0 +1,151 @@
+#include "quant.h"
+#include <QMap>
+#include <iostream>
+
+QuantizeOptions::QuantizeOptions()
+    : max_colors(256)
+    , kmeans_iterations(0)
+{
+}
+
+Quantizer::Quantizer( const QString& name, DitherMethod dither )
+    : quantizer_name(name)
+    , dither_method(dither)
+{
+}
+
+Quantizer::~Quantizer()
+{
+}
+
+QString Quantizer::name() const
+{
+    return quantizer_name;
+}
+
+DitherMethod Quantizer::dither() const
+{
+    return dither_method;
+}
+
+QVector<QRgb> Quantizer::buildPalette( const ColorHistogram&, int ) const
+{
+    return QVector<QRgb>();
+}
+
+QImage Quantizer::quantize( const QImage& src, const QuantizeOptions& opts, const QVector<QRgb>& color_table ) const
+{
+    if ( color_table.size() )
+    {
+        return mapToPalette( src, color_table, dither_method );
+    }
+    ColorHistogram hist;
+    buildHistogram( hist, src, MAXCOLORS );
+    return mapToPalette( src, palette( hist, opts ), dither_method );
+}
+
+QVector<QRgb> Quantizer::palette( const ColorHistogram& hist, const QuantizeOptions& opts ) const
+{
+    QVector<QRgb> colors;
+    if ( hist.size() <= opts.max_colors )
+    {
+        // few enough colors to keep every one of them
+        colors.reserve( hist.size() );
+        for ( ColorHistogram::const_iterator it = hist.constBegin(); it != hist.constEnd(); ++it )
+        {
+            colors.push_back( it.key() );
+        }
+        return colors;
+    }
+    colors = buildPalette( hist, opts.max_colors );
+    if ( colors.size() && opts.kmeans_iterations > 0 )
+    {
+        colors = refinePalette( colors, hist, opts.kmeans_iterations );
+    }
+    return colors;
+}
+
+QtQuantizer::QtQuantizer( const QString& name, Qt::ImageConversionFlags flags )
+    : Quantizer(name, DitherMethod_NONE)
+    , conversion_flags(flags)
+{
+}
+
+QImage QtQuantizer::quantize( const QImage& src, const QuantizeOptions&, const QVector<QRgb>& color_table ) const
+{
+    if ( color_table.size() )
+    {
+        return src.convertToFormat( QImage::Format_Indexed8, color_table, conversion_flags );
+    }
+    return src.convertToFormat( QImage::Format_Indexed8, conversion_flags );
+}
+
+//////
+
+typedef QMap<QString, Quantizer*> QuantizerMap;
+
+// every palette based quantizer comes in each dither flavor
+template <class T>
+static void addDithered( QuantizerMap& quantizers, const QString& name )
+{
+    quantizers.insert( name, new T( name, DitherMethod_NONE ) );
+    quantizers.insert( name + "_FLOYD", new T( name + "_FLOYD", DitherMethod_FLOYD ) );
+    quantizers.insert( name + "_ORDERED", new T( name + "_ORDERED", DitherMethod_ORDERED ) );
+    quantizers.insert( name + "_BLUENOISE", new T( name + "_BLUENOISE", DitherMethod_BLUENOISE ) );
+}
+
+static QuantizerMap& registry()
+{
+    static QuantizerMap quantizers;
+    static bool initialized = false;
+    if ( !initialized )
+    {
+        initialized = true;
+        quantizers.insert( "THRESHOLD", new QtQuantizer( "THRESHOLD", Qt::ThresholdDither ) );
+        quantizers.insert( "DIFFUSE", new QtQuantizer( "DIFFUSE", Qt::DiffuseDither ) );
+        quantizers.insert( "ORDERED", new QtQuantizer( "ORDERED", Qt::OrderedDither ) );
+        addDithered<MedianCutQuantizer>( quantizers, "MEDIANCUT" );
+        addDithered<WuQuantizer>( quantizers, "WU" );
+        addDithered<OctreeQuantizer>( quantizers, "OCTREE" );
+    }
+    return quantizers;
+}
+
+void registerQuantizer( Quantizer* quantizer )
+{
+    QuantizerMap& quantizers = registry();
+    QuantizerMap::iterator it = quantizers.find( quantizer->name() );
+    if ( it != quantizers.end() )
+    {
+        delete it.value();
+        quantizers.erase( it );
+    }
+    quantizers.insert( quantizer->name(), quantizer );
+}
+
+const Quantizer* findQuantizer( const QString& name )
+{
+    QuantizerMap& quantizers = registry();
+    QuantizerMap::const_iterator it = quantizers.constFind( name.toUpper() );
+    if ( it == quantizers.constEnd() )
+    {
+        return 0;
+    }
+    return it.value();
+}
+
+const Quantizer* toQuantizer( const QString& name )
+{
+    const Quantizer* quantizer = findQuantizer( name );
+    if ( !quantizer )
+    {
+        std::cerr << "warning: unknown quantize method:" << name.toLocal8Bit().constData() << ", using MEDIANCUT" << std::endl;
+        quantizer = findQuantizer( "MEDIANCUT" );
+    }
+    return quantizer;
+}
+
+QStringList quantizerNames()
+{
+    return registry().keys();
+}
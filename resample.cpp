@@ -0,0 +1,350 @@
+#include "resample.h"
+#include "parallel.h"
+#include <QVector>
+#include <cmath>
+#include <iostream>
+#include <time.h>
+
+// lobes of the lanczos window
+#define LANCZOS_LOBES 3
+// fixed point weights: 14 bits keeps a 4 channel sum of 255 * weight
+// products well inside 32 bits, with headroom for negative lobes
+#define WEIGHT_BITS 14
+#define WEIGHT_ONE ( 1 << WEIGHT_BITS )
+
+static double lanczos( double x )
+{
+    if ( x == 0 )
+    {
+        return 1;
+    }
+    if ( x <= -LANCZOS_LOBES || x >= LANCZOS_LOBES )
+    {
+        return 0;
+    }
+    double px = M_PI * x;
+    return LANCZOS_LOBES * sin( px ) * sin( px / LANCZOS_LOBES ) / ( px * px );
+}
+
+// for each destination pixel, the first source pixel it reads and its
+// weights, all destination pixels having the same number of taps
+struct Contributions
+{
+    int taps;
+    QVector<int> first;
+    QVector<int> weights; // taps per destination pixel
+};
+
+static Contributions contributions( int src, int dst )
+{
+    Contributions c;
+    double scale = (double)dst / src;
+    double stretch = scale < 1 ? 1 / scale : 1; // widen the filter when shrinking
+    double support = LANCZOS_LOBES * stretch;
+    c.taps = qMin( src, (int)ceil( support ) * 2 + 1 );
+    c.first.resize( dst );
+    c.weights.resize( dst * c.taps );
+    QVector<double> w( c.taps );
+    for ( int i = 0; i < dst; ++i )
+    {
+        double center = ( i + 0.5 ) / scale - 0.5;
+        int first = qBound( 0, (int)floor( center - support ) + 1, src - c.taps );
+        double sum = 0;
+        for ( int t = 0; t < c.taps; ++t )
+        {
+            w[t] = lanczos( ( first + t - center ) / stretch );
+            sum += w[t];
+        }
+        // normalize, putting the rounding error on the largest weight so
+        // that flat areas stay exactly flat
+        int total = 0;
+        int largest = 0;
+        int* out = c.weights.data() + i * c.taps;
+        for ( int t = 0; t < c.taps; ++t )
+        {
+            out[t] = (int)floor( w[t] / sum * WEIGHT_ONE + 0.5 );
+            total += out[t];
+            if ( out[t] > out[largest] )
+            {
+                largest = t;
+            }
+        }
+        out[largest] += WEIGHT_ONE - total;
+        c.first[i] = first;
+    }
+    return c;
+}
+
+// round a fixed point sum to a byte, and keep color within alpha as
+// premultiplied pixels need; negative lobes can push either out of range
+static inline uint packPixel( const int* sum )
+{
+    int a = qBound( 0, ( sum[3] + WEIGHT_ONE / 2 ) >> WEIGHT_BITS, 255 );
+    int r = qBound( 0, ( sum[2] + WEIGHT_ONE / 2 ) >> WEIGHT_BITS, a );
+    int g = qBound( 0, ( sum[1] + WEIGHT_ONE / 2 ) >> WEIGHT_BITS, a );
+    int b = qBound( 0, ( sum[0] + WEIGHT_ONE / 2 ) >> WEIGHT_BITS, a );
+    return ( a << 24 ) | ( r << 16 ) | ( g << 8 ) | b;
+}
+
+// image flipped over its diagonal, in small tiles so that both the rows
+// read and the rows written stay in cache
+#define TRANSPOSE_TILE 16
+
+class TransposeTask : public ParallelTask
+{
+public:
+    TransposeTask( const QImage& s, QImage& d, int bs )
+        : src(s), dst(d), bands(bs)
+    {
+    }
+    void run( int band )
+    {
+        int begin, end;
+        bandRange( band, bands, dst.height(), begin, end );
+        for ( int y0 = begin; y0 < end; y0 += TRANSPOSE_TILE )
+        {
+            int y1 = qMin( end, y0 + TRANSPOSE_TILE );
+            for ( int x0 = 0; x0 < dst.width(); x0 += TRANSPOSE_TILE )
+            {
+                int x1 = qMin( dst.width(), x0 + TRANSPOSE_TILE );
+                for ( int y = y0; y < y1; ++y )
+                {
+                    uint* out = (uint*)dst.scanLine( y );
+                    for ( int x = x0; x < x1; ++x )
+                    {
+                        out[x] = ( (const uint*)src.scanLine( x ) )[y];
+                    }
+                }
+            }
+        }
+    }
+private:
+    const QImage& src;
+    QImage& dst;
+    int bands;
+};
+
+static QImage transposed( const QImage& image )
+{
+    QImage dst( image.height(), image.width(), QImage::Format_ARGB32_Premultiplied );
+    int bands = bandCount( dst.height() );
+    TransposeTask task( image, dst, bands );
+    parallelRun( task, bands );
+    return dst;
+}
+
+// columns of src resampled to the height of dst, a whole row at a time.
+// Weights and bytes are multiplied as 16 bit values into 32 bit sums,
+// which vectorizes well everywhere. Widths are resampled by running
+// this on the transposed image: resampling along a row has to gather
+// different pixels for every output pixel, which doesn't.
+class VerticalTask : public ParallelTask
+{
+public:
+    VerticalTask( const QImage& s, QImage& d, const Contributions& c, int bs )
+        : src(s), dst(d), contrib(c), bands(bs)
+    {
+    }
+    void run( int band )
+    {
+        int begin, end;
+        bandRange( band, bands, dst.height(), begin, end );
+        int bytes = dst.width() * 4;
+        QVector<int> sums( bytes );
+        int* sum = sums.data();
+        for ( int y = begin; y < end; ++y )
+        {
+            const int* w = contrib.weights.constData() + y * contrib.taps;
+            sums.fill( 0 );
+            for ( int t = 0; t < contrib.taps; ++t )
+            {
+                const uchar* in = src.scanLine( contrib.first[y] + t );
+                short weight = w[t];
+                for ( int i = 0; i < bytes; ++i )
+                {
+                    sum[i] += weight * (short)in[i];
+                }
+            }
+            uint* out = (uint*)dst.scanLine( y );
+            for ( int x = 0; x < dst.width(); ++x )
+            {
+                out[x] = packPixel( sum + x * 4 );
+            }
+        }
+    }
+private:
+    const QImage& src;
+    QImage& dst;
+    const Contributions& contrib;
+    int bands;
+};
+
+// average of kx by ky blocks, the blocks at the right and bottom edges
+// taking whatever is left over
+class BoxTask : public ParallelTask
+{
+public:
+    BoxTask( const QImage& s, QImage& d, int x, int y, int bs )
+        : src(s), dst(d), kx(x), ky(y), bands(bs)
+    {
+    }
+    void run( int band )
+    {
+        int begin, end;
+        bandRange( band, bands, dst.height(), begin, end );
+        int bytes = src.width() * 4;
+        QVector<int> sums( bytes );
+        int* sum = sums.data();
+        for ( int y = begin; y < end; ++y )
+        {
+            // columns first: whole rows added together
+            int top = y * ky;
+            int rows = qMin( ky, src.height() - top );
+            sums.fill( 0 );
+            for ( int r = 0; r < rows; ++r )
+            {
+                const uchar* in = src.scanLine( top + r );
+                for ( int i = 0; i < bytes; ++i )
+                {
+                    sum[i] += in[i];
+                }
+            }
+            uint* out = (uint*)dst.scanLine( y );
+            for ( int x = 0; x < dst.width(); ++x )
+            {
+                int left = x * kx;
+                int cols = qMin( kx, src.width() - left );
+                int block[4] = { 0, 0, 0, 0 };
+                const int* s = sum + left * 4;
+                for ( int i = 0; i < cols * 4; i += 4 )
+                {
+                    for ( int c = 0; c < 4; ++c )
+                    {
+                        block[c] += s[i + c];
+                    }
+                }
+                int count = cols * rows;
+                out[x] = ( ( ( block[3] + count / 2 ) / count ) << 24 ) | ( ( ( block[2] + count / 2 ) / count ) << 16 )
+                    | ( ( ( block[1] + count / 2 ) / count ) << 8 ) | ( ( block[0] + count / 2 ) / count );
+            }
+        }
+    }
+private:
+    const QImage& src;
+    QImage& dst;
+    int kx, ky;
+    int bands;
+};
+
+static QImage resampleColumns( const QImage& image, int height )
+{
+    QImage dst( image.width(), height, QImage::Format_ARGB32_Premultiplied );
+    Contributions c = contributions( image.height(), height );
+    int bands = bandCount( height );
+    VerticalTask task( image, dst, c, bands );
+    parallelRun( task, bands );
+    return dst;
+}
+
+QImage resampleImage( const QImage& image, const QSize& size )
+{
+    QImage src = image;
+    if ( src.format() != QImage::Format_ARGB32_Premultiplied )
+    {
+        src = src.convertToFormat( QImage::Format_ARGB32_Premultiplied );
+    }
+    if ( src.isNull() || size.isEmpty() || size == src.size() )
+    {
+        return src;
+    }
+    // big reductions: average whole blocks down to between 2 and 4 times
+    // the size wanted, which is far cheaper per source pixel than a
+    // filter that wide, and leave the rest to the filter
+    int kx = qMax( 1, src.width() / ( size.width() * 2 ) );
+    int ky = qMax( 1, src.height() / ( size.height() * 2 ) );
+    if ( kx > 1 || ky > 1 )
+    {
+        QImage dst( ( src.width() + kx - 1 ) / kx, ( src.height() + ky - 1 ) / ky, QImage::Format_ARGB32_Premultiplied );
+        int bands = bandCount( dst.height() );
+        BoxTask task( src, dst, kx, ky, bands );
+        parallelRun( task, bands );
+        src = dst;
+    }
+    // the pass which shrinks more goes first, leaving less for the other
+    bool rows_first = (double)size.width() / src.width() <= (double)size.height() / src.height();
+    QImage out = src;
+    for ( int pass = 0; pass < 2; ++pass )
+    {
+        bool horizontal = ( pass == 0 ) == rows_first;
+        if ( horizontal && out.width() != size.width() )
+        {
+            out = transposed( resampleColumns( transposed( out ), size.width() ) );
+        }
+        else if ( !horizontal && out.height() != size.height() )
+        {
+            out = resampleColumns( out, size.height() );
+        }
+    }
+    return out;
+}
+
+QSize thumbnailSize( const QSize& size, double scale, int max_width, int max_height )
+{
+    if ( size.isEmpty() )
+    {
+        return size;
+    }
+    double s = scale > 0 ? scale : 1;
+    if ( max_width > 0 && size.width() * s > max_width )
+    {
+        s = (double)max_width / size.width();
+    }
+    if ( max_height > 0 && size.height() * s > max_height )
+    {
+        s = (double)max_height / size.height();
+    }
+    return QSize( qMax( 1, qRound( size.width() * s ) ), qMax( 1, qRound( size.height() * s ) ) );
+}
+
+#define BENCH_RUNS 5
+
+static double benchMs()
+{
+    timespec t;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return t.tv_sec * 1000.0 + t.tv_nsec / 1000000.0;
+}
+
+int benchScale( const QString& filename )
+{
+    QImage image( filename );
+    if ( image.isNull() )
+    {
+        std::cerr << "Unable to read " << filename.toLocal8Bit().constData() << std::endl;
+        return 1;
+    }
+    image = image.convertToFormat( QImage::Format_ARGB32_Premultiplied );
+    std::cout << filename.toLocal8Bit().constData() << ": " << image.width() << "x" << image.height()
+              << ", best of " << BENCH_RUNS << " runs" << std::endl;
+    const double scales[] = { 0.5, 0.25, 0.1 };
+    for ( unsigned int i = 0; i < sizeof(scales) / sizeof(scales[0]); ++i )
+    {
+        QSize size = thumbnailSize( image.size(), scales[i], 0, 0 );
+        double qt = 0;
+        double ours = 0;
+        for ( int run = 0; run < BENCH_RUNS; ++run )
+        {
+            double start = benchMs();
+            QImage a = image.scaled( size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation );
+            double middle = benchMs();
+            QImage b = resampleImage( image, size );
+            double end = benchMs();
+            qt = run ? qMin( qt, middle - start ) : middle - start;
+            ours = run ? qMin( ours, end - middle ) : end - middle;
+        }
+        std::cout << "scale " << scales[i] << " to " << size.width() << "x" << size.height()
+                  << ": QImage::scaled " << qt << "ms, resampleImage " << ours << "ms ("
+                  << ( ours > 0 ? qt / ours : 0 ) << "x)" << std::endl;
+    }
+    return 0;
+}
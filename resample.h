@@ -0,0 +1,28 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <QImage>
+#include <QSize>
+#include <QString>
+
+// Image resizing for thumbnails: a separable Lanczos-3 filter, widened
+// by the reduction when shrinking so that every source pixel counts
+// (area averaging in effect, without the aliasing). Works on
+// premultiplied ARGB32 with integer weights, one channel of one pixel
+// after another, so the inner loops are plain multiply-adds over
+// contiguous bytes which the compiler vectorizes. Rows are done in
+// parallel bands.
+
+// image resized to size, premultiplied ARGB32
+QImage resampleImage( const QImage& image, const QSize& size );
+
+// size of image scaled by scale, then shrunk further to fit max_width
+// and max_height where those are > 0, keeping the aspect ratio
+QSize thumbnailSize( const QSize& size, double scale, int max_width, int max_height );
+
+// times resampleImage against QImage::scaled with smooth transformation
+// on the given image at a few reductions, for --bench-scale. Returns
+// non-zero if the image can't be read.
+int benchScale( const QString& filename );
+
+#endif
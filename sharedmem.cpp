@@ -0,0 +1,121 @@
+#include "sharedmem.h"
+#include <QFileInfo>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+
+static int createShared( const QByteArray& name )
+{
+    int fd;
+#ifdef SYS_memfd_create
+    // through syscall, older glibc has no wrapper
+    fd = syscall( SYS_memfd_create, name.constData(), MFD_CLOEXEC | MFD_ALLOW_SEALING );
+    if ( fd >= 0 || errno != ENOSYS )
+    {
+        return fd;
+    }
+#endif
+    static int count = 0;
+    QByteArray shm_name = "/" + name + "." + QByteArray::number( (int)getpid() ) + "." + QByteArray::number( ++count );
+    fd = shm_open( shm_name.constData(), O_RDWR | O_CREAT | O_EXCL, 0600 );
+    if ( fd >= 0 )
+    {
+        // only the descriptor is passed on
+        shm_unlink( shm_name.constData() );
+        fcntl( fd, F_SETFD, FD_CLOEXEC );
+    }
+    return fd;
+}
+
+EncodedFile::EncodedFile()
+    : fd(-1)
+    , size(0)
+{
+}
+
+EncodeTarget::EncodeTarget( EncodedFile& f, bool s, const QString& n )
+    : file(f)
+    , shared(s)
+    , done(false)
+    , buffer(&f.data)
+    , name(n)
+{
+    file.data.clear();
+    file.fd = -1;
+    file.size = 0;
+    file.error.clear();
+    if ( !shared )
+    {
+        buffer.open( QIODevice::WriteOnly );
+        return;
+    }
+    QByteArray base = QFile::encodeName( QFileInfo( name ).fileName() ).replace( '/', '_' );
+    file.fd = createShared( "ichabod." + base );
+    if ( file.fd < 0 )
+    {
+        file.error = QString("Failure to create shared memory for: %1 (%2)").arg(name).arg(strerror( errno ));
+        return;
+    }
+    // the descriptor stays open when shm is closed
+    if ( !shm.open( file.fd, QIODevice::WriteOnly ) )
+    {
+        file.error = QString("Failure to open shared memory for: %1 (%2)").arg(name).arg(shm.errorString());
+        close( file.fd );
+        file.fd = -1;
+    }
+}
+
+EncodeTarget::~EncodeTarget()
+{
+    if ( !done && file.fd >= 0 )
+    {
+        // before the descriptor goes, so nothing is flushed into a reused one
+        shm.close();
+        close( file.fd );
+        file.fd = -1;
+    }
+}
+
+QIODevice* EncodeTarget::device()
+{
+    if ( !shared )
+    {
+        return &buffer;
+    }
+    return file.fd >= 0 ? &shm : 0;
+}
+
+bool EncodeTarget::finish()
+{
+    if ( !shared )
+    {
+        file.size = file.data.size();
+        done = true;
+        return true;
+    }
+    if ( file.fd < 0 )
+    {
+        return false;
+    }
+    if ( !shm.flush() || shm.error() != QFile::NoError )
+    {
+        file.error = QString("Failure to write shared memory for: %1 (%2)").arg(name).arg(shm.errorString());
+        return false;
+    }
+    file.size = shm.size();
+    shm.close();
+#ifdef F_ADD_SEALS
+    // not for shm_open objects, which can't be sealed
+    fcntl( file.fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL );
+#endif
+    done = true;
+    return true;
+}
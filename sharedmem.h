@@ -0,0 +1,47 @@
+#ifndef SHAREDMEM_H
+#define SHAREDMEM_H
+
+#include <QString>
+#include <QByteArray>
+#include <QBuffer>
+#include <QFile>
+
+// Encoded files handed to a local client as shared memory rather than
+// bytes on a socket, see shm in unixsocket.h. The file is a memfd, or an
+// unlinked POSIX shared memory object where memfd_create isn't there.
+// The encoder writes straight into it, and a memfd is sealed once
+// written, so the client can map it knowing its size and contents won't
+// change underneath.
+
+// one encoded file, as bytes or as shared memory
+struct EncodedFile
+{
+    EncodedFile();
+    QByteArray data; // empty when shared
+    int fd;          // shared memory holding it, else -1. Whoever publishes it owns it
+    qint64 size;
+    QString error;   // why shared memory failed
+};
+
+// where an encoder writes file: memory, or with shared a fresh shared
+// memory file. name only shows up in /proc, it doesn't need to be
+// unique. device() is 0 with file.error set when the shared memory
+// couldn't be made. finish() once the encoder is done; without it the
+// descriptor is closed again.
+class EncodeTarget
+{
+public:
+    EncodeTarget( EncodedFile& file, bool shared, const QString& name );
+    ~EncodeTarget();
+    QIODevice* device();
+    bool finish();
+private:
+    EncodedFile& file;
+    bool shared;
+    bool done;
+    QBuffer buffer;
+    QFile shm;
+    QString name;
+};
+
+#endif
@@ -0,0 +1,79 @@
+#include "sprite.h"
+#include <QtAlgorithms>
+#include <cmath>
+#include <cstring>
+
+// gap between sprites, so that scaled or filtered use of one doesn't
+// bleed into its neighbours
+#define SPRITE_PADDING 1
+
+// tallest first. Sorted stable, so ties keep the order given.
+struct TallerFirst
+{
+    TallerFirst( const QVector<QSize>& s ) : sizes(s) {}
+    bool operator()( int a, int b ) const
+    {
+        return sizes[a].height() > sizes[b].height();
+    }
+    const QVector<QSize>& sizes;
+};
+
+QVector<QPoint> packSprites( const QVector<QSize>& sizes, QSize& sheet )
+{
+    QVector<QPoint> positions( sizes.size() );
+    QVector<int> order( sizes.size() );
+    double area = 0;
+    int widest = 0;
+    for ( int i = 0; i < sizes.size(); ++i )
+    {
+        order[i] = i;
+        area += (double)( sizes[i].width() + SPRITE_PADDING ) * ( sizes[i].height() + SPRITE_PADDING );
+        widest = qMax( widest, sizes[i].width() );
+    }
+    qStableSort( order.begin(), order.end(), TallerFirst( sizes ) );
+    int shelf_width = qMax( widest, (int)ceil( sqrt( area ) ) );
+    int x = 0;
+    int y = 0;
+    int shelf_height = 0;
+    int width = 0;
+    for ( int i = 0; i < order.size(); ++i )
+    {
+        QSize size = sizes[order[i]];
+        if ( x > 0 && x + size.width() > shelf_width )
+        {
+            y += shelf_height + SPRITE_PADDING;
+            x = 0;
+            shelf_height = 0;
+        }
+        positions[order[i]] = QPoint( x, y );
+        width = qMax( width, x + size.width() );
+        shelf_height = qMax( shelf_height, size.height() );
+        x += size.width() + SPRITE_PADDING;
+    }
+    sheet = QSize( width, y + shelf_height );
+    return positions;
+}
+
+QImage drawSprites( const QVector<QImage>& images, const QVector<QPoint>& positions, const QSize& sheet )
+{
+    QImage out( sheet, QImage::Format_ARGB32_Premultiplied );
+    out.fill( 0 );
+    for ( int i = 0; i < images.size(); ++i )
+    {
+        QImage image = images[i];
+        if ( image.isNull() )
+        {
+            continue;
+        }
+        if ( image.format() != QImage::Format_ARGB32_Premultiplied )
+        {
+            image = image.convertToFormat( QImage::Format_ARGB32_Premultiplied );
+        }
+        for ( int y = 0; y < image.height(); ++y )
+        {
+            memcpy( out.scanLine( positions[i].y() + y ) + positions[i].x() * 4,
+                    image.scanLine( y ), image.width() * 4 );
+        }
+    }
+    return out;
+}
@@ -0,0 +1,21 @@
+#ifndef SPRITE_H
+#define SPRITE_H
+
+#include <QImage>
+#include <QPoint>
+#include <QSize>
+#include <QVector>
+
+// Sprite sheets: many small images packed into one, for output of
+// several elements of a page as a single file.
+
+// place rects of the given sizes without overlap on shelves, tallest
+// first, in a sheet roughly as wide as it is tall. Returns the top left
+// of each and sets sheet to the size needed.
+QVector<QPoint> packSprites( const QVector<QSize>& sizes, QSize& sheet );
+
+// transparent ARGB32 premultiplied sheet with every image drawn at its
+// position
+QImage drawSprites( const QVector<QImage>& images, const QVector<QPoint>& positions, const QSize& sheet );
+
+#endif
@@ -0,0 +1,229 @@
+#include "still.h"
+#include "png8.h"
+#include "awebp.h"
+#include "parallel.h"
+#include <QBuffer>
+#include <QIODevice>
+#include <QSet>
+#include <QStringList>
+#include <cstdlib>
+
+// luma step between neighbours which counts as an edge
+#define EDGE_STEP 48
+// edge density above which an image is treated as graphics or text
+// rather than photographic
+#define EDGE_DENSITY_GRAPHICS 0.04
+// quality decrement when squeezing lossy output into a byte budget
+#define QUALITY_STEP 10
+
+bool stillWrite( const QImage& image, const QString& fmt, int quality, const Quantizer* quantizer,
+                 const QuantizeOptions& opts, bool png8_auto, QIODevice* out )
+{
+    QImage indexed;
+    if ( fmt == "png8" )
+    {
+        indexed = png8Image( quantizer, opts, image );
+    }
+    else if ( fmt == "png" && png8_auto )
+    {
+        indexed = exactIndexed( image ); // null when there are too many colors
+    }
+    if ( !indexed.isNull() )
+    {
+        return indexed.save( out, "png", quality );
+    }
+    if ( fmt == "webp" )
+    {
+        // no webp image plugin in Qt 4
+        return webpWriteImage( image, out, quality );
+    }
+    return image.save( out, fmt.toLocal8Bit().constData(), quality );
+}
+
+ImageStats::ImageStats()
+    : colors(0)
+    , alpha(false)
+    , edge_density(0.0)
+{
+}
+
+AutoFormatOptions::AutoFormatOptions()
+    : max_bytes(0)
+    , min_quality(30)
+{
+}
+
+static inline int luma( QRgb c )
+{
+    return ( qRed( c ) * 77 + qGreen( c ) * 150 + qBlue( c ) * 29 ) >> 8;
+}
+
+struct BandStats
+{
+    BandStats() : alpha(false), edges(0) {}
+    QSet<QRgb> colors;
+    bool alpha;
+    int edges;
+};
+
+class StatsTask : public ParallelTask
+{
+public:
+    StatsTask( const QImage& s, int b )
+        : src(s), bands(b), stats(b)
+    {
+    }
+    void run( int band )
+    {
+        int begin, end;
+        bandRange( band, bands, src.height(), begin, end );
+        QSet<QRgb>& set = stats[band].colors;
+        bool has_alpha = false;
+        int edge_count = 0;
+        int width = src.width();
+        for ( int y = begin; y < end; ++y )
+        {
+            const QRgb* line = (const QRgb*)src.scanLine( y );
+            const QRgb* above = y > 0 ? (const QRgb*)src.scanLine( y - 1 ) : 0;
+            QRgb last = line[0] ^ 1; // anything but line[0]
+            int last_luma = luma( line[0] );
+            for ( int x = 0; x < width; ++x )
+            {
+                QRgb c = line[x];
+                if ( c == last )
+                {
+                    // runs are common in rendered pages, and a run has
+                    // no edge to its left
+                    if ( above && c != above[x] && abs( luma( c ) - luma( above[x] ) ) > EDGE_STEP )
+                    {
+                        ++edge_count;
+                    }
+                    continue;
+                }
+                if ( set.size() <= 256 )
+                {
+                    set.insert( c );
+                }
+                has_alpha |= qAlpha( c ) != 255;
+                int l = luma( c );
+                if ( ( x > 0 && abs( l - last_luma ) > EDGE_STEP )
+                     || ( above && abs( l - luma( above[x] ) ) > EDGE_STEP ) )
+                {
+                    ++edge_count;
+                }
+                last = c;
+                last_luma = l;
+            }
+        }
+        stats[band].alpha = has_alpha;
+        stats[band].edges = edge_count;
+    }
+    const QImage& src;
+    int bands;
+    QVector<BandStats> stats;
+};
+
+ImageStats imageStats( const QImage& image )
+{
+    ImageStats stats;
+    if ( image.isNull() )
+    {
+        return stats;
+    }
+    QImage src = image;
+    if ( src.format() != QImage::Format_ARGB32 && src.format() != QImage::Format_ARGB32_Premultiplied
+         && src.format() != QImage::Format_RGB32 )
+    {
+        src = src.convertToFormat( QImage::Format_ARGB32_Premultiplied );
+    }
+    int bands = bandCount( src.height() );
+    StatsTask task( src, bands );
+    parallelRun( task, bands );
+
+    QSet<QRgb> all;
+    double edges = 0;
+    for ( int band = 0; band < bands; ++band )
+    {
+        if ( all.size() <= 256 )
+        {
+            all.unite( task.stats[band].colors );
+        }
+        if ( task.stats[band].alpha && src.format() != QImage::Format_RGB32 )
+        {
+            stats.alpha = true;
+        }
+        edges += task.stats[band].edges;
+    }
+    stats.colors = qMin( all.size(), 257 );
+    stats.edge_density = edges / ( (double)src.width() * src.height() );
+    return stats;
+}
+
+// formats to try, best guess first
+static QStringList autoCandidates( const ImageStats& stats )
+{
+    QStringList formats;
+    if ( stats.colors <= 256 )
+    {
+        formats << "png8"; // lossless and usually smallest
+    }
+    bool graphics = stats.edge_density > EDGE_DENSITY_GRAPHICS;
+    if ( stats.alpha )
+    {
+        // jpg can't keep alpha
+        formats << ( graphics ? "png" : "webp" ) << ( graphics ? "webp" : "png" );
+    }
+    else if ( graphics )
+    {
+        formats << "png" << "webp" << "jpg";
+    }
+    else
+    {
+        formats << "jpg" << "webp" << "png";
+    }
+    return formats;
+}
+
+static bool isLossy( const QString& fmt )
+{
+    return fmt == "jpg" || fmt == "webp";
+}
+
+bool autoWrite( const QImage& image, int quality, const Quantizer* quantizer, const QuantizeOptions& opts,
+                const AutoFormatOptions& auto_opts, QByteArray& encoded, QString& fmt )
+{
+    QStringList formats = autoCandidates( imageStats( image ) );
+    int tries = auto_opts.max_bytes > 0 ? formats.size() : 1;
+    bool found = false;
+    for ( int i = 0; i < tries; ++i )
+    {
+        int q = quality;
+        while ( true )
+        {
+            QByteArray data;
+            QBuffer buffer( &data );
+            buffer.open( QIODevice::WriteOnly );
+            if ( stillWrite( image, formats[i], q, quantizer, opts, false, &buffer ) )
+            {
+                if ( !found || data.size() < encoded.size() )
+                {
+                    encoded = data;
+                    fmt = formats[i];
+                    found = true;
+                }
+                if ( auto_opts.max_bytes <= 0 || data.size() <= auto_opts.max_bytes )
+                {
+                    encoded = data;
+                    fmt = formats[i];
+                    return true;
+                }
+            }
+            if ( !isLossy( formats[i] ) || q <= auto_opts.min_quality )
+            {
+                break;
+            }
+            q = qMax( q - QUALITY_STEP, auto_opts.min_quality );
+        }
+    }
+    return found; // over budget, smallest of what was tried
+}
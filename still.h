@@ -0,0 +1,43 @@
+#ifndef STILL_H
+#define STILL_H
+
+#include <QImage>
+#include <QString>
+#include <QByteArray>
+#include "quant.h"
+
+class QIODevice;
+
+// Single image output: encoding by format name, and picking a format
+// from the image's content for format=auto.
+
+// encode image as fmt (png, png8, jpg, webp or anything Qt can write).
+// png8_auto turns png into png8 when that loses nothing.
+bool stillWrite( const QImage& image, const QString& fmt, int quality, const Quantizer* quantizer,
+                 const QuantizeOptions& opts, bool png8_auto, QIODevice* out );
+
+struct ImageStats
+{
+    ImageStats();
+    int colors;          // distinct colors, counted up to 257
+    bool alpha;          // any pixel not fully opaque
+    double edge_density; // fraction of pixels with a sharp step to the left or above
+};
+
+// one band parallel pass over image
+ImageStats imageStats( const QImage& image );
+
+struct AutoFormatOptions
+{
+    AutoFormatOptions();
+    int max_bytes;   // byte budget, 0 takes the first choice as is
+    int min_quality; // lossy quality may drop this far to meet max_bytes
+};
+
+// encode image in the format its stats suggest. Given a byte budget,
+// later choices and lower qualities are tried until one fits, else the
+// smallest result wins. fmt is set to the format used.
+bool autoWrite( const QImage& image, int quality, const Quantizer* quantizer, const QuantizeOptions& opts,
+                const AutoFormatOptions& auto_opts, QByteArray& encoded, QString& fmt );
+
+#endif
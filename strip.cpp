@@ -0,0 +1,247 @@
+#include "strip.h"
+#include "pngchunk.h"
+#include <QIODevice>
+#include <QByteArray>
+#include <zlib.h>
+#include <cstdio>
+#include <csetjmp>
+extern "C"
+{
+#include <jpeglib.h>
+#include <jerror.h>
+}
+
+// IDAT chunks are cut at this size
+#define PNG_CHUNK_BYTES 65536
+#define JPEG_BUFFER_BYTES 65536
+
+class PngStripWriter : public StripWriter
+{
+public:
+    PngStripWriter( QIODevice* o, int quality )
+        : out(o), level(pngLevel( quality )), alpha(false), started(false)
+    {
+    }
+    ~PngStripWriter()
+    {
+        if ( started )
+        {
+            deflateEnd( &stream );
+        }
+    }
+    bool begin( const QSize& size, bool a )
+    {
+        alpha = a;
+        bpp = alpha ? 4 : 3;
+        stride = size.width() * bpp;
+        prev = QByteArray( stride, 0 );
+        cur = QByteArray( stride, 0 );
+        stream.zalloc = Z_NULL;
+        stream.zfree = Z_NULL;
+        stream.opaque = Z_NULL;
+        if ( deflateInit( &stream, level ) != Z_OK )
+        {
+            return false;
+        }
+        started = true;
+        return out->write( PNG_SIGNATURE, 8 ) == 8
+            && pngWriteChunk( out, "IHDR", pngHeader( size, alpha ) );
+    }
+    bool writeStrip( const QImage& strip )
+    {
+        QImage argb = strip.convertToFormat( QImage::Format_ARGB32 );
+        QByteArray filtered;
+        filtered.reserve( ( stride + 1 ) * argb.height() );
+        for ( int y = 0; y < argb.height(); ++y )
+        {
+            pngRowBytes( argb, y, alpha, (uchar*)cur.data() );
+            pngFilterRow( (const uchar*)cur.constData(), (const uchar*)prev.constData(), stride, bpp, filtered );
+            qSwap( prev, cur );
+        }
+        return compress( filtered, Z_NO_FLUSH );
+    }
+    bool finish()
+    {
+        return compress( QByteArray(), Z_FINISH )
+            && flushChunks( 0 )
+            && pngWriteChunk( out, "IEND", QByteArray() );
+    }
+private:
+    bool compress( const QByteArray& data, int flush )
+    {
+        stream.next_in = (Bytef*)data.constData();
+        stream.avail_in = data.size();
+        char buffer[16384];
+        int ret;
+        do
+        {
+            stream.next_out = (Bytef*)buffer;
+            stream.avail_out = sizeof(buffer);
+            ret = deflate( &stream, flush );
+            if ( ret == Z_STREAM_ERROR )
+            {
+                return false;
+            }
+            pending.append( buffer, sizeof(buffer) - stream.avail_out );
+        } while ( stream.avail_out == 0 || ( flush == Z_FINISH && ret != Z_STREAM_END ) );
+        return flushChunks( PNG_CHUNK_BYTES );
+    }
+    // write out pending compressed data in chunks of at least min bytes
+    bool flushChunks( int min )
+    {
+        while ( pending.size() && pending.size() >= min )
+        {
+            int size = min ? min : pending.size();
+            if ( !pngWriteChunk( out, "IDAT", pending.left( size ) ) )
+            {
+                return false;
+            }
+            pending = pending.mid( size );
+        }
+        return true;
+    }
+    QIODevice* out;
+    int level;
+    bool alpha;
+    bool started;
+    int bpp;
+    int stride;
+    QByteArray prev;
+    QByteArray cur;
+    QByteArray pending;
+    z_stream stream;
+};
+
+// libjpeg reports errors through a callback which must not return
+struct JpegError
+{
+    jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+static void jpegErrorExit( j_common_ptr cinfo )
+{
+    JpegError* err = (JpegError*)cinfo->err;
+    longjmp( err->jump, 1 );
+}
+
+// destination manager writing to a QIODevice
+struct JpegDestination
+{
+    jpeg_destination_mgr mgr;
+    QIODevice* out;
+    JOCTET buffer[JPEG_BUFFER_BYTES];
+};
+
+static void jpegInitDestination( j_compress_ptr cinfo )
+{
+    JpegDestination* dest = (JpegDestination*)cinfo->dest;
+    dest->mgr.next_output_byte = dest->buffer;
+    dest->mgr.free_in_buffer = JPEG_BUFFER_BYTES;
+}
+
+static boolean jpegEmptyBuffer( j_compress_ptr cinfo )
+{
+    JpegDestination* dest = (JpegDestination*)cinfo->dest;
+    if ( dest->out->write( (const char*)dest->buffer, JPEG_BUFFER_BYTES ) != JPEG_BUFFER_BYTES )
+    {
+        ERREXIT( cinfo, JERR_FILE_WRITE );
+    }
+    dest->mgr.next_output_byte = dest->buffer;
+    dest->mgr.free_in_buffer = JPEG_BUFFER_BYTES;
+    return TRUE;
+}
+
+static void jpegTermDestination( j_compress_ptr cinfo )
+{
+    JpegDestination* dest = (JpegDestination*)cinfo->dest;
+    qint64 n = JPEG_BUFFER_BYTES - dest->mgr.free_in_buffer;
+    if ( dest->out->write( (const char*)dest->buffer, n ) != n )
+    {
+        ERREXIT( cinfo, JERR_FILE_WRITE );
+    }
+}
+
+class JpegStripWriter : public StripWriter
+{
+public:
+    JpegStripWriter( QIODevice* o, int q )
+        : quality(q), started(false)
+    {
+        cinfo.err = jpeg_std_error( &err.mgr );
+        err.mgr.error_exit = jpegErrorExit;
+        jpeg_create_compress( &cinfo );
+        dest.out = o;
+        dest.mgr.init_destination = jpegInitDestination;
+        dest.mgr.empty_output_buffer = jpegEmptyBuffer;
+        dest.mgr.term_destination = jpegTermDestination;
+        cinfo.dest = &dest.mgr;
+    }
+    ~JpegStripWriter()
+    {
+        jpeg_destroy_compress( &cinfo );
+    }
+    bool begin( const QSize& size, bool )
+    {
+        if ( setjmp( err.jump ) )
+        {
+            return false;
+        }
+        cinfo.image_width = size.width();
+        cinfo.image_height = size.height();
+        cinfo.input_components = 3;
+        cinfo.in_color_space = JCS_RGB;
+        jpeg_set_defaults( &cinfo );
+        jpeg_set_quality( &cinfo, quality < 0 ? 75 : qMin( quality, 100 ), TRUE );
+        jpeg_start_compress( &cinfo, TRUE );
+        started = true;
+        row = QByteArray( size.width() * 3, 0 );
+        return true;
+    }
+    bool writeStrip( const QImage& strip )
+    {
+        if ( !started || setjmp( err.jump ) )
+        {
+            return false;
+        }
+        // jpg has no alpha, premultiplied pixels are as seen over black
+        QImage rgb = strip.convertToFormat( QImage::Format_RGB32 );
+        JSAMPROW rows[1] = { (JSAMPROW)row.data() };
+        for ( int y = 0; y < rgb.height(); ++y )
+        {
+            pngRowBytes( rgb, y, false, (uchar*)row.data() );
+            jpeg_write_scanlines( &cinfo, rows, 1 );
+        }
+        return true;
+    }
+    bool finish()
+    {
+        if ( !started || setjmp( err.jump ) )
+        {
+            return false;
+        }
+        jpeg_finish_compress( &cinfo );
+        started = false;
+        return true;
+    }
+private:
+    int quality;
+    bool started;
+    QByteArray row;
+    jpeg_compress_struct cinfo;
+    JpegError err;
+    JpegDestination dest;
+};
+
+StripWriter* makeStripWriter( const QString& fmt, QIODevice* out, int quality )
+{
+    if ( fmt == "png" )
+    {
+        return new PngStripWriter( out, quality );
+    }
+    if ( fmt == "jpg" || fmt == "jpeg" )
+    {
+        return new JpegStripWriter( out, quality );
+    }
+    return 0;
+}
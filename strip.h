@@ -0,0 +1,25 @@
+#ifndef STRIP_H
+#define STRIP_H
+
+#include <QImage>
+#include <QString>
+
+class QIODevice;
+
+// Encoders fed a horizontal strip of the image at a time, top to
+// bottom, so that a tall page never has to be held in memory whole.
+class StripWriter
+{
+public:
+    virtual ~StripWriter() {}
+    // size of the whole image. Without alpha the output is opaque.
+    virtual bool begin( const QSize& size, bool alpha ) = 0;
+    // every row of strip, which is as wide as the image
+    virtual bool writeStrip( const QImage& strip ) = 0;
+    virtual bool finish() = 0;
+};
+
+// png or jpg writer onto out, 0 for formats which can't be streamed
+StripWriter* makeStripWriter( const QString& fmt, QIODevice* out, int quality );
+
+#endif
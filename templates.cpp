@@ -0,0 +1,76 @@
+#include "templates.h"
+
+TemplateRegistry::Template::Template()
+    : page(0)
+{
+}
+
+TemplateRegistry::TemplateRegistry()
+    : capacity(0)
+{
+}
+
+TemplateRegistry::~TemplateRegistry()
+{
+    for ( QMap<QString, Template>::iterator it = templates.begin(); it != templates.end(); ++it )
+    {
+        delete it.value().page;
+    }
+}
+
+void TemplateRegistry::setCapacity( int t )
+{
+    capacity = t;
+}
+
+bool TemplateRegistry::full() const
+{
+    return capacity > 0 && templates.size() >= capacity;
+}
+
+void TemplateRegistry::put( const QString& id, WebPage* page, const Settings& settings, const QString& hook )
+{
+    remove( id );
+    Template t;
+    t.page = page;
+    t.settings = settings;
+    t.hook = hook;
+    templates.insert( id, t );
+}
+
+bool TemplateRegistry::remove( const QString& id )
+{
+    QMap<QString, Template>::iterator it = templates.find( id );
+    if ( it == templates.end() )
+    {
+        return false;
+    }
+    delete it.value().page;
+    templates.erase( it );
+    return true;
+}
+
+bool TemplateRegistry::contains( const QString& id ) const
+{
+    return templates.contains( id );
+}
+
+WebPage* TemplateRegistry::page( const QString& id ) const
+{
+    return templates.value( id ).page;
+}
+
+Settings TemplateRegistry::settings( const QString& id ) const
+{
+    return templates.value( id ).settings;
+}
+
+QString TemplateRegistry::hook( const QString& id ) const
+{
+    return templates.value( id ).hook;
+}
+
+int TemplateRegistry::size() const
+{
+    return templates.size();
+}
@@ -0,0 +1,42 @@
+#ifndef TEMPLATES_H
+#define TEMPLATES_H
+
+#include <QMap>
+#include <QString>
+#include "engine.h"
+
+// Pages loaded once and kept, so that requests which only differ in a
+// few fields skip sending, parsing and laying out the rest of the
+// document. A template's page is handed to an Engine for each render
+// and changed in place by the render's parameters.
+class TemplateRegistry
+{
+public:
+    TemplateRegistry();
+    ~TemplateRegistry();
+
+    void setCapacity( int templates ); // 0 for no limit
+    bool full() const;
+
+    // takes the page, replacing and deleting any under the same id
+    void put( const QString& id, WebPage* page, const Settings& settings, const QString& hook );
+    bool remove( const QString& id );
+    bool contains( const QString& id ) const;
+
+    WebPage* page( const QString& id ) const;
+    Settings settings( const QString& id ) const; // as loaded
+    QString hook( const QString& id ) const;      // global js function taking the parameters
+    int size() const;
+private:
+    struct Template
+    {
+        Template();
+        WebPage* page;
+        Settings settings;
+        QString hook;
+    };
+    QMap<QString, Template> templates;
+    int capacity;
+};
+
+#endif
@@ -2,16 +2,29 @@
 
 VERBOSITY=0
 PORT=19090
+OTHER_PORT=19091
 
 
 HELLO_FILE=hello.png
 ANIM_FILE=hello.gif
+BODY_FILE=body.txt
+SOCKET_FILE=ichabod_test.sock
 ichabod_pid=-1
+other_pid=-1
+
+# gradients dither, which gives the gif options something to do
+GRADIENT_HTML="<html><body style='margin: 0; background: -webkit-linear-gradient(left, red, yellow, blue);'><div id='word' style='font-size: 30px;'>hello</div></body></html>"
+ANIM_JS="(function(){ichabod.setTransparent(0); ichabod.snapshotPage(); document.getElementById('word').innerHTML='world'; ichabod.snapshotPage(); ichabod.saveToOutput();})();"
+STILL_JS="js=(function(){ichabod.snapshotPage(250); ichabod.saveToOutput();})();"
+SOLID_HTML="html=<html><body style='background-color: red;'></body></html>"
 
 function cleanup()
 {
-    rm -f $HELLO_FILE
+    rm -f $HELLO_FILE ${HELLO_FILE%.png}_*
     rm -f $ANIM_FILE
+    rm -f $BODY_FILE $BODY_FILE.gz $BODY_FILE.zst
+    rm -f $SOCKET_FILE
+    stop_other
     while sleep 1
           echo Killing ichabod pid $ichabod_pid on port $PORT
           kill -0 $ichabod_pid >/dev/null 2>&1
@@ -20,6 +33,24 @@ function cleanup()
     done
 }
 
+# another ichabod on OTHER_PORT, for options only the command line has
+function start_other()
+{
+    ./ichabod --verbosity=$VERBOSITY --port=$OTHER_PORT "$@" &
+    other_pid=$!
+    sleep 1
+}
+
+function stop_other()
+{
+    if [ $other_pid != -1 ]
+    then
+        kill $other_pid > /dev/null 2>&1
+        wait $other_pid > /dev/null 2>&1 || true
+        other_pid=-1
+    fi
+}
+
 function die()
 {
     echo -e "\e[31mERROR: $1\e[0m"
@@ -34,11 +65,97 @@ function error_handler() {
  
 trap error_handler EXIT
 
-./ichabod --verbosity=$VERBOSITY --port=$PORT &
+./ichabod --verbosity=$VERBOSITY --port=$PORT --socket=$SOCKET_FILE &
 ichabod_pid=$!
 sleep 1
 
 
+# render the two frame gradient animation to $ANIM_FILE with the given
+# request variables, which come first and so win, on port $2 if given
+function render_anim()
+{
+    curl -s -X POST http://localhost:${2:-$PORT} --data "$1&width=100&height=100&output=$ANIM_FILE" --data-urlencode "html=$GRADIENT_HTML" --data-urlencode "js=$ANIM_JS"
+}
+
+# format and size of image $1 from its header, e.g. "png 100x100", with
+# the number of frames after them for animated apng and webp
+function image_info()
+{
+    python3 - $1 <<'EOF'
+import struct, sys
+d = open(sys.argv[1], 'rb').read()
+info = ['unknown', 0, 0]
+if d[:8] == b'\x89PNG\r\n\x1a\n':
+    w, h = struct.unpack('>II', d[16:24])
+    info = ['png8' if d[25] == 3 else 'png', w, h]
+    actl = d.find(b'acTL', 0, d.find(b'IDAT'))
+    if actl > 0:
+        info = ['apng', w, h, struct.unpack('>I', d[actl + 4:actl + 8])[0]]
+elif d[:6] == b'GIF89a':
+    info = ['gif'] + list(struct.unpack('<HH', d[6:10]))
+elif d[:2] == b'\xff\xd8':
+    p = 2
+    while p + 9 < len(d):
+        marker, size = d[p + 1], struct.unpack('>H', d[p + 2:p + 4])[0]
+        if marker in (0xc0, 0xc1, 0xc2):
+            h, w = struct.unpack('>HH', d[p + 5:p + 9])
+            info = ['jpg', w, h]
+            break
+        p += 2 + size
+elif d[:4] == b'RIFF' and d[8:12] == b'WEBP':
+    chunk = d[12:16]
+    if chunk == b'VP8X':
+        w = 1 + int.from_bytes(d[24:27], 'little')
+        h = 1 + int.from_bytes(d[27:30], 'little')
+        info = ['webp', w, h]
+        if d[20] & 2:
+            info.append(d.count(b'ANMF'))
+    elif chunk == b'VP8 ':
+        w, h = struct.unpack('<HH', d[26:30])
+        info = ['webp', w & 0x3fff, h & 0x3fff]
+    elif chunk == b'VP8L':
+        bits = int.from_bytes(d[21:25], 'little')
+        info = ['webp', (bits & 0x3fff) + 1, ((bits >> 14) & 0x3fff) + 1]
+print(' '.join([info[0], '%dx%d' % (info[1], info[2])] + [str(n) for n in info[3:]]))
+EOF
+}
+
+# delays of the frames of animated apng or webp $1, in milliseconds
+function anim_delays()
+{
+    python3 - $1 <<'EOF'
+import struct, sys
+d = open(sys.argv[1], 'rb').read()
+delays = []
+if d[:4] == b'RIFF':
+    at = d.find(b'ANMF')
+    while at > 0:
+        delays.append(int.from_bytes(d[at + 20:at + 23], 'little'))
+        at = d.find(b'ANMF', at + 8 + struct.unpack('<I', d[at + 4:at + 8])[0])
+else:
+    at = d.find(b'fcTL')
+    while at > 0:
+        num, den = struct.unpack('>HH', d[at + 24:at + 28])
+        delays.append(num * 1000 // (den or 100))
+        at = d.find(b'fcTL', at + 8 + struct.unpack('>I', d[at - 4:at])[0])
+print(' '.join(str(n) for n in delays))
+EOF
+}
+
+# check image $1 is $2, as image_info prints it
+function check_image()
+{
+    test -f $1 || die "Result file missing: [$1]"
+    test "`image_info $1`" == "$2"  || die "Unexpected image [$1]: `image_info $1`, expected: $2"
+}
+
+# check the first line of --gif-check for gif $1 is $2, e.g. "100x100 frames: 2"
+function check_gif()
+{
+    GIF_CHECK=$(./ichabod --gif-check=$1) || die "Invalid gif: [$1] $GIF_CHECK"
+    test "`echo "$GIF_CHECK" | head -1`" == "$1: $2"  || die "Unexpected gif: $GIF_CHECK, expected: $2"
+}
+
 function test_simple()
 {
     # simple image
@@ -51,6 +168,614 @@ function test_simple()
     test `echo $ANIM | jq '.conversion'` == "true"  || die "Conversion failed: $ANIM"
     test `echo $ANIM | jq '.result'` == "42"  || die "Invalid result: $ANIM"
     ls $ANIM_FILE > /dev/null || die "Animated result file missing: [$ANIM_FILE]"
+    ./ichabod --gif-check=$ANIM_FILE > /dev/null || die "Animated result file invalid: [$ANIM_FILE]"
+    # snapshotPage delays are milliseconds, gif stores centiseconds
+    DELAYS=$(./ichabod --gif-check=$ANIM_FILE | grep '^delays:')
+    test "$DELAYS" == "delays: 10 10" || die "Unexpected gif delays: $DELAYS"
+    return 0
+}
+
+function test_timeline()
+{
+    # 30fps for 100ms on the virtual clock is 3 frames of 33-34ms
+    COUNTER="<html><body><div id='count'>0</div><script>var n = 0; setInterval(function(){ n += 1; document.getElementById('count').innerHTML = n; }, 10);</script></body></html>"
+    TIMELINE=$(curl -s -X POST http://localhost:$PORT --data-urlencode "html=$COUNTER" --data "width=100&height=100&format=gif&virtual_time=1&output=$ANIM_FILE&js=(function(){ichabod.setTransparent(0); ichabod.captureTimeline(30, 100); ichabod.saveToOutput();})();")
+    test `echo $TIMELINE | jq '.conversion'` == "true"  || die "Timeline conversion failed: $TIMELINE"
+    DELAYS=$(./ichabod --gif-check=$ANIM_FILE | grep '^delays:')
+    test "$DELAYS" == "delays: 3 3 3" || die "Unexpected timeline gif delays: $DELAYS"
+
+    # the virtual clock makes captures the same on every run
+    TIMELINE=$(curl -s -X POST http://localhost:$PORT --data-urlencode "html=$COUNTER" --data "width=100&height=100&format=apng&virtual_time=1&output=$HELLO_FILE&js=(function(){ichabod.captureTimeline(30, 100); ichabod.saveToOutput();})();")
+    test `echo $TIMELINE | jq '.conversion'` == "true"  || die "Timeline conversion failed: $TIMELINE"
+    check_image $HELLO_FILE "apng 100x100 3"
+    test "`anim_delays $HELLO_FILE`" == "33 33 34"  || die "Unexpected timeline apng delays: `anim_delays $HELLO_FILE`"
+    cp $HELLO_FILE $ANIM_FILE
+    TIMELINE=$(curl -s -X POST http://localhost:$PORT --data-urlencode "html=$COUNTER" --data "width=100&height=100&format=apng&virtual_time=1&output=$HELLO_FILE&js=(function(){ichabod.captureTimeline(30, 100); ichabod.saveToOutput();})();")
+    cmp -s $HELLO_FILE $ANIM_FILE || die "Timeline captures differ between runs"
+    return 0
+}
+
+function test_templates()
+{
+    WORD_PAGE="<html><body><div id='word'>hello</div><script>var app = { render: function(p) { document.getElementById('word').innerHTML = p.word; } };</script></body></html>"
+    BAD_HOOK=$(curl -s -X PUT http://localhost:$PORT/templates/word --data-urlencode "html=$WORD_PAGE" --data-urlencode "hook=app.render(1);alert" --data "width=100&height=100")
+    echo $BAD_HOOK | jq -r '.errors[0]' | grep -q "^hook must be" || die "Bad hook accepted: $BAD_HOOK"
+
+    PUT=$(curl -s -X PUT http://localhost:$PORT/templates/word --data-urlencode "html=$WORD_PAGE" --data "width=100&height=100&hook=app.render")
+    test `echo $PUT | jq '.conversion'` == "true"  || die "Template failed to load: $PUT"
+    RENDER=$(curl -s -X POST http://localhost:$PORT/render/word --data-urlencode 'params={"word": "world"}' --data "format=png&output=$HELLO_FILE")
+    test `echo $RENDER | jq '.conversion'` == "true"  || die "Template render failed: $RENDER"
+    check_image $HELLO_FILE "png 100x100"
+    # the hook gets params and runs before js
+    RENDER=$(curl -s -X POST http://localhost:$PORT/render/word --data-urlencode 'params={"word": "world"}' --data "format=png&output=$HELLO_FILE&js=(function(){ichabod.snapshotPage(); ichabod.saveToOutput(); return JSON.stringify(document.getElementById('word').innerHTML);})();")
+    test `echo $RENDER | jq -r '.result'` == "world"  || die "Template hook didn't run: $RENDER"
+    UNKNOWN=$(curl -s -X POST http://localhost:$PORT/render/nosuch --data "format=png&output=$HELLO_FILE")
+    test "`echo $UNKNOWN | jq -r '.errors[0]'`" == "Unknown template:nosuch"  || die "Unknown template rendered: $UNKNOWN"
+    DELETE=$(curl -s -X DELETE http://localhost:$PORT/templates/word)
+    test `echo $DELETE | jq -r '.template'` == "word"  || die "Template delete failed: $DELETE"
+
+    start_other --max-templates=1
+    PUT=$(curl -s -X PUT http://localhost:$OTHER_PORT/templates/one --data-urlencode "html=$WORD_PAGE" --data "width=100&height=100&hook=app.render")
+    FULL=$(curl -s -X PUT http://localhost:$OTHER_PORT/templates/two --data-urlencode "html=$WORD_PAGE" --data "width=100&height=100&hook=app.render")
+    stop_other
+    test `echo $PUT | jq '.conversion'` == "true"  || die "Template failed to load: $PUT"
+    test "`echo $FULL | jq -r '.errors[0]'`" == "Too many templates, at most 1"  || die "Template over --max-templates kept: $FULL"
+    return 0
+}
+
+function test_compressed()
+{
+    echo -n "html=<html><body><div>compressed</div></body></html>&width=100&height=100&format=png&output=$HELLO_FILE&js=(function(){ichabod.snapshotPage();ichabod.saveToOutput();})();" > $BODY_FILE
+    rm -f $HELLO_FILE
+
+    gzip -c $BODY_FILE > $BODY_FILE.gz
+    GZIP=$(curl -s -X POST http://localhost:$PORT -H 'Content-Encoding: gzip' --data-binary @$BODY_FILE.gz)
+    test `echo $GZIP | jq '.conversion'` == "true"  || die "gzip request failed: $GZIP"
+    ls $HELLO_FILE > /dev/null || die "gzip result file missing: [$HELLO_FILE]"
+    rm -f $HELLO_FILE
+
+    zstd -q -c $BODY_FILE > $BODY_FILE.zst
+    ZSTD=$(curl -s -X POST http://localhost:$PORT -H 'Content-Encoding: zstd' --data-binary @$BODY_FILE.zst)
+    test `echo $ZSTD | jq '.conversion'` == "true"  || die "zstd request failed: $ZSTD"
+    ls $HELLO_FILE > /dev/null || die "zstd result file missing: [$HELLO_FILE]"
+
+    # cut off before the end of the stream
+    head -c $(( $(stat -c %s $BODY_FILE.gz) - 12 )) $BODY_FILE.gz > $BODY_FILE
+    TRUNCATED=$(curl -s -X POST http://localhost:$PORT -H 'Content-Encoding: gzip' --data-binary @$BODY_FILE)
+    test "`echo $TRUNCATED | jq -r '.errors[0]'`" == "Request body is truncated"  || die "Truncated body accepted: $TRUNCATED"
+
+    # 70MB of zeros is well past the default --max-body-bytes of 64MB
+    head -c 70000000 /dev/zero | gzip -c > $BODY_FILE.gz
+    LARGE=$(curl -s -X POST http://localhost:$PORT -H 'Content-Encoding: gzip' --data-binary @$BODY_FILE.gz)
+    echo $LARGE | jq -r '.errors[0]' | grep -q "^Request body is larger than [0-9]* bytes decompressed$" || die "Oversized body accepted: $LARGE"
+
+    # the cap applies to plain bodies too
+    start_other --max-body-bytes=100
+    LARGE=$(render_anim "format=png" $OTHER_PORT)
+    stop_other
+    test "`echo $LARGE | jq -r '.errors[0]'`" == "Request body is larger than 100 bytes"  || die "Body over --max-body-bytes accepted: $LARGE"
+    ./ichabod --max-body-bytes=0 > /dev/null 2>&1 && die "--max-body-bytes of 0 accepted"
+    return 0
+}
+
+function test_socket()
+{
+    python3 - $SOCKET_FILE <<'EOF' || die "Unix socket test failed"
+import array, json, os, socket, struct, sys
+
+PNG = b'\x89PNG\r\n\x1a\n'
+JPG = b'\xff\xd8'
+
+def frame(fields):
+    body = b''
+    for kind, name, value in fields:
+        body += kind.encode() + struct.pack('<B', len(name)) + name.encode()
+        if kind == 'i':
+            body += struct.pack('<q', value)
+        else:
+            value = value if isinstance(value, bytes) else value.encode()
+            body += struct.pack('<I', len(value)) + value
+    return struct.pack('<I', len(body)) + body
+
+NOISE = "<html><body style='margin: 0;'><canvas id='c' width='800' height='800'></canvas><script>var c = document.getElementById('c').getContext('2d'); var d = c.createImageData(800, 800); for (var i = 0; i < d.data.length; i++) d.data[i] = Math.random() * 256; c.putImageData(d, 0, 0);</script></body></html>"
+
+def render(fmt='png', html="<html><body style='background-color: red;'><div>hello</div></body></html>", size=100, **extra):
+    return frame([('b', 'html', html),
+                  ('i', 'width', size), ('i', 'height', size), ('b', 'format', fmt),
+                  ('b', 'js', '(function(){ichabod.snapshotPage();ichabod.saveToOutput();})();')]
+                 + [('i', k, v) for k, v in extra.items()])
+
+def fields(body):
+    out = []
+    while body:
+        kind, n = chr(body[0]), body[1]
+        name, body = body[2:2 + n].decode(), body[2 + n:]
+        if kind == 'i':
+            out.append((name, struct.unpack_from('<q', body)[0]))
+            body = body[8:]
+        else:
+            size = struct.unpack_from('<I', body)[0]
+            out.append((name, body[4:4 + size]))
+            body = body[4 + size:]
+    return out
+
+class Client:
+    def __init__(self):
+        self.sock = socket.socket(socket.AF_UNIX)
+        self.sock.settimeout(60)
+        self.sock.connect(sys.argv[1])
+        self.buf = b''
+        self.fds = [] # received, one for each size field to come
+    def send(self, data):
+        self.sock.sendall(data)
+    def read(self):
+        # the next response as (fields, descriptors), None once closed
+        while len(self.buf) < 4 or len(self.buf) < 4 + struct.unpack_from('<I', self.buf)[0]:
+            try:
+                data, anc, flags, addr = self.sock.recvmsg(1 << 20, socket.CMSG_SPACE(250 * 4))
+            except ConnectionResetError:
+                return None
+            for level, kind, fds in anc:
+                a = array.array('i')
+                a.frombytes(fds[:len(fds) - len(fds) % 4])
+                self.fds += list(a)
+            if not data:
+                return None
+            self.buf += data
+        n = 4 + struct.unpack_from('<I', self.buf)[0]
+        body, self.buf = self.buf[4:n], self.buf[n:]
+        f = fields(body)
+        shared = len([name for name, value in f if name == 'size'])
+        fds, self.fds = self.fds[:shared], self.fds[shared:]
+        return f, fds
+
+def check_image(response, magic, what):
+    assert response, what + ': no response'
+    f = response[0]
+    assert f[0] == ('conversion', 1), what + ': conversion failed %r' % f[:2]
+    assert f[1][0] == 'json' and json.loads(f[1][1])['conversion'], what + ': bad json %r' % f[1][1]
+    assert [name for name, value in f[2:]] == ['path', 'data'], what + ': expected one file %r' % [name for name, value in f]
+    data = f[3][1]
+    assert data.startswith(magic), what + ': wrong format %r' % data[:8]
+    if magic == PNG:
+        assert struct.unpack('>II', data[16:24]) == (100, 100), what + ': not 100x100'
+
+def check_error(response, error, what):
+    assert response, what + ': no response'
+    f = response[0]
+    assert f[0] == ('conversion', 0), what + ': unexpected success'
+    assert json.loads(f[1][1])['errors'][0] == error, what + ': wrong error %r' % f[1][1]
+
+c = Client()
+c.send(render())
+check_image(c.read(), PNG, 'inline png')
+
+# pipelined on one connection, answered in order
+c.send(render('jpg') + render())
+check_image(c.read(), JPG, 'first of two')
+check_image(c.read(), PNG, 'second of two')
+
+# errors are answered and the connection stays usable
+c.send(frame([('i', 'width', 100)]))
+check_error(c.read(), 'Empty document and no URL specified', 'no html')
+c.send(struct.pack('<I', 3) + b'xyz')
+check_error(c.read(), 'Malformed frame', 'malformed')
+c.send(render())
+check_image(c.read(), PNG, 'after errors')
+
+# shm returns a descriptor to read the image from instead of its bytes,
+# passed with the frame it belongs to
+c.send(render(shm=1) + render() + render(shm=1))
+for n in range(3):
+    f, fds = c.read()
+    what = 'shared %d' % n
+    assert f[0] == ('conversion', 1), what + ': conversion failed %r' % f[:2]
+    if n == 1:
+        assert [name for name, value in f[2:]] == ['path', 'data'] and not fds, what + ': not inline'
+        continue
+    assert [name for name, value in f[2:]] == ['path', 'size'], what + ': expected a path and size %r' % [name for name, value in f]
+    assert len(fds) == 1, what + ': expected one descriptor, got %d' % len(fds)
+    assert os.fstat(fds[0]).st_size == f[3][1], what + ': size differs from the descriptor'
+    data = os.pread(fds[0], f[3][1], 0)
+    assert data.startswith(PNG) and struct.unpack('>II', data[16:24]) == (100, 100), what + ': not a 100x100 png'
+    os.close(fds[0])
+
+# behind a response too large for the socket's buffer, the responses
+# after it queue up, each with its own descriptors
+c.send(render(html=NOISE, size=800) + render(shm=1) + render(shm=1))
+f, fds = c.read()
+assert f[0] == ('conversion', 1) and len(f[3][1]) > 500000, 'noise: expected a large png'
+for n in range(2):
+    f, fds = c.read()
+    assert f[0] == ('conversion', 1) and len(fds) == 1, 'queued shared %d: expected one descriptor, got %d' % (n, len(fds))
+    data = os.pread(fds[0], f[3][1], 0)
+    assert data.startswith(PNG) and struct.unpack('>II', data[16:24]) == (100, 100), 'queued shared %d: not a 100x100 png' % n
+    os.close(fds[0])
+assert not c.fds, 'descriptors left over'
+
+# a header claiming more than FRAME_MAX_BYTES closes the connection
+c = Client()
+c.send(struct.pack('<I', 0xffffffff))
+assert c.read() is None, 'oversized header answered'
+
+# a client which shuts down its side still gets its answers, for the
+# whole frames it sent
+c = Client()
+c.send(render() + render('jpg') + render()[:-5])
+c.sock.shutdown(socket.SHUT_WR)
+check_image(c.read(), PNG, 'half closed first')
+check_image(c.read(), JPG, 'half closed second')
+assert c.read() is None, 'half closed: cut short frame answered'
+
+# a truncated header or frame is never answered
+for partial in (b'\x10\x00', render()[:-5]):
+    c = Client()
+    c.send(partial)
+    c.sock.shutdown(socket.SHUT_WR)
+    assert c.read() is None, 'truncated frame answered'
+EOF
+    return 0
+}
+
+function test_quantize_threads()
+{
+    for THREADS in 1 3
+    do
+        start_other --quantize-threads=$THREADS
+        QUANTIZED=$(render_anim "format=gif&quantize=MEDIANCUT_FLOYD" $OTHER_PORT)
+        stop_other
+        test `echo $QUANTIZED | jq '.conversion'` == "true"  || die "Conversion with $THREADS quantize threads failed: $QUANTIZED"
+        check_gif $ANIM_FILE "100x100 frames: 2"
+    done
+    ./ichabod --quantize-threads=x > /dev/null 2>&1 && die "Bad --quantize-threads accepted"
+    return 0
+}
+
+function test_quantizers()
+{
+    for METHOD in THRESHOLD DIFFUSE ORDERED MEDIANCUT WU OCTREE MEDIANCUT_FLOYD WU_ORDERED OCTREE_BLUENOISE wu_floyd
+    do
+        QUANTIZED=$(render_anim "format=gif&quantize=$METHOD")
+        test `echo $QUANTIZED | jq '.conversion'` == "true"  || die "Conversion with $METHOD failed: $QUANTIZED"
+        check_gif $ANIM_FILE "100x100 frames: 2"
+    done
+    QUANTIZED=$(render_anim "format=gif&quantize=WU_FLOYD&quantize_kmeans=3")
+    test `echo $QUANTIZED | jq '.conversion'` == "true"  || die "Conversion with k-means passes failed: $QUANTIZED"
+    check_gif $ANIM_FILE "100x100 frames: 2"
+
+    UNKNOWN=$(render_anim "format=gif&quantize=NOSUCH")
+    test "`echo $UNKNOWN | jq -r '.errors[0]'`" == "Unknown quantize method:NOSUCH"  || die "Unknown quantize method accepted: $UNKNOWN"
+    ./ichabod --quantize=NOSUCH > /dev/null 2>&1 && die "Unknown --quantize accepted"
+    return 0
+}
+
+# rectangle of frame $2 of gif $1, as --gif-check prints it
+function gif_frame()
+{
+    ./ichabod --gif-check=$1 | grep "^frame $2:" | cut -d' ' -f3
+}
+
+function test_gif_optimize()
+{
+    FULL=$(render_anim "format=gif")
+    test `echo $FULL | jq '.conversion'` == "true"  || die "Conversion failed: $FULL"
+    check_gif $ANIM_FILE "100x100 frames: 2"
+    test "`gif_frame $ANIM_FILE 1`" == "100x100+0+0"  || die "Unexpected second frame without gif_optimize: `gif_frame $ANIM_FILE 1`"
+
+    # only the word changes, so the second frame is a smaller rectangle
+    OPTIMIZED=$(render_anim "format=gif&gif_optimize=1")
+    test `echo $OPTIMIZED | jq '.conversion'` == "true"  || die "Optimized conversion failed: $OPTIMIZED"
+    check_gif $ANIM_FILE "100x100 frames: 2"
+    test "`gif_frame $ANIM_FILE 0`" == "100x100+0+0"  || die "Unexpected first frame with gif_optimize: `gif_frame $ANIM_FILE 0`"
+    test "`gif_frame $ANIM_FILE 1`" != "100x100+0+0"  || die "Second frame not optimized"
+    return 0
+}
+
+function test_gif_palette()
+{
+    SAMPLED=$(render_anim "format=gif&gif_palette_sample=4")
+    test `echo $SAMPLED | jq '.conversion'` == "true"  || die "Conversion with gif_palette_sample failed: $SAMPLED"
+    check_gif $ANIM_FILE "100x100 frames: 2"
+
+    SHARED=$(render_anim "format=gif")
+    test `echo $SHARED | jq '.conversion'` == "true"  || die "Conversion failed: $SHARED"
+    ./ichabod --gif-check=$ANIM_FILE | grep -q "local palette" && die "Local palette without gif_local_palette_threshold"
+
+    # no 256 color palette matches a gradient this closely
+    LOCAL=$(render_anim "format=gif&gif_local_palette_threshold=0.001")
+    test `echo $LOCAL | jq '.conversion'` == "true"  || die "Conversion with local palettes failed: $LOCAL"
+    check_gif $ANIM_FILE "100x100 frames: 2"
+    ./ichabod --gif-check=$ANIM_FILE | grep -q "local palette" || die "No local palette with gif_local_palette_threshold"
+    return 0
+}
+
+function test_gif_encoder()
+{
+    STILL=$(render_anim "format=gif&js=(function(){ichabod.snapshotPage(250); ichabod.saveToOutput();})();")
+    test `echo $STILL | jq '.conversion'` == "true"  || die "Single frame gif failed: $STILL"
+    check_image $ANIM_FILE "gif 100x100"
+    check_gif $ANIM_FILE "100x100 frames: 1"
+    test "`./ichabod --gif-check=$ANIM_FILE | grep '^delays:'`" == "delays: 25"  || die "Unexpected single frame delay"
+
+    ANIM=$(render_anim "format=gif")
+    test `echo $ANIM | jq '.conversion'` == "true"  || die "Conversion failed: $ANIM"
+    check_image $ANIM_FILE "gif 100x100"
+    check_gif $ANIM_FILE "100x100 frames: 2"
+    test `echo $ANIM | jq '.output_bytes'` == `stat -c %s $ANIM_FILE`  || die "output_bytes isn't the gif's size: $ANIM"
+    return 0
+}
+
+function test_gif_lossy()
+{
+    LOSSLESS=$(render_anim "format=gif&quantize=MEDIANCUT_FLOYD")
+    test `echo $LOSSLESS | jq '.conversion'` == "true"  || die "Conversion failed: $LOSSLESS"
+    LOSSLESS_BYTES=`stat -c %s $ANIM_FILE`
+
+    LOSSY=$(render_anim "format=gif&quantize=MEDIANCUT_FLOYD&gif_lossiness=80")
+    test `echo $LOSSY | jq '.conversion'` == "true"  || die "Lossy conversion failed: $LOSSY"
+    check_gif $ANIM_FILE "100x100 frames: 2"
+    test `stat -c %s $ANIM_FILE` -lt $LOSSLESS_BYTES  || die "Lossy gif no smaller than $LOSSLESS_BYTES bytes: `stat -c %s $ANIM_FILE`"
+    return 0
+}
+
+function test_apng_webp()
+{
+    APNG=$(render_anim "format=apng")
+    test `echo $APNG | jq '.conversion'` == "true"  || die "apng conversion failed: $APNG"
+    check_image $ANIM_FILE "apng 100x100 2"
+    test "`anim_delays $ANIM_FILE`" == "100 100"  || die "Unexpected apng delays: `anim_delays $ANIM_FILE`"
+
+    WEBP=$(render_anim "format=webp")
+    test `echo $WEBP | jq '.conversion'` == "true"  || die "webp conversion failed: $WEBP"
+    check_image $ANIM_FILE "webp 100x100 2"
+    test "`anim_delays $ANIM_FILE`" == "100 100"  || die "Unexpected webp delays: `anim_delays $ANIM_FILE`"
+
+    # apng is always animated, webp only with more than one snapshot
+    APNG=$(render_anim "format=apng&$STILL_JS")
+    test `echo $APNG | jq '.conversion'` == "true"  || die "Single frame apng failed: $APNG"
+    check_image $ANIM_FILE "apng 100x100 1"
+    test "`anim_delays $ANIM_FILE`" == "250"  || die "Unexpected apng delay: `anim_delays $ANIM_FILE`"
+    WEBP=$(render_anim "format=webp&$STILL_JS")
+    test `echo $WEBP | jq '.conversion'` == "true"  || die "Single frame webp failed: $WEBP"
+    check_image $ANIM_FILE "webp 100x100"
+    return 0
+}
+
+function test_png8()
+{
+    PNG8=$(render_anim "format=png8&$STILL_JS")
+    test `echo $PNG8 | jq '.conversion'` == "true"  || die "png8 conversion failed: $PNG8"
+    check_image $ANIM_FILE "png8 100x100"
+
+    PNG=$(render_anim "format=png&$STILL_JS&$SOLID_HTML")
+    test `echo $PNG | jq '.conversion'` == "true"  || die "png conversion failed: $PNG"
+    check_image $ANIM_FILE "png 100x100"
+
+    # one color loses nothing as png8
+    AUTO=$(render_anim "format=png&png8_auto=1&$STILL_JS&$SOLID_HTML")
+    test `echo $AUTO | jq '.conversion'` == "true"  || die "png8_auto conversion failed: $AUTO"
+    check_image $ANIM_FILE "png8 100x100"
+    return 0
+}
+
+function test_auto_format()
+{
+    for PAGE in "$SOLID_HTML" ""
+    do
+        AUTO=$(render_anim "format=auto&$STILL_JS&$PAGE")
+        test `echo $AUTO | jq '.conversion'` == "true"  || die "format=auto conversion failed: $AUTO"
+        AUTO_FORMAT=`echo $AUTO | jq -r '.format'`
+        echo "png8 png jpg webp" | grep -qw "$AUTO_FORMAT" || die "Unexpected format=auto format: $AUTO"
+        check_image $ANIM_FILE "$AUTO_FORMAT 100x100"
+    done
+    AUTO_BYTES=`stat -c %s $ANIM_FILE`
+
+    # a budget smaller than the first choice gets something smaller
+    BUDGET=$(render_anim "format=auto&auto_max_bytes=$(( AUTO_BYTES / 2 ))&auto_min_quality=10&$STILL_JS")
+    test `echo $BUDGET | jq '.conversion'` == "true"  || die "auto_max_bytes conversion failed: $BUDGET"
+    check_image $ANIM_FILE "`echo $BUDGET | jq -r '.format'` 100x100"
+    test `stat -c %s $ANIM_FILE` -lt $AUTO_BYTES  || die "auto_max_bytes of $(( AUTO_BYTES / 2 )) ignored: $BUDGET"
+    return 0
+}
+
+function test_stream()
+{
+    # several strips of 256 rows, the last one short
+    TALL_HTML="html=<html><body style='margin: 0;'><div style='height: 1000px; background-color: red;'></div><div style='height: 1000px; background-color: blue;'></div></body></html>"
+    for FORMAT in png jpg
+    do
+        STREAM=$(render_anim "format=$FORMAT&stream=1&height=-1&$TALL_HTML&$STILL_JS")
+        test `echo $STREAM | jq '.conversion'` == "true"  || die "Streamed $FORMAT conversion failed: $STREAM"
+        check_image $ANIM_FILE "$FORMAT 100x2000"
+    done
+    STREAM=$(render_anim "format=png&stream=1&height=-1&crop_x=10&crop_y=300&crop_w=50&crop_h=600&$TALL_HTML&$STILL_JS")
+    test `echo $STREAM | jq '.conversion'` == "true"  || die "Streamed crop failed: $STREAM"
+    check_image $ANIM_FILE "png 50x600"
+    return 0
+}
+
+function test_many_frames()
+{
+    # past the 32 frames between keyframes of the snapshot store, with
+    # the + of i++ form encoded
+    COUNT_JS="js=(function(){ichabod.setTransparent(0); for (var i = 0; i < 40; i%2B%2B) { document.getElementById('word').innerHTML = i; ichabod.snapshotPage(20); } ichabod.saveToOutput();})();"
+    MANY=$(render_anim "format=gif&$COUNT_JS")
+    test `echo $MANY | jq '.conversion'` == "true"  || die "40 frame gif failed: $MANY"
+    check_gif $ANIM_FILE "100x100 frames: 40"
+    MANY=$(render_anim "format=apng&$COUNT_JS")
+    test `echo $MANY | jq '.conversion'` == "true"  || die "40 frame apng failed: $MANY"
+    check_image $ANIM_FILE "apng 100x100 40"
+    return 0
+}
+
+function test_merge_frames()
+{
+    # the first two snapshots are the same, so show as one for longer
+    REPEAT_JS="js=(function(){ichabod.setTransparent(0); ichabod.snapshotPage(); ichabod.snapshotPage(50); document.getElementById('word').innerHTML='world'; ichabod.snapshotPage(); ichabod.saveToOutput();})();"
+    MERGED=$(render_anim "format=gif&$REPEAT_JS")
+    test `echo $MERGED | jq '.conversion'` == "true"  || die "Conversion failed: $MERGED"
+    test "`echo $MERGED | jq -r '.warnings[0]'`" == "Merged 1 duplicate frames"  || die "Merge not reported: $MERGED"
+    check_gif $ANIM_FILE "100x100 frames: 2"
+    test "`./ichabod --gif-check=$ANIM_FILE | grep '^delays:'`" == "delays: 15 10"  || die "Unexpected merged delays"
+    MERGED=$(render_anim "format=webp&$REPEAT_JS")
+    test `echo $MERGED | jq '.conversion'` == "true"  || die "Conversion failed: $MERGED"
+    check_image $ANIM_FILE "webp 100x100 2"
+    test "`anim_delays $ANIM_FILE`" == "150 100"  || die "Unexpected merged webp delays: `anim_delays $ANIM_FILE`"
+    return 0
+}
+
+BOXES_HTML="html=<html><body style='margin: 0;'><div id='a' style='position: absolute; left: 10px; top: 10px; width: 20px; height: 20px; background-color: red;'></div><div id='b' class='box' style='position: absolute; left: 50px; top: 40px; width: 30px; height: 30px; background-color: blue;'></div></body></html>"
+
+function test_snapshot_elements()
+{
+    # the area covering both boxes, from (10, 10) to (80, 70)
+    ELEMENTS=$(render_anim "format=png&$BOXES_HTML&js=(function(){ichabod.snapshotElements(['a', 'b']); ichabod.saveToOutput();})();")
+    test `echo $ELEMENTS | jq '.conversion'` == "true"  || die "snapshotElements failed: $ELEMENTS"
+    check_image $ANIM_FILE "png 70x60"
+    # entries which aren't ids are css selectors
+    ELEMENTS=$(render_anim "format=png&$BOXES_HTML&js=(function(){ichabod.snapshotElements(['.box']); ichabod.saveToOutput();})();")
+    test `echo $ELEMENTS | jq '.conversion'` == "true"  || die "snapshotElements with a selector failed: $ELEMENTS"
+    check_image $ANIM_FILE "png 30x30"
+    return 0
+}
+
+function test_selectors()
+{
+    SELECTORS=$(render_anim "format=png&output=$HELLO_FILE&$BOXES_HTML&selectors=[\"#a\", \".box\"]&$STILL_JS")
+    test `echo $SELECTORS | jq '.conversion'` == "true"  || die "selectors failed: $SELECTORS"
+    test `echo $SELECTORS | jq '.elements | length'` == "2"  || die "Expected 2 elements: $SELECTORS"
+    test "`echo $SELECTORS | jq -c '[.elements[1].left, .elements[1].top, .elements[1].width, .elements[1].height]'`" == "[50,40,30,30]"  || die "Unexpected element: $SELECTORS"
+    check_image ${HELLO_FILE%.png}_0.png "png 20x20"
+    check_image ${HELLO_FILE%.png}_1.png "png 30x30"
+    test `echo $SELECTORS | jq -r '.elements[1].path'` == "${HELLO_FILE%.png}_1.png"  || die "Unexpected element path: $SELECTORS"
+
+    # both boxes side by side, with a gap, in one sheet
+    SPRITE=$(render_anim "format=png&output=$HELLO_FILE&$BOXES_HTML&selectors=[\"#a\", \".box\"]&sprite=1&$STILL_JS")
+    test `echo $SPRITE | jq '.conversion'` == "true"  || die "sprite failed: $SPRITE"
+    test `echo $SPRITE | jq '.elements[1] | has("x") and has("y")'` == "true"  || die "No sprite position: $SPRITE"
+    test "`image_info $HELLO_FILE | cut -d' ' -f1`" == "png"  || die "Sprite sheet isn't a png: [$HELLO_FILE]"
+    return 0
+}
+
+function test_widths()
+{
+    WIDTHS=$(render_anim "format=png&output=$HELLO_FILE&$SOLID_HTML&widths=[50, 80]&$STILL_JS")
+    test `echo $WIDTHS | jq '.conversion'` == "true"  || die "widths failed: $WIDTHS"
+    test "`echo $WIDTHS | jq -c '[.renders[] | [.width, .image_width, .image_height]]'`" == "[[50,50,100],[80,80,100]]"  || die "Unexpected renders: $WIDTHS"
+    check_image ${HELLO_FILE%.png}_50.png "png 50x100"
+    check_image ${HELLO_FILE%.png}_80.png "png 80x100"
+    return 0
+}
+
+function test_outputs()
+{
+    BASE=${HELLO_FILE%.png}
+    OUTPUTS=$(render_anim "format=png&$STILL_JS&outputs=[{\"path\": \"${BASE}_full.png\"}, {\"path\": \"${BASE}_thumb.jpg\", \"format\": \"jpg\", \"quality\": 70, \"scale\": 0.5}, {\"path\": \"${BASE}_logo.gif\", \"format\": \"gif\", \"crop\": [0, 0, 40, 20]}]")
+    test `echo $OUTPUTS | jq '.conversion'` == "true"  || die "outputs failed: $OUTPUTS"
+    test "`echo $OUTPUTS | jq -c '[.outputs[] | [.format, .width, .height]]'`" == '[["png",100,100],["jpg",50,50],["gif",40,20]]'  || die "Unexpected outputs: $OUTPUTS"
+    check_image ${BASE}_full.png "png 100x100"
+    check_image ${BASE}_thumb.jpg "jpg 50x50"
+    check_image ${BASE}_logo.gif "gif 40x20"
+    check_gif ${BASE}_logo.gif "40x20 frames: 1"
+
+    # wrongly typed fields are refused rather than read
+    for BAD in '{"path": "x.png", "format": 5}' '{"path": "x.png", "quality": "x"}' '{"path": "x.png", "quality": 1e20}' \
+               '{"path": "x.png", "crop": ["a", 0, 1, 1]}' '{"path": "x.png", "crop": [0, 0, 0, 10]}' '{"path": "x.png", "scale": "x"}' \
+               '{"path": "x.png", "format": "apng"}'
+    do
+        OUTPUTS=$(render_anim "format=png&$STILL_JS&outputs=[$BAD]")
+        test `echo $OUTPUTS | jq '.conversion'` == "false"  || die "Bad outputs accepted: $BAD $OUTPUTS"
+        echo $OUTPUTS | jq -r '.errors[0]' | grep -q "^outputs" || die "Unexpected error for outputs $BAD: $OUTPUTS"
+    done
+    OUTPUTS=$(render_anim "format=apng&$STILL_JS&outputs=[{\"path\": \"${BASE}_full.png\"}]")
+    test "`echo $OUTPUTS | jq -r '.errors[0]'`" == "outputs need a still format, not apng"  || die "apng outputs accepted: $OUTPUTS"
+
+    # a crop which misses the image isn't written as the whole image
+    rm -f ${BASE}_full.png
+    OUTPUTS=$(render_anim "format=png&$STILL_JS&outputs=[{\"path\": \"${BASE}_full.png\", \"crop\": [500, 500, 10, 10]}]")
+    echo $OUTPUTS | jq -r '.errors[0]' | grep -q "^Crop 500,500 10x10 of output .* is outside the 100x100 image$" || die "Crop outside the image not reported: $OUTPUTS"
+    test -f ${BASE}_full.png && die "Crop outside the image written"
+    return 0
+}
+
+function test_scale()
+{
+    SCALED=$(render_anim "format=png&scale=0.5&$STILL_JS")
+    test `echo $SCALED | jq '.conversion'` == "true"  || die "scale failed: $SCALED"
+    check_image $ANIM_FILE "png 50x50"
+    SCALED=$(render_anim "format=png&scale=0.5&max_width=30&$STILL_JS")
+    test `echo $SCALED | jq '.conversion'` == "true"  || die "max_width failed: $SCALED"
+    check_image $ANIM_FILE "png 30x30"
+    SCALED=$(render_anim "format=jpg&max_height=20&$STILL_JS")
+    test `echo $SCALED | jq '.conversion'` == "true"  || die "max_height failed: $SCALED"
+    check_image $ANIM_FILE "jpg 20x20"
+    # every frame of an animation
+    SCALED=$(render_anim "format=gif&scale=0.5")
+    test `echo $SCALED | jq '.conversion'` == "true"  || die "Scaled gif failed: $SCALED"
+    check_gif $ANIM_FILE "50x50 frames: 2"
+    return 0
+}
+
+function test_device_scale_factor()
+{
+    RATIO_JS="js=(function(){ichabod.snapshotPage(); ichabod.saveToOutput(); return window.devicePixelRatio;})();"
+    RETINA=$(render_anim "format=png&device_scale_factor=2&$RATIO_JS")
+    test `echo $RETINA | jq '.conversion'` == "true"  || die "device_scale_factor failed: $RETINA"
+    test `echo $RETINA | jq '.result'` == "2"  || die "Unexpected devicePixelRatio: $RETINA"
+    check_image $ANIM_FILE "png 200x200"
+    # crops are in css pixels
+    RETINA=$(render_anim "format=png&device_scale_factor=2&crop_x=10&crop_y=10&crop_w=50&crop_h=20&$STILL_JS")
+    test `echo $RETINA | jq '.conversion'` == "true"  || die "device_scale_factor crop failed: $RETINA"
+    check_image $ANIM_FILE "png 100x40"
+    RETINA=$(render_anim "format=gif&device_scale_factor=2")
+    test `echo $RETINA | jq '.conversion'` == "true"  || die "device_scale_factor gif failed: $RETINA"
+    check_gif $ANIM_FILE "200x200 frames: 2"
+    RETINA=$(render_anim "format=png&device_scale_factor=5&$STILL_JS")
+    test "`echo $RETINA | jq -r '.errors[0]'`" == "device_scale_factor must be above 0 and at most 4"  || die "device_scale_factor of 5 accepted: $RETINA"
+    return 0
+}
+
+function test_fsync()
+{
+    for POLICY in "--fsync=none" "--fsync=always" "--fsync=batch --fsync-batch-ms=5"
+    do
+        start_other $POLICY
+        WRITTEN=$(render_anim "format=png&$STILL_JS" $OTHER_PORT)
+        stop_other
+        test `echo $WRITTEN | jq '.conversion'` == "true"  || die "Conversion with $POLICY failed: $WRITTEN"
+        test `echo $WRITTEN | jq '.write_elapsed | type'` == '"number"'  || die "No write_elapsed with $POLICY: $WRITTEN"
+        check_image $ANIM_FILE "png 100x100"
+        test `echo $WRITTEN | jq '.output_bytes'` == `stat -c %s $ANIM_FILE`  || die "output_bytes isn't the file's size with $POLICY: $WRITTEN"
+        ls -a | grep -q "^\.$ANIM_FILE\." && die "Temporary file left with $POLICY"
+    done
+    ./ichabod --fsync=sometimes > /dev/null 2>&1 && die "Unknown --fsync accepted"
+
+    # answered before the file is written
+    rm -f $ANIM_FILE
+    FORGOTTEN=$(render_anim "format=png&fire_and_forget=1&$STILL_JS")
+    test `echo $FORGOTTEN | jq '.conversion'` == "true"  || die "fire_and_forget failed: $FORGOTTEN"
+    test `echo $FORGOTTEN | jq '.write_elapsed'` == "0"  || die "Unexpected write_elapsed with fire_and_forget: $FORGOTTEN"
+    sleep 1
+    check_image $ANIM_FILE "png 100x100"
+    return 0
+}
+
+function test_autotrim()
+{
+    # the boxes cover (10, 10) to (80, 70) of a transparent page
+    TRIMMED=$(render_anim "format=png&autotrim=1&$BOXES_HTML&$STILL_JS")
+    test `echo $TRIMMED | jq '.conversion'` == "true"  || die "autotrim failed: $TRIMMED"
+    test `echo $TRIMMED | jq -c '.trim'` == "[10,10,70,60]"  || die "Unexpected trim: $TRIMMED"
+    check_image $ANIM_FILE "png 70x60"
+    TRIMMED=$(render_anim "format=jpg&transparent=0&autotrim=1&autotrim_tolerance=8&$BOXES_HTML&$STILL_JS")
+    test `echo $TRIMMED | jq '.conversion'` == "true"  || die "autotrim with a tolerance failed: $TRIMMED"
+    check_image $ANIM_FILE "jpg 70x60"
+    # every frame keeps what any of them holds
+    MOVE_JS="js=(function(){ichabod.snapshotPage(); document.getElementById('b').style.left = '60px'; ichabod.snapshotPage(); ichabod.saveToOutput();})();"
+    TRIMMED=$(render_anim "format=gif&transparent=0&autotrim=1&$BOXES_HTML&$MOVE_JS")
+    test `echo $TRIMMED | jq '.conversion'` == "true"  || die "Animated autotrim failed: $TRIMMED"
+    test `echo $TRIMMED | jq -c '.trim'` == "[10,10,80,60]"  || die "Unexpected animated trim: $TRIMMED"
+    check_gif $ANIM_FILE "80x60 frames: 2"
     return 0
 }
 
@@ -122,6 +847,30 @@ EOF
 }
 
 test_simple
+test_timeline
+test_templates
+test_compressed
+test_socket
+test_quantize_threads
+test_quantizers
+test_gif_optimize
+test_gif_palette
+test_gif_encoder
+test_gif_lossy
+test_apng_webp
+test_png8
+test_auto_format
+test_stream
+test_many_frames
+test_merge_frames
+test_snapshot_elements
+test_selectors
+test_widths
+test_outputs
+test_scale
+test_device_scale_factor
+test_fsync
+test_autotrim
 test_wait
 cleanup
 echo -e "\e[32mTesting successful.\e[0m"
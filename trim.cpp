@@ -0,0 +1,152 @@
+#include "trim.h"
+#include "parallel.h"
+#include <QVector>
+#include <cstring>
+
+#define TRIM_BLOCK_PIXELS 16 // compared between checks for content
+
+// whether any of n bytes of a is further than tolerance from b
+static inline bool differs( const uchar* a, const uchar* b, int n, uchar tolerance )
+{
+    uchar bad = 0;
+    for ( int i = 0; i < n; ++i )
+    {
+        uchar d = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+        bad |= d > tolerance;
+    }
+    return bad;
+}
+
+// first pixel in [from, to) of row which isn't border, to if none
+static int firstContent( const uchar* row, const uchar* border, int from, int to, uchar tolerance )
+{
+    for ( int x = from; x < to; x += TRIM_BLOCK_PIXELS )
+    {
+        int end = qMin( to, x + TRIM_BLOCK_PIXELS );
+        if ( differs( row + x * 4, border + x * 4, ( end - x ) * 4, tolerance ) )
+        {
+            for ( int p = x; p < end; ++p )
+            {
+                if ( differs( row + p * 4, border + p * 4, 4, tolerance ) )
+                {
+                    return p;
+                }
+            }
+        }
+    }
+    return to;
+}
+
+// last pixel in [from, to) of row which isn't border, from - 1 if none
+static int lastContent( const uchar* row, const uchar* border, int from, int to, uchar tolerance )
+{
+    for ( int x = to; x > from; x -= TRIM_BLOCK_PIXELS )
+    {
+        int begin = qMax( from, x - TRIM_BLOCK_PIXELS );
+        if ( differs( row + begin * 4, border + begin * 4, ( x - begin ) * 4, tolerance ) )
+        {
+            for ( int p = x - 1; p >= begin; --p )
+            {
+                if ( differs( row + p * 4, border + p * 4, 4, tolerance ) )
+                {
+                    return p;
+                }
+            }
+        }
+    }
+    return from - 1;
+}
+
+// left and right edges of the content of rows [top, bottom], per band.
+// A band only looks at the pixels outside the edges it has found so far.
+class EdgeTask : public ParallelTask
+{
+public:
+    EdgeTask( const QImage& i, const uchar* b, uchar t, int tp, int bt, int bs )
+        : image(i), border(b), tolerance(t), top(tp), rows(bt - tp + 1), bands(bs),
+          lefts(bs, i.width()), rights(bs, -1)
+    {
+    }
+    void run( int band )
+    {
+        int begin, end;
+        bandRange( band, bands, rows, begin, end );
+        int width = image.width();
+        int left = width;
+        int right = -1;
+        for ( int y = top + begin; y < top + end; ++y )
+        {
+            const uchar* row = image.scanLine( y );
+            left = firstContent( row, border, 0, left, tolerance );
+            right = qMax( right, lastContent( row, border, right + 1, width, tolerance ) );
+        }
+        lefts[band] = left;
+        rights[band] = right;
+    }
+    int left() const
+    {
+        int l = image.width();
+        for ( int i = 0; i < bands; ++i )
+        {
+            l = qMin( l, lefts[i] );
+        }
+        return l;
+    }
+    int right() const
+    {
+        int r = -1;
+        for ( int i = 0; i < bands; ++i )
+        {
+            r = qMax( r, rights[i] );
+        }
+        return r;
+    }
+private:
+    const QImage& image;
+    const uchar* border;
+    uchar tolerance;
+    int top;
+    int rows;
+    int bands;
+    QVector<int> lefts;
+    QVector<int> rights;
+};
+
+QRect trimRect( const QImage& source, int tolerance )
+{
+    if ( source.isNull() )
+    {
+        return QRect();
+    }
+    QImage image = source.depth() == 32 ? source : source.convertToFormat( QImage::Format_ARGB32_Premultiplied );
+    uchar tol = (uchar)qBound( 0, tolerance, 255 );
+    int width = image.width();
+    int height = image.height();
+    int bytes = width * 4;
+
+    // a row of the border color, compared byte for byte with each row
+    QVector<uchar> border( bytes );
+    for ( int x = 0; x < width; ++x )
+    {
+        memcpy( border.data() + x * 4, image.scanLine( 0 ), 4 );
+    }
+
+    int top = 0;
+    while ( top < height && !differs( image.scanLine( top ), border.constData(), bytes, tol ) )
+    {
+        ++top;
+    }
+    if ( top == height )
+    {
+        return QRect( 0, 0, 1, 1 );
+    }
+    int bottom = height - 1;
+    while ( !differs( image.scanLine( bottom ), border.constData(), bytes, tol ) )
+    {
+        --bottom;
+    }
+    int bands = bandCount( bottom - top + 1 );
+    EdgeTask task( image, border.constData(), tol, top, bottom, bands );
+    parallelRun( task, bands );
+    return QRect( QPoint( task.left(), top ), QPoint( task.right(), bottom ) );
+}
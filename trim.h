@@ -0,0 +1,18 @@
+#ifndef TRIM_H
+#define TRIM_H
+
+#include <QImage>
+#include <QRect>
+
+// Finds the content of an image inside a uniform border, for autotrim.
+// The border color is the top left pixel's, and a pixel is border when
+// every channel is within tolerance of it. Rows are compared a block of
+// bytes at a time against a row of the border color, loops which the
+// compiler vectorizes, stopping at the first block holding content.
+// The left and right edges are scanned in parallel bands.
+
+// bounding rect of the pixels which aren't border, or a 1x1 rect at
+// the origin when there are none
+QRect trimRect( const QImage& image, int tolerance = 0 );
+
+#endif
@@ -0,0 +1,440 @@
+#include "unixsocket.h"
+#include <QFile>
+#include <QVector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#define SOCKET_READ_BYTES 65536 // read at a time
+#define SOCKET_BACKLOG 16
+
+static void putU32( QByteArray& out, quint32 v )
+{
+    char b[4];
+    for ( int i = 0; i < 4; ++i )
+    {
+        b[i] = (char)( v >> ( i * 8 ) );
+    }
+    out.append( b, 4 );
+}
+
+static void putU64( QByteArray& out, quint64 v )
+{
+    char b[8];
+    for ( int i = 0; i < 8; ++i )
+    {
+        b[i] = (char)( v >> ( i * 8 ) );
+    }
+    out.append( b, 8 );
+}
+
+static quint32 getU32( const char* p )
+{
+    const uchar* u = (const uchar*)p;
+    return u[0] | ( u[1] << 8 ) | ( u[2] << 16 ) | ( (quint32)u[3] << 24 );
+}
+
+static quint64 getU64( const char* p )
+{
+    return getU32( p ) | ( (quint64)getU32( p + 4 ) << 32 );
+}
+
+static void putName( QByteArray& body, char kind, const char* name )
+{
+    int len = qMin( (int)strlen( name ), 255 );
+    body.append( kind );
+    body.append( (char)len );
+    body.append( name, len );
+}
+
+FrameField::FrameField()
+    : kind(0)
+    , i(0)
+    , d(0)
+{
+}
+
+QString FrameField::toString() const
+{
+    switch ( kind )
+    {
+    case 'i':
+        return QString::number( i );
+    case 'd':
+        return QString::number( d, 'g', 17 );
+    }
+    return QString::fromUtf8( bytes.constData(), bytes.size() );
+}
+
+bool parseFrame( const QByteArray& body, QList<FrameField>& fields )
+{
+    const char* p = body.constData();
+    const char* end = p + body.size();
+    while ( p < end )
+    {
+        if ( end - p < 2 || end - p - 2 < (uchar)p[1] )
+        {
+            return false;
+        }
+        FrameField f;
+        f.kind = p[0];
+        f.name = QByteArray( p + 2, (uchar)p[1] );
+        p += 2 + (uchar)p[1];
+        switch ( f.kind )
+        {
+        case 'i':
+        case 'd':
+        {
+            if ( end - p < 8 )
+            {
+                return false;
+            }
+            quint64 v = getU64( p );
+            if ( f.kind == 'i' )
+            {
+                f.i = (qint64)v;
+            }
+            else
+            {
+                memcpy( &f.d, &v, 8 );
+            }
+            p += 8;
+            break;
+        }
+        case 'b':
+        {
+            if ( end - p < 4 || (quint64)( end - p - 4 ) < getU32( p ) )
+            {
+                return false;
+            }
+            quint32 len = getU32( p );
+            f.bytes = QByteArray::fromRawData( p + 4, len );
+            p += 4 + len;
+            break;
+        }
+        default:
+            return false;
+        }
+        fields.append( f );
+    }
+    return true;
+}
+
+void appendInt( QByteArray& body, const char* name, qint64 i )
+{
+    putName( body, 'i', name );
+    putU64( body, (quint64)i );
+}
+
+void appendDouble( QByteArray& body, const char* name, double d )
+{
+    quint64 v;
+    memcpy( &v, &d, 8 );
+    putName( body, 'd', name );
+    putU64( body, v );
+}
+
+void appendBytes( QByteArray& body, const char* name, const QByteArray& bytes )
+{
+    putName( body, 'b', name );
+    putU32( body, bytes.size() );
+    body.append( bytes );
+}
+
+SocketServer::SocketServer()
+    : listen_fd(-1)
+    , next_id(1)
+{
+}
+
+SocketServer::~SocketServer()
+{
+    QList<int> ids = clients.keys();
+    for ( int i = 0; i < ids.size(); ++i )
+    {
+        drop( ids[i] );
+    }
+    if ( listen_fd >= 0 )
+    {
+        close( listen_fd );
+        unlink( socket_path.constData() );
+    }
+}
+
+bool SocketServer::listen( const QString& path, QString& error )
+{
+    socket_path = QFile::encodeName( path );
+    sockaddr_un addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    if ( socket_path.size() >= (int)sizeof(addr.sun_path) )
+    {
+        error = "path too long";
+        return false;
+    }
+    memcpy( addr.sun_path, socket_path.constData(), socket_path.size() );
+    listen_fd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if ( listen_fd < 0 )
+    {
+        error = strerror( errno );
+        return false;
+    }
+    // left behind by a server which didn't exit cleanly
+    unlink( socket_path.constData() );
+    if ( bind( listen_fd, (sockaddr*)&addr, sizeof(addr) ) != 0 || ::listen( listen_fd, SOCKET_BACKLOG ) != 0 )
+    {
+        error = strerror( errno );
+        close( listen_fd );
+        listen_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void SocketServer::poll( int timeout_ms, QList<SocketRequest>& requests )
+{
+    QVector<pollfd> fds;
+    QVector<int> ids;
+    pollfd lfd;
+    lfd.fd = listen_fd;
+    lfd.events = POLLIN;
+    lfd.revents = 0;
+    fds.append( lfd );
+    ids.append( 0 );
+    for ( QMap<int, Client>::const_iterator it = clients.begin(); it != clients.end(); ++it )
+    {
+        pollfd cfd;
+        cfd.fd = it.value().fd;
+        cfd.events = ( it.value().read_closed ? 0 : POLLIN ) | ( it.value().out.size() ? POLLOUT : 0 );
+        cfd.revents = 0;
+        fds.append( cfd );
+        ids.append( it.key() );
+    }
+    if ( ::poll( fds.data(), fds.size(), timeout_ms ) <= 0 )
+    {
+        return;
+    }
+    for ( int i = 1; i < fds.size(); ++i )
+    {
+        if ( !fds[i].revents || !clients.contains( ids[i] ) )
+        {
+            continue;
+        }
+        Client& c = clients[ids[i]];
+        bool ok = true;
+        if ( fds[i].revents & POLLOUT )
+        {
+            ok = writeTo( c );
+        }
+        if ( ok && c.read_closed && ( fds[i].revents & ( POLLHUP | POLLERR ) ) )
+        {
+            ok = false; // gone altogether, nothing more can reach it
+        }
+        else if ( ok && ( fds[i].revents & ( POLLIN | POLLHUP | POLLERR ) ) )
+        {
+            ok = readFrom( ids[i], c, requests );
+        }
+        if ( !ok || finished( c ) )
+        {
+            drop( ids[i] );
+        }
+    }
+    if ( fds[0].revents & POLLIN )
+    {
+        accept();
+    }
+}
+
+static void closeAll( const QVector<int>& fds )
+{
+    for ( int i = 0; i < fds.size(); ++i )
+    {
+        close( fds[i] );
+    }
+}
+
+// send up to size bytes, with fds attached when there are any
+static ssize_t sendWith( int fd, const char* data, size_t size, const QVector<int>& fds )
+{
+    if ( fds.isEmpty() )
+    {
+        return send( fd, data, size, MSG_NOSIGNAL );
+    }
+    iovec iov;
+    iov.iov_base = (void*)data;
+    iov.iov_len = size;
+    QByteArray control( CMSG_SPACE( fds.size() * sizeof(int) ), 0 );
+    msghdr msg;
+    memset( &msg, 0, sizeof(msg) );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    cmsghdr* cmsg = CMSG_FIRSTHDR( &msg );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN( fds.size() * sizeof(int) );
+    memcpy( CMSG_DATA( cmsg ), fds.constData(), fds.size() * sizeof(int) );
+    return sendmsg( fd, &msg, MSG_NOSIGNAL );
+}
+
+void SocketServer::respond( int client, const QByteArray& body, const QVector<int>& fds )
+{
+    if ( !clients.contains( client ) )
+    {
+        closeAll( fds );
+        return;
+    }
+    Client& c = clients[client];
+    --c.pending;
+    if ( fds.size() )
+    {
+        c.fds.append( qMakePair( c.out.size(), fds ) );
+    }
+    putU32( c.out, body.size() );
+    c.out.append( body );
+    if ( !writeTo( c ) || finished( c ) )
+    {
+        drop( client );
+    }
+}
+
+void SocketServer::accept()
+{
+    for ( ;; )
+    {
+        int fd = accept4( listen_fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC );
+        if ( fd < 0 )
+        {
+            return;
+        }
+        Client c;
+        c.fd = fd;
+        c.sent = 0;
+        c.read_closed = false;
+        c.pending = 0;
+        clients.insert( next_id++, c );
+    }
+}
+
+// false once the client is gone or sent something which isn't a frame.
+// A client which shuts down its side still gets answers to the whole
+// frames it sent; a frame it cut short is dropped.
+bool SocketServer::readFrom( int id, Client& c, QList<SocketRequest>& requests )
+{
+    while ( !c.read_closed )
+    {
+        int have = c.in.size();
+        c.in.resize( have + SOCKET_READ_BYTES );
+        ssize_t n = recv( c.fd, c.in.data() + have, SOCKET_READ_BYTES, 0 );
+        c.in.resize( have + qMax( (ssize_t)0, n ) );
+        if ( n < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+        {
+            break;
+        }
+        if ( n < 0 )
+        {
+            return false;
+        }
+        if ( n == 0 )
+        {
+            c.read_closed = true;
+        }
+    }
+    int used = 0;
+    while ( c.in.size() - used >= 4 )
+    {
+        quint32 len = getU32( c.in.constData() + used );
+        if ( len > FRAME_MAX_BYTES )
+        {
+            return false;
+        }
+        if ( (quint32)( c.in.size() - used - 4 ) < len )
+        {
+            break;
+        }
+        SocketRequest r;
+        r.client = id;
+        r.body = c.in.mid( used + 4, len );
+        requests.append( r );
+        ++c.pending;
+        used += 4 + len;
+    }
+    c.in.remove( 0, used );
+    if ( c.read_closed )
+    {
+        c.in.clear();
+    }
+    return true;
+}
+
+// answered everything it sent before shutting down its side
+bool SocketServer::finished( const Client& c )
+{
+    return c.read_closed && !c.pending && c.out.isEmpty();
+}
+
+// false once the client is gone
+bool SocketServer::writeTo( Client& c )
+{
+    while ( c.sent < c.out.size() )
+    {
+        // descriptors go with the first byte of their frame, so a send
+        // stops short of the next frame which has any, including the
+        // one after a frame whose descriptors go with this send
+        int end = c.out.size();
+        QVector<int> fds;
+        int next = 0;
+        if ( c.fds.size() && c.fds.first().first == c.sent )
+        {
+            fds = c.fds.first().second;
+            next = 1;
+        }
+        if ( c.fds.size() > next )
+        {
+            end = c.fds[next].first;
+        }
+        ssize_t n = sendWith( c.fd, c.out.constData() + c.sent, end - c.sent, fds );
+        if ( n < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+        {
+            return true;
+        }
+        if ( n <= 0 )
+        {
+            return false;
+        }
+        if ( fds.size() )
+        {
+            // the client has its own copies now
+            closeAll( fds );
+            c.fds.removeFirst();
+        }
+        c.sent += n;
+    }
+    c.out.clear();
+    c.sent = 0;
+    return true;
+}
+
+void SocketServer::drop( int id )
+{
+    Client& c = clients[id];
+    for ( int i = 0; i < c.fds.size(); ++i )
+    {
+        closeAll( c.fds[i].second );
+    }
+    close( c.fd );
+    clients.remove( id );
+}
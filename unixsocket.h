@@ -0,0 +1,97 @@
+#ifndef UNIXSOCKET_H
+#define UNIXSOCKET_H
+
+#include <QString>
+#include <QByteArray>
+#include <QList>
+#include <QMap>
+#include <QVector>
+#include <QPair>
+
+// Binary protocol on a unix domain socket, for local clients which would
+// rather not form-encode html and base64 images. A client sends a frame
+// of named fields, the same names and meanings as the http variables,
+// and gets one frame back per request, in order. All integers are little
+// endian:
+//
+//   frame:  u32 length of the body, then the body
+//   body:   fields, one after another
+//   field:  u8 kind, u8 name length, name, value
+//   kind i: i64 value
+//   kind d: f64 value
+//   kind b: u32 length, then that many bytes (utf-8 for text)
+//
+// Files returned as shared memory (shm) are passed as descriptors with
+// the first byte of their frame, see sharedmem.h.
+
+// larger frames are refused and the connection closed
+#define FRAME_MAX_BYTES (256 << 20)
+
+// most descriptors passed with one frame, under the kernel's SCM_MAX_FD
+#define FRAME_MAX_FDS 250
+
+struct FrameField
+{
+    FrameField();
+    char kind; // 'i', 'd' or 'b'
+    QByteArray name;
+    qint64 i;
+    double d;
+    QByteArray bytes; // shares the frame's memory, see parseFrame
+    QString toString() const; // as an http variable would read
+};
+
+// fields of a frame body, false when it's malformed. Byte fields point
+// into body rather than copying it, so body has to outlive them.
+bool parseFrame( const QByteArray& body, QList<FrameField>& fields );
+
+// append a field to a frame body
+void appendInt( QByteArray& body, const char* name, qint64 i );
+void appendDouble( QByteArray& body, const char* name, double d );
+void appendBytes( QByteArray& body, const char* name, const QByteArray& bytes );
+
+// one request read off the socket
+struct SocketRequest
+{
+    int client; // to respond to
+    QByteArray body;
+};
+
+// Non-blocking listener, polled from the main loop next to mongoose
+class SocketServer
+{
+public:
+    SocketServer();
+    ~SocketServer();
+    // bind and listen at path, replacing a stale socket file there
+    bool listen( const QString& path, QString& error );
+    // wait up to timeout_ms for the socket, then accept, read and write
+    // whatever is ready. Whole frames are appended to requests.
+    void poll( int timeout_ms, QList<SocketRequest>& requests );
+    // queue a response body, sent as the client reads it, with fds
+    // passed along with its first byte (SCM_RIGHTS). The descriptors
+    // are closed here once sent, or when the client has gone.
+    void respond( int client, const QByteArray& body, const QVector<int>& fds = QVector<int>() );
+private:
+    struct Client
+    {
+        int fd;
+        QByteArray in;
+        QByteArray out;
+        int sent; // of out
+        QList<QPair<int, QVector<int> > > fds; // offsets in out of frames with descriptors
+        bool read_closed; // the client has shut down its side, answer and drop it
+        int pending;      // requests taken from the client and not yet answered
+    };
+    static bool finished( const Client& c );
+    void accept();
+    bool readFrom( int id, Client& c, QList<SocketRequest>& requests );
+    bool writeTo( Client& c );
+    void drop( int id );
+    int listen_fd;
+    QByteArray socket_path;
+    QMap<int, Client> clients;
+    int next_id;
+};
+
+#endif
@@ -0,0 +1,140 @@
+#include "vtime.h"
+#include <QWebFrame>
+#include <QVariant>
+
+#define VIRTUAL_CLOCK "__ichabod_clock"
+
+// ES3 so that it runs on the webkit we ship
+static const char* g_virtual_time_js =
+"(function() {"
+"  if ( window." VIRTUAL_CLOCK " ) { return; }"
+"  var RealDate = Date;"
+"  var start = new RealDate().getTime();"
+"  var now = start;"
+"  var timers = [];"
+"  var callbacks = [];"
+"  var next_id = 1;"
+"  var last_frame = 0;"
+"  var FRAME_MS = 1000 / 60;"
+""
+"  function VirtualDate( a, b, c, d, e, f, g ) {"
+"    if ( !( this instanceof VirtualDate ) ) { return new RealDate( now ).toString(); }"
+"    switch ( arguments.length ) {"
+"      case 0: return new RealDate( now );"
+"      case 1: return new RealDate( a );"
+"      case 2: return new RealDate( a, b );"
+"      case 3: return new RealDate( a, b, c );"
+"      case 4: return new RealDate( a, b, c, d );"
+"      case 5: return new RealDate( a, b, c, d, e );"
+"      case 6: return new RealDate( a, b, c, d, e, f );"
+"      default: return new RealDate( a, b, c, d, e, f, g );"
+"    }"
+"  }"
+"  VirtualDate.prototype = RealDate.prototype;"
+"  VirtualDate.now = function() { return now; };"
+"  VirtualDate.parse = RealDate.parse;"
+"  VirtualDate.UTC = RealDate.UTC;"
+"  window.Date = VirtualDate;"
+""
+"  function addTimer( fn, ms, args, repeat ) {"
+"    if ( typeof fn != 'function' ) { var code = String( fn ); fn = function() { window.eval( code ); }; }"
+"    ms = Math.max( 0, Number( ms ) || 0 );"
+"    var id = next_id++;"
+"    timers.push( { id: id, fn: fn, at: now + ms, ms: ms, args: args, repeat: repeat } );"
+"    return id;"
+"  }"
+"  function removeTimer( id ) {"
+"    for ( var i = 0; i < timers.length; ++i ) {"
+"      if ( timers[i].id == id ) { timers.splice( i, 1 ); return; }"
+"    }"
+"  }"
+"  window.setTimeout = function( fn, ms ) { return addTimer( fn, ms, Array.prototype.slice.call( arguments, 2 ), false ); };"
+"  window.setInterval = function( fn, ms ) { return addTimer( fn, ms, Array.prototype.slice.call( arguments, 2 ), true ); };"
+"  window.clearTimeout = removeTimer;"
+"  window.clearInterval = removeTimer;"
+""
+"  function requestFrame( fn ) { var id = next_id++; callbacks.push( { id: id, fn: fn } ); return id; }"
+"  function cancelFrame( id ) {"
+"    for ( var i = 0; i < callbacks.length; ++i ) {"
+"      if ( callbacks[i].id == id ) { callbacks.splice( i, 1 ); return; }"
+"    }"
+"  }"
+"  window.requestAnimationFrame = window.webkitRequestAnimationFrame = requestFrame;"
+"  window.cancelAnimationFrame = window.webkitCancelAnimationFrame = cancelFrame;"
+"  try { if ( window.performance ) { window.performance.now = function() { return now - start; }; } } catch ( e ) {}"
+""
+"  function run( fn, args ) {"
+"    try { fn.apply( window, args ); } catch ( e ) { if ( window.console ) { console.log( 'virtual time: ' + e ); } }"
+"  }"
+"  // due timers in order of time, then of creation\n"
+"  function runTimers( until ) {"
+"    for ( var fired = 0; fired < 100000; ++fired ) {"
+"      var due = null;"
+"      for ( var i = 0; i < timers.length; ++i ) {"
+"        if ( timers[i].at <= until && ( !due || timers[i].at < due.at ) ) { due = timers[i]; }"
+"      }"
+"      if ( !due ) { return; }"
+"      now = Math.max( now, due.at );"
+"      if ( due.repeat ) { due.at = now + Math.max( due.ms, 1 ); } else { removeTimer( due.id ); }"
+"      run( due.fn, due.args );"
+"    }"
+"  }"
+"  function runFrames() {"
+"    var due = callbacks;"
+"    callbacks = [];"
+"    for ( var i = 0; i < due.length; ++i ) { run( due[i].fn, [ now - start ] ); }"
+"  }"
+""
+"  // pin css animations to the clock: paused, and started as far in the\n"
+"  // past as the clock has moved\n"
+"  function seekAnimations( elapsed ) {"
+"    var all = document.getElementsByTagName( '*' );"
+"    for ( var i = 0; i < all.length; ++i ) {"
+"      var el = all[i];"
+"      var saved = el." VIRTUAL_CLOCK "_animation;"
+"      if ( !saved ) {"
+"        var style = window.getComputedStyle( el, null );"
+"        if ( !style ) { continue; }"
+"        var name = style.getPropertyValue( '-webkit-animation-name' );"
+"        if ( !name || name == 'none' ) { continue; }"
+"        var delay = parseFloat( style.getPropertyValue( '-webkit-animation-delay' ) ) || 0;"
+"        saved = el." VIRTUAL_CLOCK "_animation = { name: name, delay: delay * 1000 };"
+"      }"
+"      el.style.webkitAnimationName = 'none';"
+"      el.offsetWidth;"
+"      el.style.webkitAnimationPlayState = 'paused';"
+"      el.style.webkitAnimationDelay = ( saved.delay - elapsed ) + 'ms';"
+"      el.style.webkitAnimationName = saved.name;"
+"    }"
+"  }"
+""
+"  window." VIRTUAL_CLOCK " = {"
+"    advance: function( ms ) {"
+"      var target = now + Math.max( 0, Number( ms ) || 0 );"
+"      while ( now < target ) {"
+"        var step = Math.min( target, start + last_frame + FRAME_MS );"
+"        runTimers( step );"
+"        now = step;"
+"        if ( now - start >= last_frame + FRAME_MS ) { last_frame = now - start; runFrames(); }"
+"      }"
+"      runTimers( now );"
+"      seekAnimations( now - start );"
+"      return now - start;"
+"    }"
+"  };"
+"})();";
+
+bool hasVirtualTime( QWebFrame* frame )
+{
+    return frame->evaluateJavaScript( "typeof window." VIRTUAL_CLOCK " != 'undefined'" ).toBool();
+}
+
+void installVirtualTime( QWebFrame* frame )
+{
+    frame->evaluateJavaScript( g_virtual_time_js );
+}
+
+double advanceVirtualTime( QWebFrame* frame, double msec )
+{
+    return frame->evaluateJavaScript( QString( "window." VIRTUAL_CLOCK ".advance(%1)" ).arg( msec ) ).toDouble();
+}
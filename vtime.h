@@ -0,0 +1,25 @@
+#ifndef VTIME_H
+#define VTIME_H
+
+#include <QString>
+
+class QWebFrame;
+
+// Virtual time for pages. A script replaces Date, the timer functions,
+// requestAnimationFrame and performance.now with versions driven by a
+// clock which only moves when it's told to, and pins css animations to
+// that clock. Installed before the page's own scripts run, animations
+// can then be stepped through as fast as they render, and come out the
+// same every time.
+
+// true if the clock is installed in frame
+bool hasVirtualTime( QWebFrame* frame );
+
+// install the clock into frame, a no-op if it's already there
+void installVirtualTime( QWebFrame* frame );
+
+// move the clock forward, running due timers and animation frame
+// callbacks in order. Returns the virtual milliseconds since install.
+double advanceVirtualTime( QWebFrame* frame, double msec );
+
+#endif
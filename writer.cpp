@@ -0,0 +1,348 @@
+#include "writer.h"
+#include <QThread>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+#include <QList>
+#include <QSet>
+#include <QFile>
+#include <QFileInfo>
+#include <QElapsedTimer>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+WriteResult::WriteResult()
+    : bytes(0)
+    , ok(false)
+    , write_ms(0)
+    , finished(false)
+{
+}
+
+struct WriteJob
+{
+    WriteRef result;
+    QByteArray data;
+    timespec queued;
+    QByteArray target; // encoded path
+    QByteArray dir;
+    QByteArray temp;   // name the file is written under, empty while unnamed
+    int fd;
+};
+
+static double elapsedMs( const timespec& start )
+{
+    timespec end;
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    return ( end.tv_sec - start.tv_sec ) * 1000.0 + ( end.tv_nsec - start.tv_nsec ) / 1000000.0;
+}
+
+static void fail( WriteJob& job, const QString& what )
+{
+    job.result->ok = false;
+    job.result->error = QString("%1: %2 (%3)").arg(what).arg(job.result->path).arg(strerror( errno ));
+    if ( job.fd >= 0 )
+    {
+        close( job.fd );
+        job.fd = -1;
+    }
+    if ( job.temp.size() )
+    {
+        unlink( job.temp.constData() );
+    }
+}
+
+static void syncDir( const QByteArray& dir )
+{
+    int fd = open( dir.constData(), O_RDONLY | O_DIRECTORY );
+    if ( fd >= 0 )
+    {
+        fsync( fd );
+        close( fd );
+    }
+}
+
+class OutputWriter : public QThread
+{
+public:
+    OutputWriter()
+        : policy(FSYNC_NONE)
+        , batch_ms(5)
+        , stopping(false)
+        , unfinished(0)
+        , temp_count(0)
+    {
+        // umask can only be read by setting it, do it before there are
+        // other threads to race with
+        mode_t mask = umask( 0 );
+        umask( mask );
+        file_mode = 0666 & ~mask;
+    }
+    ~OutputWriter()
+    {
+        {
+            QMutexLocker lock( &mutex );
+            stopping = true;
+            wake.wakeOne();
+        }
+        wait();
+    }
+    void setPolicy( FsyncPolicy p, int ms )
+    {
+        QMutexLocker lock( &mutex );
+        policy = p;
+        batch_ms = ms;
+    }
+    void queue( const WriteJob& job )
+    {
+        QMutexLocker lock( &mutex );
+        jobs.append( job );
+        ++unfinished;
+        if ( !isRunning() )
+        {
+            start();
+        }
+        wake.wakeOne();
+    }
+    bool finished( const WriteRef& write )
+    {
+        QMutexLocker lock( &mutex );
+        return write->finished;
+    }
+    int pending()
+    {
+        QMutexLocker lock( &mutex );
+        return unfinished;
+    }
+protected:
+    void run()
+    {
+        for ( ;; )
+        {
+            QList<WriteJob> batch;
+            FsyncPolicy p;
+            {
+                QMutexLocker lock( &mutex );
+                while ( jobs.isEmpty() && !stopping )
+                {
+                    wake.wait( &mutex );
+                }
+                if ( jobs.isEmpty() )
+                {
+                    return;
+                }
+                if ( policy == FSYNC_BATCH && !stopping )
+                {
+                    // give the files of the next few requests a chance to
+                    // share the sync
+                    QElapsedTimer timer;
+                    timer.start();
+                    while ( !stopping && timer.elapsed() < batch_ms )
+                    {
+                        wake.wait( &mutex, (unsigned long)( batch_ms - timer.elapsed() ) );
+                    }
+                }
+                batch = jobs;
+                jobs.clear();
+                p = policy;
+            }
+            writeBatch( batch, p );
+            QMutexLocker lock( &mutex );
+            for ( int i = 0; i < batch.size(); ++i )
+            {
+                batch[i].result->finished = true;
+            }
+            unfinished -= batch.size();
+        }
+    }
+private:
+    bool writeTemp( WriteJob& job )
+    {
+        job.fd = -1;
+#ifdef O_TMPFILE
+        job.fd = open( job.dir.constData(), O_TMPFILE | O_WRONLY | O_CLOEXEC, file_mode );
+#endif
+        if ( job.fd < 0 )
+        {
+            // filesystem without O_TMPFILE, use a hidden name until renamed
+            job.temp = job.dir + "/." + QFile::encodeName( QFileInfo( job.result->path ).fileName() ) + ".XXXXXX";
+            job.fd = mkstemp( job.temp.data() );
+            if ( job.fd < 0 )
+            {
+                job.temp.clear();
+                fail( job, "Failure to open output file" );
+                return false;
+            }
+            fchmod( job.fd, file_mode );
+        }
+        const char* data = job.data.constData();
+        qint64 left = job.data.size();
+        while ( left > 0 )
+        {
+            ssize_t n = ::write( job.fd, data, left );
+            if ( n < 0 && errno == EINTR )
+            {
+                continue;
+            }
+            if ( n <= 0 )
+            {
+                fail( job, "Failure to write output file" );
+                return false;
+            }
+            data += n;
+            left -= n;
+        }
+        job.data.clear();
+        return true;
+    }
+    bool publish( WriteJob& job )
+    {
+        if ( job.temp.isEmpty() )
+        {
+            // an O_TMPFILE is linked in under a temp name first, as
+            // linkat can't replace an existing file but rename can
+            job.temp = job.dir + "/." + QFile::encodeName( QFileInfo( job.result->path ).fileName() )
+                + "." + QByteArray::number( (int)getpid() ) + "." + QByteArray::number( ++temp_count );
+            QByteArray proc = "/proc/self/fd/" + QByteArray::number( job.fd );
+            if ( linkat( AT_FDCWD, proc.constData(), AT_FDCWD, job.temp.constData(), AT_SYMLINK_FOLLOW ) != 0 )
+            {
+                job.temp.clear();
+                fail( job, "Failure to link output file" );
+                return false;
+            }
+        }
+        if ( rename( job.temp.constData(), job.target.constData() ) != 0 )
+        {
+            fail( job, "Failure to rename output file" );
+            return false;
+        }
+        close( job.fd );
+        job.fd = -1;
+        job.result->ok = true;
+        return true;
+    }
+    void writeBatch( QList<WriteJob>& batch, FsyncPolicy p )
+    {
+        QSet<dev_t> devices;
+        for ( int i = 0; i < batch.size(); ++i )
+        {
+            WriteJob& job = batch[i];
+            if ( !writeTemp( job ) )
+            {
+                continue;
+            }
+            if ( p == FSYNC_ALWAYS && fsync( job.fd ) != 0 )
+            {
+                fail( job, "Failure to sync output file" );
+            }
+        }
+        for ( int i = 0; i < batch.size() && p == FSYNC_BATCH; ++i )
+        {
+            // once every file is written, one sync per filesystem
+            struct stat st;
+            if ( batch[i].fd >= 0 && fstat( batch[i].fd, &st ) == 0 && !devices.contains( st.st_dev ) )
+            {
+                devices.insert( st.st_dev );
+#ifdef __linux__
+                syncfs( batch[i].fd );
+#else
+                sync();
+#endif
+            }
+        }
+        QSet<QByteArray> dirs;
+        for ( int i = 0; i < batch.size(); ++i )
+        {
+            WriteJob& job = batch[i];
+            if ( job.fd >= 0 && publish( job ) )
+            {
+                if ( p == FSYNC_ALWAYS )
+                {
+                    syncDir( job.dir );
+                }
+                else if ( p == FSYNC_BATCH )
+                {
+                    dirs.insert( job.dir );
+                }
+            }
+        }
+        for ( QSet<QByteArray>::const_iterator it = dirs.begin(); it != dirs.end(); ++it )
+        {
+            syncDir( *it );
+        }
+        for ( int i = 0; i < batch.size(); ++i )
+        {
+            batch[i].result->write_ms = elapsedMs( batch[i].queued );
+        }
+    }
+
+    QMutex mutex;
+    QWaitCondition wake;
+    QList<WriteJob> jobs;
+    FsyncPolicy policy;
+    int batch_ms;
+    bool stopping;
+    int unfinished;
+    int temp_count;
+    mode_t file_mode;
+};
+
+static OutputWriter* outputWriter()
+{
+    static OutputWriter writer;
+    return &writer;
+}
+
+bool setFsyncPolicy( const QString& name, int batch_ms )
+{
+    FsyncPolicy policy;
+    if ( name == "none" )
+    {
+        policy = FSYNC_NONE;
+    }
+    else if ( name == "always" )
+    {
+        policy = FSYNC_ALWAYS;
+    }
+    else if ( name == "batch" )
+    {
+        policy = FSYNC_BATCH;
+    }
+    else
+    {
+        return false;
+    }
+    outputWriter()->setPolicy( policy, batch_ms );
+    return true;
+}
+
+WriteRef writeOutput( const QString& path, const QByteArray& data )
+{
+    WriteJob job;
+    job.result = WriteRef( new WriteResult() );
+    job.result->path = path;
+    job.result->bytes = data.size();
+    job.data = data;
+    clock_gettime( CLOCK_MONOTONIC, &job.queued );
+    job.target = QFile::encodeName( path );
+    job.dir = QFile::encodeName( QFileInfo( path ).absolutePath() );
+    job.fd = -1;
+    outputWriter()->queue( job );
+    return job.result;
+}
+
+bool writeFinished( const WriteRef& write )
+{
+    return outputWriter()->finished( write );
+}
+
+int pendingWrites()
+{
+    return outputWriter()->pending();
+}
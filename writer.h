@@ -0,0 +1,49 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <QString>
+#include <QByteArray>
+#include <QSharedPointer>
+
+// Output files are written by a dedicated thread, so that rendering
+// never waits on the filesystem. Each file is written to an unnamed
+// temp file in its directory (O_TMPFILE, or a hidden temp name where
+// that isn't supported), synced as the fsync policy says, then renamed
+// over the destination: readers see the old file or the whole new one,
+// never a partial write.
+
+// when files are synced before their write counts as finished
+enum FsyncPolicy
+{
+    FSYNC_NONE,   // never, finished once renamed into place
+    FSYNC_ALWAYS, // each file and its directory
+    FSYNC_BATCH   // the files written together, once per filesystem
+};
+
+// by name: none, always or batch. In batch mode the writer waits up to
+// batch_ms for more files before syncing. False for an unknown name.
+bool setFsyncPolicy( const QString& name, int batch_ms );
+
+struct WriteResult
+{
+    WriteResult();
+    QString path;
+    qint64 bytes;    // of data, whether or not it was written
+    bool ok;
+    QString error;   // why it failed
+    double write_ms; // from being queued until finished
+    bool finished;   // guarded by the writer, see writeFinished
+};
+typedef QSharedPointer<WriteResult> WriteRef;
+
+// queue data to be written to path, returning straight away
+WriteRef writeOutput( const QString& path, const QByteArray& data );
+
+// whether the write is done, after which the rest of the result can
+// be read
+bool writeFinished( const WriteRef& write );
+
+// writes queued and not finished yet
+int pendingWrites();
+
+#endif
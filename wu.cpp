@@ -0,0 +1,319 @@
+#include "quant.h"
+
+/*
+** Xiaolin Wu's color quantizer, "Efficient Statistical Computations for
+** Optimal Color Quantization", Graphics Gems II, page 126. Colors are
+** binned into a 32x32x32 grid of cumulative moments, which makes the
+** variance of any box a handful of lookups. Boxes are then split along
+** whichever plane minimizes the summed variance, largest variance
+** first, until there are enough of them.
+*/
+
+#define WU_SIDE 33
+
+enum WuDirection
+{
+    WuDirection_RED,
+    WuDirection_GREEN,
+    WuDirection_BLUE
+};
+
+struct WuBox
+{
+    int r0, r1; // r0 exclusive, r1 inclusive
+    int g0, g1;
+    int b0, b1;
+    int vol;
+};
+
+struct WuMoments
+{
+    WuMoments()
+        : wt(WU_SIDE * WU_SIDE * WU_SIDE, 0)
+        , mr(WU_SIDE * WU_SIDE * WU_SIDE, 0)
+        , mg(WU_SIDE * WU_SIDE * WU_SIDE, 0)
+        , mb(WU_SIDE * WU_SIDE * WU_SIDE, 0)
+        , m2(WU_SIDE * WU_SIDE * WU_SIDE, 0.0)
+    {
+    }
+    QVector<qint64> wt;
+    QVector<qint64> mr;
+    QVector<qint64> mg;
+    QVector<qint64> mb;
+    QVector<double> m2;
+};
+
+static inline int ind( int r, int g, int b )
+{
+    return ( r * WU_SIDE + g ) * WU_SIDE + b;
+}
+
+template <class T>
+static T vol( const WuBox& c, const QVector<T>& m )
+{
+    return m[ind( c.r1, c.g1, c.b1 )] - m[ind( c.r1, c.g1, c.b0 )]
+        - m[ind( c.r1, c.g0, c.b1 )] + m[ind( c.r1, c.g0, c.b0 )]
+        - m[ind( c.r0, c.g1, c.b1 )] + m[ind( c.r0, c.g1, c.b0 )]
+        + m[ind( c.r0, c.g0, c.b1 )] - m[ind( c.r0, c.g0, c.b0 )];
+}
+
+// part of vol() which doesn't depend on the cut position
+static qint64 bottom( const WuBox& c, WuDirection dir, const QVector<qint64>& m )
+{
+    switch ( dir )
+    {
+    case WuDirection_RED:
+        return - m[ind( c.r0, c.g1, c.b1 )] + m[ind( c.r0, c.g1, c.b0 )]
+            + m[ind( c.r0, c.g0, c.b1 )] - m[ind( c.r0, c.g0, c.b0 )];
+    case WuDirection_GREEN:
+        return - m[ind( c.r1, c.g0, c.b1 )] + m[ind( c.r1, c.g0, c.b0 )]
+            + m[ind( c.r0, c.g0, c.b1 )] - m[ind( c.r0, c.g0, c.b0 )];
+    case WuDirection_BLUE:
+        return - m[ind( c.r1, c.g1, c.b0 )] + m[ind( c.r1, c.g0, c.b0 )]
+            + m[ind( c.r0, c.g1, c.b0 )] - m[ind( c.r0, c.g0, c.b0 )];
+    }
+    return 0;
+}
+
+// remainder of vol() with the cut at pos
+static qint64 top( const WuBox& c, WuDirection dir, int pos, const QVector<qint64>& m )
+{
+    switch ( dir )
+    {
+    case WuDirection_RED:
+        return m[ind( pos, c.g1, c.b1 )] - m[ind( pos, c.g1, c.b0 )]
+            - m[ind( pos, c.g0, c.b1 )] + m[ind( pos, c.g0, c.b0 )];
+    case WuDirection_GREEN:
+        return m[ind( c.r1, pos, c.b1 )] - m[ind( c.r1, pos, c.b0 )]
+            - m[ind( c.r0, pos, c.b1 )] + m[ind( c.r0, pos, c.b0 )];
+    case WuDirection_BLUE:
+        return m[ind( c.r1, c.g1, pos )] - m[ind( c.r1, c.g0, pos )]
+            - m[ind( c.r0, c.g1, pos )] + m[ind( c.r0, c.g0, pos )];
+    }
+    return 0;
+}
+
+static void histogram3d( WuMoments& m, const ColorHistogram& hist )
+{
+    for ( ColorHistogram::const_iterator it = hist.constBegin(); it != hist.constEnd(); ++it )
+    {
+        int r = qRed( it.key() );
+        int g = qGreen( it.key() );
+        int b = qBlue( it.key() );
+        qint64 n = it.value();
+        int i = ind( ( r >> 3 ) + 1, ( g >> 3 ) + 1, ( b >> 3 ) + 1 );
+        m.wt[i] += n;
+        m.mr[i] += r * n;
+        m.mg[i] += g * n;
+        m.mb[i] += b * n;
+        m.m2[i] += (double)n * ( r*r + g*g + b*b );
+    }
+}
+
+// turn per-bin moments into cumulative ones
+static void moments3d( WuMoments& m )
+{
+    qint64 area[WU_SIDE], area_r[WU_SIDE], area_g[WU_SIDE], area_b[WU_SIDE];
+    double area2[WU_SIDE];
+    for ( int r = 1; r < WU_SIDE; ++r )
+    {
+        for ( int i = 0; i < WU_SIDE; ++i )
+        {
+            area[i] = area_r[i] = area_g[i] = area_b[i] = 0;
+            area2[i] = 0.0;
+        }
+        for ( int g = 1; g < WU_SIDE; ++g )
+        {
+            qint64 line = 0, line_r = 0, line_g = 0, line_b = 0;
+            double line2 = 0.0;
+            for ( int b = 1; b < WU_SIDE; ++b )
+            {
+                int i1 = ind( r, g, b );
+                line += m.wt[i1];
+                line_r += m.mr[i1];
+                line_g += m.mg[i1];
+                line_b += m.mb[i1];
+                line2 += m.m2[i1];
+                area[b] += line;
+                area_r[b] += line_r;
+                area_g[b] += line_g;
+                area_b[b] += line_b;
+                area2[b] += line2;
+                int i2 = ind( r - 1, g, b );
+                m.wt[i1] = m.wt[i2] + area[b];
+                m.mr[i1] = m.mr[i2] + area_r[b];
+                m.mg[i1] = m.mg[i2] + area_g[b];
+                m.mb[i1] = m.mb[i2] + area_b[b];
+                m.m2[i1] = m.m2[i2] + area2[b];
+            }
+        }
+    }
+}
+
+static double variance( const WuBox& c, const WuMoments& m )
+{
+    double dr = (double)vol( c, m.mr );
+    double dg = (double)vol( c, m.mg );
+    double db = (double)vol( c, m.mb );
+    double xx = vol( c, m.m2 );
+    return xx - ( dr*dr + dg*dg + db*db ) / (double)vol( c, m.wt );
+}
+
+static double maximize( const WuBox& c, WuDirection dir, int first, int last, int& cut,
+                        qint64 whole_r, qint64 whole_g, qint64 whole_b, qint64 whole_w,
+                        const WuMoments& m )
+{
+    qint64 base_r = bottom( c, dir, m.mr );
+    qint64 base_g = bottom( c, dir, m.mg );
+    qint64 base_b = bottom( c, dir, m.mb );
+    qint64 base_w = bottom( c, dir, m.wt );
+    double max = 0.0;
+    cut = -1;
+    for ( int i = first; i < last; ++i )
+    {
+        double half_r = (double)( base_r + top( c, dir, i, m.mr ) );
+        double half_g = (double)( base_g + top( c, dir, i, m.mg ) );
+        double half_b = (double)( base_b + top( c, dir, i, m.mb ) );
+        double half_w = (double)( base_w + top( c, dir, i, m.wt ) );
+        if ( half_w == 0 )
+        {
+            continue; // never split into an empty box
+        }
+        double temp = ( half_r*half_r + half_g*half_g + half_b*half_b ) / half_w;
+        half_r = whole_r - half_r;
+        half_g = whole_g - half_g;
+        half_b = whole_b - half_b;
+        half_w = whole_w - half_w;
+        if ( half_w == 0 )
+        {
+            continue;
+        }
+        temp += ( half_r*half_r + half_g*half_g + half_b*half_b ) / half_w;
+        if ( temp > max )
+        {
+            max = temp;
+            cut = i;
+        }
+    }
+    return max;
+}
+
+static bool cut( WuBox& set1, WuBox& set2, const WuMoments& m )
+{
+    qint64 whole_r = vol( set1, m.mr );
+    qint64 whole_g = vol( set1, m.mg );
+    qint64 whole_b = vol( set1, m.mb );
+    qint64 whole_w = vol( set1, m.wt );
+
+    int cutr, cutg, cutb;
+    double maxr = maximize( set1, WuDirection_RED, set1.r0 + 1, set1.r1, cutr, whole_r, whole_g, whole_b, whole_w, m );
+    double maxg = maximize( set1, WuDirection_GREEN, set1.g0 + 1, set1.g1, cutg, whole_r, whole_g, whole_b, whole_w, m );
+    double maxb = maximize( set1, WuDirection_BLUE, set1.b0 + 1, set1.b1, cutb, whole_r, whole_g, whole_b, whole_w, m );
+
+    WuDirection dir;
+    if ( maxr >= maxg && maxr >= maxb )
+    {
+        dir = WuDirection_RED;
+        if ( cutr < 0 )
+        {
+            return false; // can't split the box
+        }
+    }
+    else if ( maxg >= maxr && maxg >= maxb )
+    {
+        dir = WuDirection_GREEN;
+    }
+    else
+    {
+        dir = WuDirection_BLUE;
+    }
+
+    set2.r1 = set1.r1;
+    set2.g1 = set1.g1;
+    set2.b1 = set1.b1;
+    switch ( dir )
+    {
+    case WuDirection_RED:
+        set2.r0 = set1.r1 = cutr;
+        set2.g0 = set1.g0;
+        set2.b0 = set1.b0;
+        break;
+    case WuDirection_GREEN:
+        set2.g0 = set1.g1 = cutg;
+        set2.r0 = set1.r0;
+        set2.b0 = set1.b0;
+        break;
+    case WuDirection_BLUE:
+        set2.b0 = set1.b1 = cutb;
+        set2.r0 = set1.r0;
+        set2.g0 = set1.g0;
+        break;
+    }
+    set1.vol = ( set1.r1 - set1.r0 ) * ( set1.g1 - set1.g0 ) * ( set1.b1 - set1.b0 );
+    set2.vol = ( set2.r1 - set2.r0 ) * ( set2.g1 - set2.g0 ) * ( set2.b1 - set2.b0 );
+    return true;
+}
+
+WuQuantizer::WuQuantizer( const QString& name, DitherMethod dither )
+    : Quantizer(name, dither)
+{
+}
+
+QVector<QRgb> WuQuantizer::buildPalette( const ColorHistogram& hist, int max_colors ) const
+{
+    WuMoments m;
+    histogram3d( m, hist );
+    moments3d( m );
+
+    QVector<WuBox> cube( max_colors );
+    QVector<double> vv( max_colors, 0.0 );
+    cube[0].r0 = cube[0].g0 = cube[0].b0 = 0;
+    cube[0].r1 = cube[0].g1 = cube[0].b1 = WU_SIDE - 1;
+    cube[0].vol = ( WU_SIDE - 1 ) * ( WU_SIDE - 1 ) * ( WU_SIDE - 1 );
+
+    int colors = max_colors;
+    int next = 0;
+    for ( int i = 1; i < colors; ++i )
+    {
+        if ( cut( cube[next], cube[i], m ) )
+        {
+            // volume test ensures we won't try to cut one-cell box
+            vv[next] = ( cube[next].vol > 1 ) ? variance( cube[next], m ) : 0.0;
+            vv[i] = ( cube[i].vol > 1 ) ? variance( cube[i], m ) : 0.0;
+        }
+        else
+        {
+            vv[next] = 0.0; // don't try to split this box again
+            --i;            // didn't create box i
+        }
+        next = 0;
+        double temp = vv[0];
+        for ( int k = 1; k <= i; ++k )
+        {
+            if ( vv[k] > temp )
+            {
+                temp = vv[k];
+                next = k;
+            }
+        }
+        if ( temp <= 0.0 )
+        {
+            colors = i + 1; // only got this many boxes
+            break;
+        }
+    }
+
+    QVector<QRgb> palette;
+    palette.reserve( colors );
+    for ( int k = 0; k < colors; ++k )
+    {
+        qint64 weight = vol( cube[k], m.wt );
+        if ( weight )
+        {
+            palette.push_back( qRgb( (int)( vol( cube[k], m.mr ) / weight ),
+                                     (int)( vol( cube[k], m.mg ) / weight ),
+                                     (int)( vol( cube[k], m.mb ) / weight ) ) );
+        }
+    }
+    return palette;
+}